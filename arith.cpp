@@ -0,0 +1,599 @@
+#include "arith.hpp"
+#include "variables.hpp"
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <cstring>
+
+// Compiled expressions kept; the cache starts over when it is full
+#define ARITH_CACHE_MAX 128
+
+// How deep variable values may refer to further expressions (a=b, b=a)
+#define ARITH_MAX_DEPTH 32
+
+/**
+ * Operation of a node of a compiled expression
+ */
+enum ArithOp {
+    AR_CONST,       // value
+    AR_VARIABLE,    // name
+    AR_NEGATE, AR_NOT, AR_COMPLEMENT,
+    AR_PRE_INCREMENT, AR_PRE_DECREMENT, AR_POST_INCREMENT, AR_POST_DECREMENT,
+    AR_POWER, AR_MULTIPLY, AR_DIVIDE, AR_MODULO, AR_ADD, AR_SUBTRACT,
+    AR_SHIFT_LEFT, AR_SHIFT_RIGHT, AR_LESS, AR_LESS_EQUAL, AR_GREATER, AR_GREATER_EQUAL,
+    AR_EQUAL, AR_NOT_EQUAL, AR_BIT_AND, AR_BIT_XOR, AR_BIT_OR,
+    AR_AND, AR_OR,  // Short-circuit
+    AR_CONDITION,   // left ? right : third
+    AR_ASSIGN,      // name = right, or name op= right with update as op
+    AR_COMMA
+};
+
+/**
+ * Node of a compiled expression, children are indices into the same vector
+ */
+struct ArithNode {
+    ArithOp op;
+    ArithOp update;         // AR_ASSIGN: operator of op=, AR_CONST for plain =
+    long long value;        // AR_CONST
+    std::string name;       // AR_VARIABLE, AR_ASSIGN and the ++/-- operators
+    int left, right, third;
+};
+
+/**
+ * Expression compiled into a tree of nodes
+ */
+struct ArithProgram {
+    std::vector<ArithNode> nodes;
+    int root = -1;
+    std::string error;      // Syntax error: the expression cannot be evaluated
+};
+
+// Binary operators by precedence level, lowest first; ** binds tighter, after the unary operators
+struct BinaryOperator {
+    const char* text;
+    ArithOp op;
+    int level;
+};
+
+static const BinaryOperator binaryOperators[] = {
+    // Longer spellings first, so "<<" is not taken for "<"
+    { "||", AR_OR, 1 }, { "&&", AR_AND, 2 }, { "==", AR_EQUAL, 6 }, { "!=", AR_NOT_EQUAL, 6 },
+    { "<=", AR_LESS_EQUAL, 7 }, { ">=", AR_GREATER_EQUAL, 7 }, { "<<", AR_SHIFT_LEFT, 8 },
+    { ">>", AR_SHIFT_RIGHT, 8 }, { "|", AR_BIT_OR, 3 }, { "^", AR_BIT_XOR, 4 }, { "&", AR_BIT_AND, 5 },
+    { "<", AR_LESS, 7 }, { ">", AR_GREATER, 7 }, { "+", AR_ADD, 9 }, { "-", AR_SUBTRACT, 9 },
+    { "*", AR_MULTIPLY, 10 }, { "/", AR_DIVIDE, 10 }, { "%", AR_MODULO, 10 },
+};
+
+static const BinaryOperator assignOperators[] = {
+    { "<<=", AR_SHIFT_LEFT, 0 }, { ">>=", AR_SHIFT_RIGHT, 0 }, { "+=", AR_ADD, 0 },
+    { "-=", AR_SUBTRACT, 0 }, { "*=", AR_MULTIPLY, 0 }, { "/=", AR_DIVIDE, 0 },
+    { "%=", AR_MODULO, 0 }, { "&=", AR_BIT_AND, 0 }, { "^=", AR_BIT_XOR, 0 },
+    { "|=", AR_BIT_OR, 0 }, { "=", AR_CONST, 0 },
+};
+
+#define BINARY_LEVEL_MAX 10
+
+/**
+ * Apply a binary operator (not && and ||) to two values
+ * +, - and * wrap around like the unsigned types, shift counts are taken
+ * modulo 64.
+ *
+ * @param error Output: message for division by 0 or a negative exponent
+ * @return false on such an error
+ */
+static bool applyBinary(ArithOp op, long long a, long long b, long long& result, std::string& error) {
+    typedef unsigned long long u64;
+    switch (op) {
+    case AR_ADD: result = (long long)((u64)a + (u64)b); return true;
+    case AR_SUBTRACT: result = (long long)((u64)a - (u64)b); return true;
+    case AR_MULTIPLY: result = (long long)((u64)a * (u64)b); return true;
+    case AR_DIVIDE:
+    case AR_MODULO:
+        if (b == 0) {
+            error = "division by 0";
+            return false;
+        }
+        // LLONG_MIN / -1 overflows: it wraps to LLONG_MIN, the remainder is 0
+        if (b == -1) result = op == AR_DIVIDE ? (long long)(0 - (u64)a) : 0;
+        else result = op == AR_DIVIDE ? a / b : a % b;
+        return true;
+    case AR_POWER: {
+        if (b < 0) {
+            error = "exponent less than 0";
+            return false;
+        }
+        u64 base = (u64)a, value = 1;
+        for (; b > 0; b >>= 1) {
+            if (b & 1) value *= base;
+            base *= base;
+        }
+        result = (long long)value;
+        return true;
+    }
+    case AR_SHIFT_LEFT: result = (long long)((u64)a << (b & 63)); return true;
+    case AR_SHIFT_RIGHT: result = a >> (b & 63); return true;
+    case AR_LESS: result = a < b; return true;
+    case AR_LESS_EQUAL: result = a <= b; return true;
+    case AR_GREATER: result = a > b; return true;
+    case AR_GREATER_EQUAL: result = a >= b; return true;
+    case AR_EQUAL: result = a == b; return true;
+    case AR_NOT_EQUAL: result = a != b; return true;
+    case AR_BIT_AND: result = a & b; return true;
+    case AR_BIT_XOR: result = a ^ b; return true;
+    case AR_BIT_OR: result = a | b; return true;
+    default: return false;
+    }
+}
+
+static long long applyUnary(ArithOp op, long long a) {
+    if (op == AR_NEGATE) return (long long)(0 - (unsigned long long)a);
+    if (op == AR_NOT) return !a;
+    return ~a;
+}
+
+static int digitValue(char c, int base) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 10;
+    // Up to base 36 case does not matter, above it A-Z, @ and _ are 36 to 63
+    if (c >= 'A' && c <= 'Z') return base <= 36 ? c - 'A' + 10 : c - 'A' + 36;
+    if (c == '@') return 62;
+    if (c == '_') return 63;
+    return 64;
+}
+
+static bool isNameStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool isNameChar(char c) {
+    return isNameStart(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * Parse a number: decimal, 0x hex, 0 octal or base#digits (base 2 to 64)
+ * Wraps around like the arithmetic itself.
+ *
+ * @param pos Start, moved past the number
+ * @return false if the digits do not fit the base
+ */
+static bool parseNumber(const std::string& text, size_t& pos, long long& value) {
+    size_t start = pos;
+    int base = 10;
+    while (pos < text.size() && isNameChar(text[pos])) pos++;
+    size_t hash = text.find('#', start);
+    if (hash == pos) {
+        base = 0;
+        for (size_t i = start; i < hash; i++) {
+            if (text[i] < '0' || text[i] > '9' || base > 64) return false;
+            base = base * 10 + (text[i] - '0');
+        }
+        if (base < 2 || base > 64) return false;
+        start = ++pos;
+        while (pos < text.size() && (isNameChar(text[pos]) || text[pos] == '@')) pos++;
+    } else if (pos - start > 1 && text[start] == '0' && (text[start + 1] == 'x' || text[start + 1] == 'X')) {
+        base = 16;
+        start += 2;
+    } else if (pos - start > 1 && text[start] == '0') {
+        base = 8;
+        start++;
+    }
+    if (start == pos) return false;
+
+    unsigned long long result = 0;
+    for (size_t i = start; i < pos; i++) {
+        int digit = digitValue(text[i], base);
+        if (digit >= base) return false;
+        result = result * base + digit;
+    }
+    value = (long long)result;
+    return true;
+}
+
+/**
+ * Recursive descent compiler, folds constant subexpressions as it builds
+ * the tree
+ */
+class ArithCompiler {
+public:
+    ArithCompiler(const std::string& text, ArithProgram& program) : text(text), pos(0), program(program) {}
+
+    void compile() {
+        int root = comma();
+        skipSpaces();
+        if (program.error.empty() && pos < text.size()) {
+            fail(std::string("syntax error near `") + text.substr(pos) + "'");
+        }
+        program.root = root;
+    }
+
+private:
+    const std::string& text;
+    size_t pos;
+    ArithProgram& program;
+
+    void fail(const std::string& message) {
+        if (program.error.empty()) program.error = message;
+    }
+
+    void skipSpaces() {
+        while (pos < text.size() && strchr(" \t\n\r", text[pos])) pos++;
+    }
+
+    bool match(const char* op) {
+        skipSpaces();
+        size_t len = strlen(op);
+        if (text.compare(pos, len, op) != 0) return false;
+        pos += len;
+        return true;
+    }
+
+    int add(const ArithNode& node) {
+        program.nodes.push_back(node);
+        return (int)program.nodes.size() - 1;
+    }
+
+    int node(ArithOp op, int left = -1, int right = -1, int third = -1) {
+        ArithNode n;
+        n.op = op;
+        n.update = AR_CONST;
+        n.value = 0;
+        n.left = left;
+        n.right = right;
+        n.third = third;
+        return add(n);
+    }
+
+    int constant(long long value) {
+        int index = node(AR_CONST);
+        program.nodes[index].value = value;
+        return index;
+    }
+
+    bool isConstant(int index) const {
+        return index >= 0 && program.nodes[index].op == AR_CONST;
+    }
+
+    long long valueOf(int index) const {
+        return program.nodes[index].value;
+    }
+
+    // Folded nodes stay in the vector unused; compiling happens once per text
+    int unary(ArithOp op, int operand) {
+        if (isConstant(operand)) return constant(applyUnary(op, valueOf(operand)));
+        return node(op, operand);
+    }
+
+    int binary(ArithOp op, int left, int right) {
+        if (op == AR_AND && isConstant(left)) {
+            if (!valueOf(left)) return constant(0);
+            if (isConstant(right)) return constant(valueOf(right) != 0);
+        }
+        if (op == AR_OR && isConstant(left)) {
+            if (valueOf(left)) return constant(1);
+            if (isConstant(right)) return constant(valueOf(right) != 0);
+        }
+        if (op != AR_AND && op != AR_OR && isConstant(left) && isConstant(right)) {
+            long long result;
+            std::string error;
+            // 1/0 is left for run time, where it is reported when it is reached
+            if (applyBinary(op, valueOf(left), valueOf(right), result, error)) return constant(result);
+        }
+        return node(op, left, right);
+    }
+
+    // expression , expression
+    int comma() {
+        int left = assignment();
+        while (program.error.empty() && match(",")) {
+            int right = assignment();
+            left = isConstant(left) ? right : node(AR_COMMA, left, right);
+        }
+        return left;
+    }
+
+    // name = expression, name op= expression
+    int assignment() {
+        skipSpaces();
+        size_t start = pos;
+        if (pos < text.size() && isNameStart(text[pos])) {
+            while (pos < text.size() && isNameChar(text[pos])) pos++;
+            std::string name = text.substr(start, pos - start);
+            skipSpaces();
+            for (const auto& op : assignOperators) {
+                size_t len = strlen(op.text);
+                if (text.compare(pos, len, op.text) != 0) continue;
+                // "==" is a comparison, not an assignment
+                if (op.op == AR_CONST && pos + 1 < text.size() && text[pos + 1] == '=') break;
+                pos += len;
+                int value = assignment();
+                int index = node(AR_ASSIGN, -1, value);
+                program.nodes[index].update = op.op;
+                program.nodes[index].name = name;
+                return index;
+            }
+        }
+        pos = start;
+        return condition();
+    }
+
+    // condition ? expression : condition
+    int condition() {
+        int test = binaryLevel(1);
+        if (!program.error.empty() || !match("?")) return test;
+        int yes = comma();
+        if (!match(":")) {
+            fail("`:' expected for conditional expression");
+            return test;
+        }
+        int no = condition();
+        if (isConstant(test)) return valueOf(test) ? yes : no;
+        return node(AR_CONDITION, test, yes, no);
+    }
+
+    // Binary operator at pos of the given level, not one of op=
+    const BinaryOperator* peekBinary(int level) {
+        skipSpaces();
+        for (const auto& op : binaryOperators) {
+            size_t len = strlen(op.text);
+            if (text.compare(pos, len, op.text) != 0) continue;
+            char next = pos + len < text.size() ? text[pos + len] : '\0';
+            // a += 1, a **= 2 and a ** 2 are not this operator
+            if (next == '=' && op.op != AR_EQUAL && op.op != AR_NOT_EQUAL && op.op != AR_LESS_EQUAL &&
+                op.op != AR_GREATER_EQUAL) {
+                return nullptr;
+            }
+            if (op.op == AR_MULTIPLY && next == '*') return nullptr;
+            return op.level == level ? &op : nullptr;
+        }
+        return nullptr;
+    }
+
+    // Left-associative binary operators, level 1 (||) to 10 (* / %)
+    int binaryLevel(int level) {
+        if (level > BINARY_LEVEL_MAX) return power();
+        int left = binaryLevel(level + 1);
+        while (program.error.empty()) {
+            const BinaryOperator* op = peekBinary(level);
+            if (!op) break;
+            pos += strlen(op->text);
+            int right = binaryLevel(level + 1);
+            left = binary(op->op, left, right);
+        }
+        return left;
+    }
+
+    // ** (right-associative), its operands may have prefix operators: -2**2 is 4
+    int power() {
+        int base = unaryExpression();
+        if (program.error.empty() && match("**")) {
+            return binary(AR_POWER, base, power());
+        }
+        return base;
+    }
+
+    // Prefix operators
+    int unaryExpression() {
+        skipSpaces();
+        if (match("++") || match("--")) {
+            bool increment = text[pos - 1] == '+';
+            skipSpaces();
+            size_t start = pos;
+            while (pos < text.size() && isNameChar(text[pos])) pos++;
+            if (start == pos || !isNameStart(text[start])) {
+                fail(std::string(increment ? "++" : "--") + ": variable expected");
+                return constant(0);
+            }
+            int index = node(increment ? AR_PRE_INCREMENT : AR_PRE_DECREMENT);
+            program.nodes[index].name = text.substr(start, pos - start);
+            return index;
+        }
+        if (match("-")) return unary(AR_NEGATE, unaryExpression());
+        if (match("+")) return unaryExpression();
+        if (match("!")) return unary(AR_NOT, unaryExpression());
+        if (match("~")) return unary(AR_COMPLEMENT, unaryExpression());
+        return postfix();
+    }
+
+    // name++, name--
+    int postfix() {
+        int operand = primary();
+        const ArithNode& n = program.nodes[operand];
+        if (n.op != AR_VARIABLE || !isNameStart(n.name[0])) return operand;
+        skipSpaces();
+        if (text.compare(pos, 2, "++") == 0 || text.compare(pos, 2, "--") == 0) {
+            ArithOp op = text[pos] == '+' ? AR_POST_INCREMENT : AR_POST_DECREMENT;
+            pos += 2;
+            std::string name = n.name;
+            int index = node(op);
+            program.nodes[index].name = name;
+            return index;
+        }
+        return operand;
+    }
+
+    // Number, variable or ( expression )
+    int primary() {
+        skipSpaces();
+        if (pos >= text.size()) {
+            fail("operand expected");
+            return constant(0);
+        }
+        char c = text[pos];
+        if (c == '(') {
+            pos++;
+            int inner = comma();
+            if (!match(")")) fail("missing )");
+            return inner;
+        }
+        if (c >= '0' && c <= '9') {
+            size_t start = pos;
+            long long value = 0;
+            if (!parseNumber(text, pos, value)) {
+                fail(text.substr(start, pos - start) + ": invalid number");
+            }
+            return constant(value);
+        }
+        // name, $name, ${name}, $1, $#
+        size_t start = pos;
+        if (c == '$') {
+            pos++;
+            if (pos < text.size() && text[pos] == '{') {
+                size_t end = text.find('}', pos);
+                if (end == std::string::npos) {
+                    fail("missing }");
+                    return constant(0);
+                }
+                int index = node(AR_VARIABLE);
+                program.nodes[index].name = text.substr(pos + 1, end - pos - 1);
+                pos = end + 1;
+                return index;
+            }
+            if (pos < text.size() && ((text[pos] >= '0' && text[pos] <= '9') || text[pos] == '#')) {
+                int index = node(AR_VARIABLE);
+                program.nodes[index].name = text.substr(pos++, 1);
+                return index;
+            }
+            start = pos;
+        }
+        if (pos < text.size() && isNameStart(text[pos])) {
+            while (pos < text.size() && isNameChar(text[pos])) pos++;
+            int index = node(AR_VARIABLE);
+            program.nodes[index].name = text.substr(start, pos - start);
+            return index;
+        }
+        fail(std::string("syntax error near `") + text.substr(pos) + "'");
+        return constant(0);
+    }
+};
+
+/**
+ * Run a compiled expression
+ */
+class ArithEvaluator {
+public:
+    ArithEvaluator(const ArithProgram& program, int depth, std::string& error)
+        : program(program), depth(depth), error(error) {}
+
+    bool run(int index, long long& result) {
+        const ArithNode& n = program.nodes[index];
+        long long a, b;
+        switch (n.op) {
+        case AR_CONST:
+            result = n.value;
+            return true;
+        case AR_VARIABLE:
+            return variable(n.name, result);
+        case AR_NEGATE:
+        case AR_NOT:
+        case AR_COMPLEMENT:
+            if (!run(n.left, a)) return false;
+            result = applyUnary(n.op, a);
+            return true;
+        case AR_PRE_INCREMENT:
+        case AR_PRE_DECREMENT:
+        case AR_POST_INCREMENT:
+        case AR_POST_DECREMENT: {
+            if (!variable(n.name, a)) return false;
+            bool up = n.op == AR_PRE_INCREMENT || n.op == AR_POST_INCREMENT;
+            long long updated;
+            applyBinary(up ? AR_ADD : AR_SUBTRACT, a, 1, updated, error);
+            assignVariable(n.name, std::to_string(updated));
+            result = (n.op == AR_PRE_INCREMENT || n.op == AR_PRE_DECREMENT) ? updated : a;
+            return true;
+        }
+        case AR_AND:
+            if (!run(n.left, a)) return false;
+            if (!a) {
+                result = 0;
+                return true;
+            }
+            if (!run(n.right, b)) return false;
+            result = b != 0;
+            return true;
+        case AR_OR:
+            if (!run(n.left, a)) return false;
+            if (a) {
+                result = 1;
+                return true;
+            }
+            if (!run(n.right, b)) return false;
+            result = b != 0;
+            return true;
+        case AR_CONDITION:
+            if (!run(n.left, a)) return false;
+            return run(a ? n.right : n.third, result);
+        case AR_COMMA:
+            return run(n.left, a) && run(n.right, result);
+        case AR_ASSIGN:
+            if (!run(n.right, b)) return false;
+            if (n.update == AR_CONST) {
+                result = b;
+            } else if (!variable(n.name, a) || !applyBinary(n.update, a, b, result, error)) {
+                return false;
+            }
+            assignVariable(n.name, std::to_string(result));
+            return true;
+        default:
+            return run(n.left, a) && run(n.right, b) && applyBinary(n.op, a, b, result, error);
+        }
+    }
+
+private:
+    const ArithProgram& program;
+    int depth;
+    std::string& error;
+
+    // Value of a variable: empty is 0, a number is taken as it is, anything else is an expression
+    bool variable(const std::string& name, long long& result);
+};
+
+static std::shared_ptr<const ArithProgram> compileArithmetic(const std::string& expression) {
+    static std::unordered_map<std::string, std::shared_ptr<const ArithProgram>> cache;
+    auto it = cache.find(expression);
+    if (it != cache.end()) return it->second;
+
+    std::shared_ptr<ArithProgram> program(new ArithProgram);
+    ArithCompiler compiler(expression, *program);
+    compiler.compile();
+    if (cache.size() >= ARITH_CACHE_MAX) cache.clear();
+    cache[expression] = program;
+    return program;
+}
+
+static bool evaluateAt(const std::string& expression, int depth, long long& result, std::string& error) {
+    // Held here: a nested evaluation may clear the cache
+    std::shared_ptr<const ArithProgram> program = compileArithmetic(expression);
+    if (!program->error.empty()) {
+        error = program->error;
+        return false;
+    }
+    ArithEvaluator evaluator(*program, depth, error);
+    return evaluator.run(program->root, result);
+}
+
+bool ArithEvaluator::variable(const std::string& name, long long& result) {
+    std::string value = getVariable(name);
+    size_t start = value.find_first_not_of(" \t\n");
+    if (start == std::string::npos) {
+        result = 0;
+        return true;
+    }
+    size_t pos = start;
+    bool negative = value[pos] == '-';
+    if (negative || value[pos] == '+') pos++;
+    size_t end = pos;
+    if (pos < value.size() && value[pos] >= '0' && value[pos] <= '9' && parseNumber(value, end, result) &&
+        value.find_first_not_of(" \t\n", end) == std::string::npos) {
+        if (negative) result = applyUnary(AR_NEGATE, result);
+        return true;
+    }
+    if (depth >= ARITH_MAX_DEPTH) {
+        error = "expression recursion level exceeded";
+        return false;
+    }
+    return evaluateAt(value, depth + 1, result, error);
+}
+
+bool evaluateArithmetic(const std::string& expression, long long& result, std::string& error) {
+    return evaluateAt(expression, 0, result, error);
+}
@@ -0,0 +1,25 @@
+#ifndef ARITH_HPP
+#define ARITH_HPP
+#include <string>
+
+/**
+ * Evaluate an arithmetic expression ($(( )), (( )) and let)
+ * 64-bit signed integers that wrap around, with the C operators: unary
+ * + - ! ~, ** * / % + - << >> < <= > >= == != & ^ | && || ?: and ,, the
+ * assignments = += -= *= /= %= <<= >>= &= ^= |= and ++/-- before and
+ * after a variable. Numbers are decimal, 0x hex, 0 octal or base#digits.
+ * Variables are used by name ($name and ${name} work as well); a value
+ * that is not a number is evaluated as an expression itself.
+ *
+ * The expression is compiled once into a tree whose constant parts are
+ * already folded (2*60*60 is stored as 7200) and kept in a cache keyed by
+ * its text, so a function body run in a loop does not parse it again.
+ *
+ * @param expression Expression text
+ * @param result Output: value of the expression
+ * @param error Output: message if the expression is invalid or failed
+ * @return false on an error (syntax, division by 0, ...)
+ */
+bool evaluateArithmetic(const std::string& expression, long long& result, std::string& error);
+
+#endif // ARITH_HPP
@@ -0,0 +1,238 @@
+/*
+ * TinyShell - Job Table Benchmark
+ *
+ * Measures the cost of the job table operations in jobs.cpp against
+ * table sizes from 10 to 1M jobs and writes the results as CSV, so an
+ * algorithmic regression in job control shows up as a number.
+ *
+ * Usage: bench_jobs [-o results.csv] [-m max_size] [-b budget_ms]
+ *
+ * Author: TinyShell Project
+ * Platform: Linux (POSIX-compliant systems)
+ */
+
+#include "../jobs.hpp"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The shell defines these in tinyshell.cpp, the benchmark owns its own copy
+std::vector<Job> jobTable;
+int nextJobId = 1;
+
+typedef std::chrono::steady_clock Clock;
+
+// Wall time budget for a single (operation, size) measurement
+static long long budgetNs = 2000000000LL;
+
+/**
+ * Structure holding one CSV row
+ */
+struct BenchResult {
+    std::string operation;  // Name of the measured operation
+    size_t tableSize;       // Number of jobs in the table before measuring
+    size_t ops;             // Number of operations actually performed
+    long long totalNs;      // Total wall time for all operations
+};
+
+static long long elapsedNs(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+}
+
+// Fill the job table directly with n running jobs (O(n), bypasses addJob)
+static void buildTable(size_t n) {
+    jobTable.clear();
+    jobTable.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        Job job;
+        job.jobId = (int)i + 1;
+        job.pgid = (pid_t)(100000 + i);
+        job.command = "sleep 100";
+        job.state = RUNNING;
+        job.pids.push_back(job.pgid);
+        job.is_current = false;
+        job.notified = false;
+        jobTable.push_back(job);
+    }
+    if (!jobTable.empty()) {
+        jobTable.back().is_current = true;
+    }
+    nextJobId = (int)n + 1;
+}
+
+// Number of operations to attempt at a given table size
+static size_t opsFor(size_t n) {
+    size_t ops = 10000000 / (n ? n : 1);
+    if (ops > 10000) ops = 10000;
+    if (ops < 10) ops = 10;
+    return ops;
+}
+
+/**
+ * Run op(i) up to maxOps times or until the time budget runs out
+ *
+ * @param name Operation name for the CSV row
+ * @param n Table size
+ * @param maxOps Maximum number of operations
+ * @param op Callable taking the operation index
+ * @return Result row
+ */
+template <typename Op>
+static BenchResult measure(const char* name, size_t n, size_t maxOps, Op op) {
+    BenchResult r;
+    r.operation = name;
+    r.tableSize = n;
+    r.ops = 0;
+    
+    Clock::time_point start = Clock::now();
+    while (r.ops < maxOps) {
+        op(r.ops);
+        r.ops++;
+        // Checking the clock every op would dominate the O(1) cases
+        if ((r.ops & 15) == 0 && elapsedNs(start) > budgetNs) {
+            break;
+        }
+    }
+    r.totalNs = elapsedNs(start);
+    return r;
+}
+
+// Simulate a SIGCHLD storm: 10% of the jobs exit at once
+static BenchResult sigchldStorm(size_t n) {
+    size_t exits = n / 10;
+    if (exits == 0) exits = 1;
+    
+    BenchResult r;
+    r.operation = "sigchld_storm";
+    r.tableSize = n;
+    r.ops = 0;
+    
+    Clock::time_point start = Clock::now();
+    
+    // What sigchld_handler() does for every reaped pid (spread over the table)
+    size_t stride = n / exits;
+    for (size_t k = 0; k < exits; k++) {
+        Job* job = getJobByPgid((pid_t)(100000 + k * stride));
+        if (job) {
+            job->state = DONE;
+        }
+        r.ops++;
+        if ((r.ops & 15) == 0 && elapsedNs(start) > budgetNs) {
+            break;
+        }
+    }
+    
+    // What check_job_status_changes() does afterwards (same budget again)
+    size_t erased = 0;
+    for (auto it = jobTable.begin(); it != jobTable.end(); ) {
+        if (it->state == DONE && !it->notified) {
+            std::cout << "[" << it->jobId << "] Done        " << it->command << std::endl;
+            it->notified = true;
+            it = jobTable.erase(it);
+            if ((++erased & 15) == 0 && elapsedNs(start) > 2 * budgetNs) {
+                break;
+            }
+        } else {
+            ++it;
+        }
+    }
+    if (erased < r.ops) {
+        r.ops = erased;
+    }
+    
+    r.totalNs = elapsedNs(start);
+    return r;
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-o results.csv] [-m max_size] [-b budget_ms]\n";
+}
+
+int main(int argc, char* argv[]) {
+    const char* outPath = nullptr;
+    size_t maxSize = 1000000;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            maxSize = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            budgetNs = strtoll(argv[++i], nullptr, 10) * 1000000LL;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    // addJob() and printJobs() print to std::cout, keep that out of the CSV
+    std::ofstream devNull("/dev/null");
+    std::ofstream csvFile;
+    std::streambuf* coutBuf = std::cout.rdbuf();
+    std::streambuf* csvBuf = coutBuf;
+    if (outPath) {
+        csvFile.open(outPath);
+        if (!csvFile) {
+            std::cerr << "bench_jobs: cannot open " << outPath << "\n";
+            return 1;
+        }
+        csvBuf = csvFile.rdbuf();
+    }
+    std::ostream csv(csvBuf);
+    std::cout.rdbuf(devNull.rdbuf());
+    
+    csv << "operation,table_size,ops,total_ns,ns_per_op\n";
+    
+    std::vector<BenchResult> rows;
+    for (size_t n = 10; n <= maxSize; n *= 10) {
+        size_t ops = opsFor(n);
+        std::cerr << "bench_jobs: table size " << n << "\n";
+        
+        // Lookups hit ids spread over the whole table
+        buildTable(n);
+        rows.push_back(measure("getJob", n, ops, [n](size_t i) {
+            getJob((int)((i * 7919) % n) + 1);
+        }));
+        rows.push_back(measure("getJobByPgid", n, ops, [n](size_t i) {
+            getJobByPgid((pid_t)(100000 + (i * 7919) % n));
+        }));
+        rows.push_back(measure("markJobAsCurrent", n, ops, [n](size_t i) {
+            markJobAsCurrent((int)((i * 7919) % n) + 1);
+        }));
+        rows.push_back(measure("printJobs", n, ops / 10 + 1, [](size_t) {
+            printJobs();
+        }));
+        
+        // Each add grows the table by one, the table stays at ~n jobs
+        std::vector<pid_t> pids(1, 1);
+        rows.push_back(measure("addJob", n, ops, [&pids](size_t i) {
+            addJob((pid_t)(5000000 + i), "sleep 100", RUNNING, pids);
+        }));
+        
+        // Remove from the middle, the worst case for a vector
+        buildTable(n);
+        rows.push_back(measure("removeJob", n, ops < n ? ops : n, [n](size_t i) {
+            removeJob((int)(n / 2 + (i % 2 ? -(long)((i + 1) / 2) : (long)(i / 2))) + 1);
+        }));
+        
+        buildTable(n);
+        rows.push_back(sigchldStorm(n));
+        
+        for (size_t r = 0; r < rows.size(); r++) {
+            csv << rows[r].operation << "," << rows[r].tableSize << ","
+                << rows[r].ops << "," << rows[r].totalNs << ","
+                << (rows[r].ops ? rows[r].totalNs / (long long)rows[r].ops : 0) << "\n";
+        }
+        csv.flush();
+        rows.clear();
+    }
+    
+    std::cout.rdbuf(coutBuf);
+    jobTable.clear();
+    return 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * TinyShell - Parser Benchmark
+ *
+ * Measures throughput and heap usage of tokenize() and parseCommandLine()
+ * over a corpus of command lines. Allocations are counted by replacing the
+ * global operator new, so every std::string and std::vector growth made by
+ * the parser is visible. Results are written as CSV.
+ *
+ * Corpora:
+ * - interactive: short hand-typed commands (bench/corpus/interactive.txt)
+ * - pipelines:   long generated pipelines
+ * - redirects:   lines with many redirections
+ * - bigargs:     lines with 10k-argument lists
+ *
+ * Before timing anything, every lexer backend (scalar, SSE2, AVX2) must
+ * build the same class masks as the scalar one for every byte value at
+ * every position of lines around the 16/32/64-byte block sizes, and produce
+ * exactly the same tokens over the corpora and a set of random lines, and a few lines with function definitions
+ * must parse to the expected commands.
+ *
+ * Usage: bench_parser [-o results.csv] [-c corpus_dir] [-t min_ms]
+ *
+ * Author: TinyShell Project
+ * Platform: Linux (POSIX-compliant systems)
+ */
+
+#include "../parser.hpp"
+#include "../lexer.hpp"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// Allocation counters, updated by the replaced operator new below
+static size_t allocCount = 0;
+static size_t allocBytes = 0;
+
+void* operator new(std::size_t size) {
+    allocCount++;
+    allocBytes += size;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size) {
+    allocCount++;
+    allocBytes += size;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+// GCC cannot tell these are the replacements for the operator new above
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, std::size_t) noexcept { free(p); }
+void operator delete[](void* p, std::size_t) noexcept { free(p); }
+
+/**
+ * Structure holding a named set of command lines
+ */
+struct Corpus {
+    std::string name;               // Corpus name for the CSV row
+    std::vector<std::string> lines; // Command lines
+    size_t bytes = 0;               // Total input size
+};
+
+// Load one command line per line from a file
+static bool loadCorpus(const std::string& path, Corpus& corpus) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        corpus.bytes += line.size();
+        corpus.lines.push_back(line);
+    }
+    return true;
+}
+
+static void addLine(Corpus& corpus, const std::string& line) {
+    corpus.bytes += line.size();
+    corpus.lines.push_back(line);
+}
+
+// Long generated pipelines: 4 to 64 stages
+static Corpus makePipelines() {
+    static const char* stages[] = {
+        "grep -v debug", "sort -k2 -n", "uniq -c", "awk {print}", "tr a-z A-Z",
+        "sed s/foo/bar/g", "cut -d: -f1", "head -n 1000", "tail -n 500", "wc -l"
+    };
+    Corpus c;
+    c.name = "pipelines";
+    for (int n = 4; n <= 64; n += 4) {
+        std::string line = "cat /var/log/syslog";
+        for (int i = 0; i < n; i++) {
+            line += " | ";
+            line += stages[(n + i) % 10];
+        }
+        addLine(c, line);
+    }
+    return c;
+}
+
+// Lines with many redirections
+static Corpus makeRedirects() {
+    Corpus c;
+    c.name = "redirects";
+    for (int n = 8; n <= 256; n *= 2) {
+        std::string line = "cmd -x";
+        for (int i = 0; i < n; i++) {
+            switch (i % 5) {
+                case 0: line += " < in" + std::to_string(i) + ".txt"; break;
+                case 1: line += " > out" + std::to_string(i) + ".txt"; break;
+                case 2: line += " >> log" + std::to_string(i) + ".txt"; break;
+                case 3: line += " 2> err" + std::to_string(i) + ".txt"; break;
+                case 4: line += " 2>> errlog" + std::to_string(i) + ".txt"; break;
+            }
+        }
+        addLine(c, line);
+    }
+    return c;
+}
+
+// Lines with 10k-argument lists
+static Corpus makeBigArgs() {
+    Corpus c;
+    c.name = "bigargs";
+    for (int n = 0; n < 4; n++) {
+        std::string line = "rm -f";
+        for (int i = 0; i < 10000; i++) {
+            line += " build/obj/file_" + std::to_string(n * 10000 + i) + ".o";
+        }
+        addLine(c, line);
+    }
+    return c;
+}
+
+/**
+ * Structure holding the measurements of one (corpus, stage) pair
+ */
+struct StageResult {
+    size_t allocs = 0;      // Allocations for one pass over the corpus
+    size_t bytes = 0;       // Bytes requested for one pass over the corpus
+    double seconds = 0;     // Wall time of all timed passes
+    size_t passes = 0;      // Number of timed passes
+};
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void writeRow(std::ostream& csv, const Corpus& c, const char* stage,
+                     const StageResult& r) {
+    double lines = (double)c.lines.size();
+    double linesPerSec = r.seconds > 0 ? lines * r.passes / r.seconds : 0;
+    double mbPerSec = r.seconds > 0 ? (double)c.bytes * r.passes / r.seconds / 1e6 : 0;
+    csv << c.name << "," << stage << "," << c.lines.size() << "," << c.bytes << ","
+        << r.allocs / lines << "," << r.bytes / lines << ","
+        << (size_t)linesPerSec << "," << mbPerSec << "\n";
+}
+
+static bool sameTokens(const std::vector<Token>& a, const std::string& aText,
+                       const std::vector<Token>& b, const std::string& bText) {
+    if (a.size() != b.size() || aText != bText) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].offset != b[i].offset || a[i].length != b[i].length ||
+            a[i].isOperator != b[i].isOperator || a[i].quoted != b[i].quoted ||
+            a[i].owned != b[i].owned) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sameMasks(const LexMasks& a, const LexMasks& b) {
+    return a.space == b.space && a.op == b.op && a.special == b.special;
+}
+
+/**
+ * Class masks of a backend against the scalar ones
+ * Line i of a length holds byte (i + rotation) at position i, so over all
+ * 256 rotations every byte value (0x80 and up, the neighbours of the
+ * whitespace range) reaches every lane of every vector.
+ */
+static bool verifyMasks(LexBackend backend) {
+    static const size_t lengths[] = { 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 95, 96, 97, 127, 128, 129, 200 };
+    LexMasks expected, actual;
+    std::string line;
+    for (size_t length : lengths) {
+        for (int rotation = 0; rotation < 256; rotation++) {
+            line.resize(length);
+            for (size_t i = 0; i < length; i++) {
+                line[i] = (char)(unsigned char)(i + rotation);
+            }
+            lexSetBackend(LEX_SCALAR);
+            lexScan(line.data(), line.size(), expected);
+            lexSetBackend(backend);
+            lexScan(line.data(), line.size(), actual);
+            if (!sameMasks(expected, actual)) {
+                std::cerr << "bench_parser: " << lexBackendName(backend) << " masks differ from scalar"
+                          << " (length " << length << ", first byte " << rotation << ")\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Differential check of every supported SIMD backend against the scalar one
+static bool verifyBackends(const std::vector<Corpus>& corpora) {
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < corpora.size(); i++) {
+        lines.insert(lines.end(), corpora[i].lines.begin(), corpora[i].lines.end());
+    }
+    
+    // Random lines biased towards the interesting characters and block edges
+    static const char alphabet[] = "ab2  \t|&;<>>\"'$\\\n\r\v\f09x";
+    unsigned seed = 12345;
+    for (int n = 0; n < 20000; n++) {
+        size_t len = n % 300;
+        std::string line(len, ' ');
+        for (size_t i = 0; i < len; i++) {
+            seed = seed * 1103515245 + 12345;
+            line[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        lines.push_back(line);
+    }
+    
+    LexBackend backends[] = { LEX_SSE2, LEX_AVX2 };
+    std::vector<Token> expected, actual;
+    std::string expectedText, actualText;
+    for (size_t b = 0; b < 2; b++) {
+        if (lexSetBackend(backends[b]) != backends[b]) {
+            std::cerr << "bench_parser: " << lexBackendName(backends[b])
+                      << " not supported, skipping\n";
+            continue;
+        }
+        if (!verifyMasks(backends[b])) {
+            return false;
+        }
+        for (size_t i = 0; i < lines.size(); i++) {
+            lexSetBackend(LEX_SCALAR);
+            int expectedStatus = lexLine(lines[i].data(), lines[i].size(), expected, expectedText);
+            lexSetBackend(backends[b]);
+            int actualStatus = lexLine(lines[i].data(), lines[i].size(), actual, actualText);
+            if (expectedStatus != actualStatus || !sameTokens(expected, expectedText, actual, actualText)) {
+                std::cerr << "bench_parser: " << lexBackendName(backends[b])
+                          << " lexer differs from scalar on line " << i << "\n";
+                return false;
+            }
+        }
+    }
+    lexSetBackend(LEX_AUTO);
+    return true;
+}
+
+// Function definitions anywhere a command starts: first, after ;, &, && and ||
+static bool verifyDefinitions() {
+    struct Case {
+        const char* line;
+        size_t pipelines;       // Pipelines in the parsed list
+        size_t definition;      // Index of the pipeline that defines the function
+        ListCondition runIf;    // How the definition is run
+    };
+    static const Case cases[] = {
+        { "f() { echo in f; }; f", 2, 0, RUN_ALWAYS },
+        { "echo a; f() { echo in f; }; f", 3, 1, RUN_ALWAYS },
+        { "echo a & f() { echo in f; }", 2, 1, RUN_ALWAYS },
+        { "true && f() { echo in f; } && f", 3, 1, RUN_IF_TRUE },
+        { "false || f() { { a & b } | c; }", 2, 1, RUN_IF_FALSE },
+    };
+    for (const Case& c : cases) {
+        ParsedList list;
+        if (!parseLine(c.line, list) || !list.error.empty() || list.pipelines.size() != c.pipelines ||
+            !list.pipelines[c.definition].commands[0].definition ||
+            list.pipelines[c.definition].commands[0].args[0] != "f" ||
+            list.pipelines[c.definition].runIf != c.runIf) {
+            std::cerr << "bench_parser: wrong parse of '" << c.line << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Raw lexLine() throughput for every supported backend
+static void benchLexer(std::ostream& csv, const Corpus& c, double minSeconds) {
+    LexBackend backends[] = { LEX_SCALAR, LEX_SSE2, LEX_AVX2 };
+    std::vector<Token> tokens;
+    std::string unescaped;
+    for (size_t b = 0; b < 3; b++) {
+        if (lexSetBackend(backends[b]) != backends[b]) continue;
+        
+        // Warm-up: the buffers shared by all backends (tokens, unescaped and
+        // the lexer's masks) grow here, not in the counted pass of the first one
+        for (size_t i = 0; i < c.lines.size(); i++) {
+            lexLine(c.lines[i].data(), c.lines[i].size(), tokens, unescaped);
+        }
+        
+        StageResult r;
+        size_t a0 = allocCount, b0 = allocBytes;
+        for (size_t i = 0; i < c.lines.size(); i++) {
+            lexLine(c.lines[i].data(), c.lines[i].size(), tokens, unescaped);
+        }
+        r.allocs = allocCount - a0;
+        r.bytes = allocBytes - b0;
+        
+        Clock::time_point start = Clock::now();
+        do {
+            for (size_t i = 0; i < c.lines.size(); i++) {
+                lexLine(c.lines[i].data(), c.lines[i].size(), tokens, unescaped);
+            }
+            r.passes++;
+        } while (secondsSince(start) < minSeconds);
+        r.seconds = secondsSince(start);
+        
+        std::string stage = std::string("lexLine/") + lexBackendName(backends[b]);
+        writeRow(csv, c, stage.c_str(), r);
+    }
+    lexSetBackend(LEX_AUTO);
+}
+
+static void benchCorpus(std::ostream& csv, const Corpus& c, double minSeconds) {
+    // Pre-tokenize so parseCommandLine() can be measured on its own
+    std::vector<std::vector<std::string> > tokenized;
+    tokenized.reserve(c.lines.size());
+    for (size_t i = 0; i < c.lines.size(); i++) {
+        tokenized.push_back(tokenize(c.lines[i]));
+    }
+    
+    StageResult tok, parse, total;
+    size_t sink = 0;
+    
+    // One counted pass per stage
+    size_t a0 = allocCount, b0 = allocBytes;
+    for (size_t i = 0; i < c.lines.size(); i++) {
+        sink += tokenize(c.lines[i]).size();
+    }
+    tok.allocs = allocCount - a0;
+    tok.bytes = allocBytes - b0;
+    
+    a0 = allocCount; b0 = allocBytes;
+    for (size_t i = 0; i < tokenized.size(); i++) {
+        sink += parseCommandLine(tokenized[i]).commands.size();
+    }
+    parse.allocs = allocCount - a0;
+    parse.bytes = allocBytes - b0;
+    total.allocs = tok.allocs + parse.allocs;
+    total.bytes = tok.bytes + parse.bytes;
+    
+    // Timed passes
+    Clock::time_point start = Clock::now();
+    do {
+        for (size_t i = 0; i < c.lines.size(); i++) {
+            sink += tokenize(c.lines[i]).size();
+        }
+        tok.passes++;
+    } while (secondsSince(start) < minSeconds);
+    tok.seconds = secondsSince(start);
+    
+    start = Clock::now();
+    do {
+        for (size_t i = 0; i < tokenized.size(); i++) {
+            sink += parseCommandLine(tokenized[i]).commands.size();
+        }
+        parse.passes++;
+    } while (secondsSince(start) < minSeconds);
+    parse.seconds = secondsSince(start);
+    
+    start = Clock::now();
+    do {
+        for (size_t i = 0; i < c.lines.size(); i++) {
+            sink += parseCommandLine(tokenize(c.lines[i])).commands.size();
+        }
+        total.passes++;
+    } while (secondsSince(start) < minSeconds);
+    total.seconds = secondsSince(start);
+    
+    benchLexer(csv, c, minSeconds);
+    writeRow(csv, c, "tokenize", tok);
+    writeRow(csv, c, "parseCommandLine", parse);
+    writeRow(csv, c, "total", total);
+    
+    // Keep the optimizer from dropping the work
+    if (sink == 0) {
+        std::cerr << "bench_parser: empty corpus " << c.name << "\n";
+    }
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-o results.csv] [-c corpus_dir] [-t min_ms]\n";
+}
+
+int main(int argc, char* argv[]) {
+    const char* outPath = nullptr;
+    std::string corpusDir = "bench/corpus";
+    double minSeconds = 0.5;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            corpusDir = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minSeconds = atof(argv[++i]) / 1000.0;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    std::ofstream csvFile;
+    std::streambuf* csvBuf = std::cout.rdbuf();
+    if (outPath) {
+        csvFile.open(outPath);
+        if (!csvFile) {
+            std::cerr << "bench_parser: cannot open " << outPath << "\n";
+            return 1;
+        }
+        csvBuf = csvFile.rdbuf();
+    }
+    std::ostream csv(csvBuf);
+    
+    std::vector<Corpus> corpora;
+    Corpus interactive;
+    interactive.name = "interactive";
+    if (!loadCorpus(corpusDir + "/interactive.txt", interactive)) {
+        std::cerr << "bench_parser: cannot open " << corpusDir << "/interactive.txt\n";
+        return 1;
+    }
+    corpora.push_back(interactive);
+    corpora.push_back(makePipelines());
+    corpora.push_back(makeRedirects());
+    corpora.push_back(makeBigArgs());
+    
+    if (!verifyBackends(corpora) || !verifyDefinitions()) {
+        return 1;
+    }
+    
+    csv << "corpus,stage,lines,input_bytes,allocs_per_line,bytes_per_line,lines_per_sec,mb_per_sec\n";
+    for (size_t i = 0; i < corpora.size(); i++) {
+        std::cerr << "bench_parser: corpus " << corpora[i].name << "\n";
+        benchCorpus(csv, corpora[i], minSeconds);
+        csv.flush();
+    }
+    
+    return 0;
+}
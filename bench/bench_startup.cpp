@@ -0,0 +1,178 @@
+/*
+ * TinyShell - Startup Benchmark
+ *
+ * Measures the wall time of "shell -c command" from spawn to exit for
+ * tinyshell and for the system's shells (dash, sh, bash) and writes the
+ * results as CSV, so a slower start of short scripts shows up as a number.
+ *
+ * Which tinyshell build is measured matters: the default dynamic build
+ * spends most of its start in the loader and libstdc++ and takes over
+ * twice as long as dash for "-c true" (about 1.6 ms against 0.7 ms); only
+ * the static PIE from "make static" starts about as fast as dash.
+ *
+ * Usage: bench_startup [-o results.csv] [-n runs] [-s shell]...
+ *
+ * Author: TinyShell Project
+ * Platform: Linux (POSIX-compliant systems)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Structure holding one CSV row
+ */
+struct BenchResult {
+    std::string shell;      // Path of the measured shell
+    std::string command;    // Argument of -c
+    size_t runs;            // Number of successful runs
+    long long totalNs;      // Total wall time for all runs
+    long long minNs;        // Fastest run
+};
+
+// Commands run with -c, from an empty start to a typical one-liner
+static const char* const commands[] = {
+    "true",
+    "echo hello > /dev/null",
+    "ls / | wc -l > /dev/null",
+};
+
+/**
+ * Spawn "shell -c command" with stdin and stdout on /dev/null and wait for it
+ *
+ * @return Wall time in ns, -1 if the shell could not be run
+ */
+static long long runOnce(const std::string& shell, const char* command, int devNull) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, devNull, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, devNull, STDOUT_FILENO);
+
+    char* argv[] = { const_cast<char*>(shell.c_str()), const_cast<char*>("-c"),
+                     const_cast<char*>(command), nullptr };
+    Clock::time_point start = Clock::now();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell.c_str(), &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+    return WIFEXITED(status) ? ns : -1;
+}
+
+static BenchResult measure(const std::string& shell, const char* command, size_t runs, int devNull) {
+    BenchResult r;
+    r.shell = shell;
+    r.command = command;
+    r.runs = 0;
+    r.totalNs = 0;
+    r.minNs = 0;
+
+    // One untimed run so the binary and its libraries are in the page cache
+    runOnce(shell, command, devNull);
+    for (size_t i = 0; i < runs; i++) {
+        long long ns = runOnce(shell, command, devNull);
+        if (ns < 0) break;
+        r.runs++;
+        r.totalNs += ns;
+        if (r.minNs == 0 || ns < r.minNs) r.minNs = ns;
+    }
+    return r;
+}
+
+// Quote a field that may contain a comma or a quote
+static std::string csvField(const std::string& text) {
+    if (text.find_first_of(",\"") == std::string::npos) return text;
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-o results.csv] [-n runs] [-s shell]...\n";
+}
+
+int main(int argc, char* argv[]) {
+    const char* outPath = nullptr;
+    size_t runs = 200;
+    std::vector<std::string> shells;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            shells.push_back(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Default: the shell built next to bench/, and whatever small shells exist
+    if (shells.empty()) {
+        shells.push_back("./tinyshell");
+        const char* others[] = { "/bin/dash", "/bin/sh", "/bin/bash" };
+        for (const char* other : others) {
+            if (access(other, X_OK) == 0) shells.push_back(other);
+        }
+    }
+
+    int devNull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (devNull < 0) {
+        std::cerr << "bench_startup: cannot open /dev/null\n";
+        return 1;
+    }
+
+    std::ofstream csvFile;
+    std::ostream* csv = &std::cout;
+    if (outPath) {
+        csvFile.open(outPath);
+        if (!csvFile) {
+            std::cerr << "bench_startup: cannot open " << outPath << "\n";
+            return 1;
+        }
+        csv = &csvFile;
+    }
+
+    *csv << "shell,command,runs,total_ns,ns_per_run,min_ns\n";
+    for (const auto& shell : shells) {
+        std::cerr << "bench_startup: " << shell << "\n";
+        for (const char* command : commands) {
+            BenchResult r = measure(shell, command, runs, devNull);
+            if (r.runs == 0) {
+                std::cerr << "bench_startup: " << shell << " -c '" << command << "' failed\n";
+                continue;
+            }
+            *csv << csvField(r.shell) << "," << csvField(r.command) << "," << r.runs << ","
+                 << r.totalNs << "," << r.totalNs / (long long)r.runs << "," << r.minNs << "\n";
+        }
+    }
+
+    close(devNull);
+    return 0;
+}
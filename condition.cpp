@@ -0,0 +1,314 @@
+#include "condition.hpp"
+#include "tinyshell.hpp"
+#include <iostream>
+#include <unordered_map>
+#include <memory>
+#include <utility>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/stat.h>
+
+// Paths whose stat() result one evaluation keeps
+#define STAT_CACHE_SIZE 8
+
+// Regexes kept compiled; the cache starts over when it is full
+#define REGEX_CACHE_MAX 32
+
+/**
+ * stat()/lstat() results of one evaluation
+ * "[ -e f -a ! -h f -a -s f ]" or "[[ -f a && a -nt b ]]" ask about the
+ * same paths several times; the answers cannot change in between.
+ */
+class StatCache {
+public:
+    StatCache() : used(0), next(0) {}
+
+    /**
+     * @param follow false for lstat() (-h, -L)
+     * @return The result, nullptr if the path does not exist
+     */
+    const struct stat* get(const std::string& path, bool follow) {
+        for (size_t i = 0; i < used; i++) {
+            if (entries[i].follow == follow && entries[i].path == path) {
+                return entries[i].exists ? &entries[i].st : nullptr;
+            }
+        }
+        // Full: replace the oldest entry
+        Entry& entry = entries[used < STAT_CACHE_SIZE ? used++ : next++ % STAT_CACHE_SIZE];
+        entry.path = path;
+        entry.follow = follow;
+        entry.exists = (follow ? stat(path.c_str(), &entry.st) : lstat(path.c_str(), &entry.st)) == 0;
+        return entry.exists ? &entry.st : nullptr;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        bool follow;
+        bool exists;
+        struct stat st;
+    };
+    Entry entries[STAT_CACHE_SIZE];
+    size_t used;
+    size_t next;
+};
+
+struct CompiledRegex {
+    regex_t regex;
+    bool compiled = false;      // regfree() only after a successful regcomp()
+    ~CompiledRegex() { if (compiled) regfree(&regex); }
+};
+
+/**
+ * Compile an extended regex, or take it from the cache
+ *
+ * @param error Output: regcomp()'s message if the pattern is invalid
+ * @return The regex, nullptr if the pattern is invalid
+ */
+static const regex_t* compileRegex(const std::string& pattern, std::string& error) {
+    static std::unordered_map<std::string, std::unique_ptr<CompiledRegex>> cache;
+    auto it = cache.find(pattern);
+    if (it != cache.end()) return &it->second->regex;
+
+    std::unique_ptr<CompiledRegex> compiled(new CompiledRegex);
+    int code = regcomp(&compiled->regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (code != 0) {
+        char message[256];
+        regerror(code, &compiled->regex, message, sizeof(message));
+        error = message;
+        return nullptr;
+    }
+    compiled->compiled = true;
+    if (cache.size() >= REGEX_CACHE_MAX) cache.clear();
+    const regex_t* regex = &compiled->regex;
+    cache[pattern] = std::move(compiled);
+    return regex;
+}
+
+static bool isUnaryOperator(const std::string& op, bool extended) {
+    if (op.size() != 2 || op[0] != '-') return false;
+    // -a is "exists" only in [[ ]], in test it means "and"
+    return strchr("bcdefghkLprsStuwxOGzn", op[1]) || (extended && op[1] == 'a');
+}
+
+static bool isBinaryOperator(const std::string& op, bool extended) {
+    static const char* const operators[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"
+    };
+    for (const char* known : operators) {
+        if (op == known) return true;
+    }
+    return extended && op == "=~";
+}
+
+/**
+ * Recursive descent over the expression words
+ * Every part is parsed, but only the live ones are evaluated: the right
+ * side of a decided && or || does not stat files or report errors.
+ */
+class ConditionParser {
+public:
+    ConditionParser(const std::vector<std::string>& args, bool extended, const char* name)
+        : args(args), pos(0), extended(extended), name(name), failed(false) {}
+
+    int run() {
+        if (args.empty()) return CONDITION_FALSE;
+        bool result = orExpression(true);
+        if (!failed && pos < args.size()) {
+            error(args[pos] + ": unexpected argument");
+        }
+        if (failed) return CONDITION_ERROR;
+        return result ? CONDITION_TRUE : CONDITION_FALSE;
+    }
+
+private:
+    const std::vector<std::string>& args;
+    size_t pos;
+    bool extended;
+    const char* name;
+    bool failed;
+    StatCache stats;
+
+    void error(const std::string& message) {
+        if (failed) return;
+        failed = true;
+        std::cerr << COLOR_ERROR << "tinyshell: " << name << ": " << message << COLOR_RESET << "\n";
+    }
+
+    bool at(const char* word) const {
+        return pos < args.size() && args[pos] == word;
+    }
+
+    // A binary operator follows the word at pos (it is then an operand, even "!" or "(")
+    bool binaryAhead() const {
+        return pos + 2 < args.size() && isBinaryOperator(args[pos + 1], extended);
+    }
+
+    bool orExpression(bool live) {
+        bool result = andExpression(live);
+        while (!failed && at(extended ? "||" : "-o")) {
+            pos++;
+            bool right = andExpression(live && !result);
+            result = result || right;
+        }
+        return result;
+    }
+
+    bool andExpression(bool live) {
+        bool result = notExpression(live);
+        while (!failed && at(extended ? "&&" : "-a")) {
+            pos++;
+            bool right = notExpression(live && result);
+            result = result && right;
+        }
+        return result;
+    }
+
+    bool notExpression(bool live) {
+        if (at("!") && pos + 1 < args.size() && !binaryAhead()) {
+            pos++;
+            return !notExpression(live);
+        }
+        return primary(live);
+    }
+
+    bool primary(bool live) {
+        if (pos >= args.size()) {
+            error("argument expected");
+            return false;
+        }
+        if (binaryAhead()) {
+            const std::string& left = args[pos];
+            const std::string& op = args[pos + 1];
+            const std::string& right = args[pos + 2];
+            pos += 3;
+            return live && binary(left, op, right);
+        }
+        if (at("(") && pos + 1 < args.size()) {
+            pos++;
+            bool result = orExpression(live);
+            if (!at(")")) {
+                error("missing )");
+                return false;
+            }
+            pos++;
+            return result;
+        }
+        if (pos + 1 < args.size() && isUnaryOperator(args[pos], extended)) {
+            char op = args[pos][1];
+            const std::string& operand = args[pos + 1];
+            pos += 2;
+            return live && unary(op, operand);
+        }
+        // A lone word is true when it is not empty
+        return !args[pos++].empty();
+    }
+
+    bool integer(const std::string& text, long long& value) {
+        char* end;
+        errno = 0;
+        value = strtoll(text.c_str(), &end, 10);
+        while (*end == ' ' || *end == '\t') end++;
+        if (text.empty() || *end != '\0' || end == text.c_str() || errno == ERANGE) {
+            error(text + ": integer expression expected");
+            return false;
+        }
+        return true;
+    }
+
+    bool unary(char op, const std::string& operand) {
+        switch (op) {
+        case 'z': return operand.empty();
+        case 'n': return !operand.empty();
+        case 't': {
+            long long fd;
+            return integer(operand, fd) && fd >= 0 && fd <= 0x7fffffff && isatty((int)fd);
+        }
+        case 'r': return faccessat(AT_FDCWD, operand.c_str(), R_OK, AT_EACCESS) == 0;
+        case 'w': return faccessat(AT_FDCWD, operand.c_str(), W_OK, AT_EACCESS) == 0;
+        case 'x': return faccessat(AT_FDCWD, operand.c_str(), X_OK, AT_EACCESS) == 0;
+        default:
+            break;
+        }
+
+        const struct stat* st = stats.get(operand, op != 'h' && op != 'L');
+        if (!st) return false;
+        switch (op) {
+        case 'a':
+        case 'e': return true;
+        case 'f': return S_ISREG(st->st_mode);
+        case 'd': return S_ISDIR(st->st_mode);
+        case 'b': return S_ISBLK(st->st_mode);
+        case 'c': return S_ISCHR(st->st_mode);
+        case 'p': return S_ISFIFO(st->st_mode);
+        case 'S': return S_ISSOCK(st->st_mode);
+        case 'h':
+        case 'L': return S_ISLNK(st->st_mode);
+        case 's': return st->st_size > 0;
+        case 'g': return (st->st_mode & S_ISGID) != 0;
+        case 'u': return (st->st_mode & S_ISUID) != 0;
+        case 'k': return (st->st_mode & S_ISVTX) != 0;
+        case 'O': return st->st_uid == geteuid();
+        case 'G': return st->st_gid == getegid();
+        default: return false;
+        }
+    }
+
+    // -1, 0, 1 as the mtime of a is before, equal to or after that of b
+    static int compareTimes(const struct stat* a, const struct stat* b) {
+        if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+        if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec) return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec ? -1 : 1;
+        return 0;
+    }
+
+    bool binary(const std::string& left, const std::string& op, const std::string& right) {
+        if (op == "=" || op == "==") {
+            return extended ? fnmatch(right.c_str(), left.c_str(), 0) == 0 : left == right;
+        }
+        if (op == "!=") {
+            return extended ? fnmatch(right.c_str(), left.c_str(), 0) != 0 : left != right;
+        }
+        if (op == "<") return left < right;
+        if (op == ">") return left > right;
+        if (op == "=~") {
+            std::string message;
+            const regex_t* regex = compileRegex(right, message);
+            if (!regex) {
+                error(right + ": " + message);
+                return false;
+            }
+            return regexec(regex, left.c_str(), 0, nullptr, 0) == 0;
+        }
+
+        // -nt, -ot: a missing file is older than any existing one
+        if (op == "-nt" || op == "-ot" || op == "-ef") {
+            // Copied: looking up right may evict the cache entry of left
+            struct stat leftStat;
+            const struct stat* a = stats.get(left, true);
+            if (a) a = &(leftStat = *a);
+            const struct stat* b = stats.get(right, true);
+            if (op == "-ef") return a && b && a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+            if (op == "-ot") std::swap(a, b);
+            return a && (!b || compareTimes(a, b) > 0);
+        }
+
+        long long a, b;
+        if (!integer(left, a) || !integer(right, b)) return false;
+        if (op == "-eq") return a == b;
+        if (op == "-ne") return a != b;
+        if (op == "-lt") return a < b;
+        if (op == "-le") return a <= b;
+        if (op == "-gt") return a > b;
+        return a >= b;
+    }
+};
+
+int evaluateCondition(const std::vector<std::string>& args, bool extended, const char* name) {
+    ConditionParser parser(args, extended, name);
+    return parser.run();
+}
@@ -0,0 +1,26 @@
+#ifndef CONDITION_HPP
+#define CONDITION_HPP
+#include <string>
+#include <vector>
+
+// Exit statuses of a condition
+#define CONDITION_TRUE 0
+#define CONDITION_FALSE 1
+#define CONDITION_ERROR 2
+
+/**
+ * Evaluate a test expression (test, [ and [[)
+ * File operators (-e -f -d -h -s -nt ...) share a small stat cache that
+ * lives for this one evaluation, so "[ -f x -a -s x ]" stats x once.
+ * Extended expressions ([[ ]]) use && || instead of -a -o, compare
+ * strings with < and >, match == and != as glob patterns and =~ as an
+ * extended regular expression; compiled regexes are cached.
+ *
+ * @param args Expression words, without "test", "[" / "]" or "[[" / "]]"
+ * @param extended true for [[ ]]
+ * @param name Builtin name for error messages
+ * @return CONDITION_TRUE, CONDITION_FALSE, or CONDITION_ERROR (reported)
+ */
+int evaluateCondition(const std::vector<std::string>& args, bool extended, const char* name);
+
+#endif // CONDITION_HPP
@@ -0,0 +1,333 @@
+#include "format.hpp"
+#include "tinyshell.hpp"
+#include <iostream>
+#include <unordered_map>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+// Formats kept compiled; the cache starts over when it is full
+#define FORMAT_CACHE_MAX 64
+
+static std::string& sharedBuffer() {
+    static std::string buffer;
+    return buffer;
+}
+
+OutputBuffer::OutputBuffer(int fd) : fd(fd), failed(false), buffer(sharedBuffer()) {
+    buffer.clear();
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+}
+
+void OutputBuffer::append(const char* data, size_t len) {
+    buffer.append(data, len);
+    if (buffer.size() >= FORMAT_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+bool OutputBuffer::flush() {
+    size_t done = 0;
+    while (!failed && done < buffer.size()) {
+        ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << COLOR_ERROR << "tinyshell: write error: " << strerror(errno) << COLOR_RESET << "\n";
+            failed = true;
+            break;
+        }
+        done += n;
+    }
+    buffer.clear();
+    // Do not keep the memory of a huge output around
+    if (buffer.capacity() > 4 * FORMAT_BUFFER_SIZE) {
+        std::string().swap(buffer);
+    }
+    return !failed;
+}
+
+static bool isOctal(char c) {
+    return c >= '0' && c <= '7';
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Decode the escape at text[pos] (just after the backslash)
+ * Octal escapes are \NNN in formats and \0NNN in echo -e and %b.
+ *
+ * @param out Decoded text is appended here
+ * @param stop Set for \c
+ * @return Position after the escape
+ */
+static size_t decodeEscape(const std::string& text, size_t pos, bool zeroOctal, std::string& out, bool& stop) {
+    if (pos >= text.size()) {
+        out += '\\';
+        return pos;
+    }
+    char c = text[pos++];
+    switch (c) {
+    case 'a': out += '\a'; return pos;
+    case 'b': out += '\b'; return pos;
+    case 'e': out += '\033'; return pos;
+    case 'f': out += '\f'; return pos;
+    case 'n': out += '\n'; return pos;
+    case 'r': out += '\r'; return pos;
+    case 't': out += '\t'; return pos;
+    case 'v': out += '\v'; return pos;
+    case '\\': out += '\\'; return pos;
+    case 'c': stop = true; return pos;
+    case 'x': {
+        int value = 0, digits = 0;
+        while (digits < 2 && pos < text.size() && hexValue(text[pos]) >= 0) {
+            value = value * 16 + hexValue(text[pos++]);
+            digits++;
+        }
+        if (digits == 0) out += "\\x";
+        else out += (char)value;
+        return pos;
+    }
+    default:
+        break;
+    }
+    if (isOctal(c) && (!zeroOctal || c == '0')) {
+        int value = zeroOctal ? 0 : c - '0';
+        for (int digits = zeroOctal ? 0 : 1; digits < 3 && pos < text.size() && isOctal(text[pos]); digits++) {
+            value = value * 8 + (text[pos++] - '0');
+        }
+        out += (char)value;
+        return pos;
+    }
+    out += '\\';
+    out += c;
+    return pos;
+}
+
+// Decode all escapes of echo -e and %b text, up to a \c
+static bool decodeText(const std::string& text, std::string& decoded) {
+    bool stop = false;
+    size_t pos = 0;
+    while (pos < text.size() && !stop) {
+        size_t slash = text.find('\\', pos);
+        decoded.append(text, pos, slash == std::string::npos ? std::string::npos : slash - pos);
+        if (slash == std::string::npos) break;
+        pos = decodeEscape(text, slash + 1, true, decoded, stop);
+    }
+    return !stop;
+}
+
+bool decodeEscapes(const std::string& text, OutputBuffer& out) {
+    std::string decoded;
+    bool more = decodeText(text, decoded);
+    out.append(decoded);
+    return more;
+}
+
+static FormatPiece makePiece(FormatPieceType type, const std::string& text) {
+    FormatPiece piece;
+    piece.type = type;
+    piece.text = text;
+    return piece;
+}
+
+// Parse one %... directive starting at format[pos] (after the %)
+static size_t compileDirective(const std::string& format, size_t pos, CompiledFormat& compiled) {
+    FormatPiece piece;
+    piece.type = PIECE_CONVERSION;
+    piece.text = "%";
+    while (pos < format.size() && strchr("-+ #0", format[pos])) {
+        piece.text += format[pos++];
+    }
+    if (pos < format.size() && format[pos] == '*') {
+        piece.widthArg = true;
+        piece.text += format[pos++];
+    } else {
+        while (pos < format.size() && format[pos] >= '0' && format[pos] <= '9') piece.text += format[pos++];
+    }
+    if (pos < format.size() && format[pos] == '.') {
+        piece.text += format[pos++];
+        if (pos < format.size() && format[pos] == '*') {
+            piece.precisionArg = true;
+            piece.text += format[pos++];
+        } else {
+            while (pos < format.size() && format[pos] >= '0' && format[pos] <= '9') piece.text += format[pos++];
+        }
+    }
+    char conversion = pos < format.size() ? format[pos++] : 0;
+    if (conversion == 0 || !strchr("diouxXcsbeEfFgGaA", conversion)) {
+        compiled.error = std::string("%") + (conversion ? std::string(1, conversion) : std::string()) +
+                         ": invalid directive";
+        return format.size();
+    }
+    piece.conversion = conversion;
+    if (strchr("diouxX", conversion)) {
+        piece.text += "ll";
+    } else if (strchr("eEfFgGaA", conversion)) {
+        piece.text += 'L';
+    }
+    // %c and %b print a string made from the argument
+    piece.text += (conversion == 'c' || conversion == 'b') ? 's' : conversion;
+    compiled.pieces.push_back(piece);
+    compiled.conversions++;
+    return pos;
+}
+
+static void compileInto(const std::string& format, CompiledFormat& compiled) {
+    std::string text;
+    size_t pos = 0;
+    while (pos < format.size() && compiled.error.empty()) {
+        char c = format[pos];
+        if (c == '\\') {
+            bool stop = false;
+            pos = decodeEscape(format, pos + 1, false, text, stop);
+            if (stop) {
+                if (!text.empty()) compiled.pieces.push_back(makePiece(PIECE_TEXT, text));
+                compiled.pieces.push_back(makePiece(PIECE_STOP, std::string()));
+                return;
+            }
+        } else if (c == '%' && pos + 1 < format.size() && format[pos + 1] == '%') {
+            text += '%';
+            pos += 2;
+        } else if (c == '%') {
+            if (!text.empty()) compiled.pieces.push_back(makePiece(PIECE_TEXT, text));
+            text.clear();
+            pos = compileDirective(format, pos + 1, compiled);
+        } else {
+            size_t next = format.find_first_of("\\%", pos);
+            if (next == std::string::npos) next = format.size();
+            text.append(format, pos, next - pos);
+            pos = next;
+        }
+    }
+    if (!text.empty()) compiled.pieces.push_back(makePiece(PIECE_TEXT, text));
+}
+
+const CompiledFormat& compileFormat(const std::string& format) {
+    static std::unordered_map<std::string, CompiledFormat> cache;
+    auto it = cache.find(format);
+    if (it != cache.end()) return it->second;
+    if (cache.size() >= FORMAT_CACHE_MAX) cache.clear();
+    CompiledFormat& compiled = cache[format];
+    compileInto(format, compiled);
+    return compiled;
+}
+
+/**
+ * Format one value with a piece's snprintf() spec
+ * The extra int arguments are the * width and precision, when used.
+ */
+template <typename T>
+static void appendFormatted(OutputBuffer& out, const FormatPiece& piece, int width, int precision, T value) {
+    char small[256];
+    const char* spec = piece.text.c_str();
+    int n;
+    if (piece.widthArg && piece.precisionArg) n = snprintf(small, sizeof(small), spec, width, precision, value);
+    else if (piece.widthArg) n = snprintf(small, sizeof(small), spec, width, value);
+    else if (piece.precisionArg) n = snprintf(small, sizeof(small), spec, precision, value);
+    else n = snprintf(small, sizeof(small), spec, value);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(small)) {
+        out.append(small, n);
+        return;
+    }
+    std::string large(n + 1, '\0');
+    if (piece.widthArg && piece.precisionArg) snprintf(&large[0], n + 1, spec, width, precision, value);
+    else if (piece.widthArg) snprintf(&large[0], n + 1, spec, width, value);
+    else if (piece.precisionArg) snprintf(&large[0], n + 1, spec, precision, value);
+    else snprintf(&large[0], n + 1, spec, value);
+    out.append(large.data(), n);
+}
+
+// Numeric argument: a C constant (010 is octal, 0x10 hex) or 'c for the code of c
+static long long numberArgument(const std::string& arg, bool& valid) {
+    if (arg.empty()) return 0;
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return arg.size() > 1 ? (unsigned char)arg[1] : 0;
+    }
+    char* end;
+    errno = 0;
+    long long value = arg[0] == '-' ? strtoll(arg.c_str(), &end, 0) : (long long)strtoull(arg.c_str(), &end, 0);
+    if (*end != '\0' || end == arg.c_str() || errno == ERANGE) {
+        std::cerr << COLOR_ERROR << "tinyshell: printf: " << arg << ": invalid number" << COLOR_RESET << "\n";
+        valid = false;
+    }
+    return value;
+}
+
+static long double floatArgument(const std::string& arg, bool& valid) {
+    if (arg.empty()) return 0;
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return arg.size() > 1 ? (unsigned char)arg[1] : 0;
+    }
+    char* end;
+    long double value = strtold(arg.c_str(), &end);
+    if (*end != '\0' || end == arg.c_str()) {
+        std::cerr << COLOR_ERROR << "tinyshell: printf: " << arg << ": invalid number" << COLOR_RESET << "\n";
+        valid = false;
+    }
+    return value;
+}
+
+bool formatArguments(const CompiledFormat& format, const std::vector<std::string>& args, OutputBuffer& out) {
+    bool valid = true;
+    size_t next = 0;
+    static const std::string none;
+    auto argument = [&args, &next]() -> const std::string& {
+        return next < args.size() ? args[next++] : none;
+    };
+
+    do {
+        for (const auto& piece : format.pieces) {
+            if (piece.type == PIECE_TEXT) {
+                out.append(piece.text);
+                continue;
+            }
+            if (piece.type == PIECE_STOP) {
+                return valid;
+            }
+            int width = piece.widthArg ? (int)numberArgument(argument(), valid) : 0;
+            int precision = piece.precisionArg ? (int)numberArgument(argument(), valid) : 0;
+            const std::string& arg = argument();
+            switch (piece.conversion) {
+            case 's':
+                appendFormatted(out, piece, width, precision, arg.c_str());
+                break;
+            case 'c':
+                appendFormatted(out, piece, width, precision, arg.substr(0, 1).c_str());
+                break;
+            case 'b': {
+                // Decode into a buffer of its own, then pad it like %s
+                std::string decoded;
+                bool more = decodeText(arg, decoded);
+                appendFormatted(out, piece, width, precision, decoded.c_str());
+                if (!more) return valid;
+                break;
+            }
+            case 'd':
+            case 'i':
+                appendFormatted(out, piece, width, precision, numberArgument(arg, valid));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                appendFormatted(out, piece, width, precision, (unsigned long long)numberArgument(arg, valid));
+                break;
+            default:
+                appendFormatted(out, piece, width, precision, floatArgument(arg, valid));
+                break;
+            }
+        }
+    } while (format.conversions > 0 && next < args.size());
+    return valid;
+}
@@ -0,0 +1,98 @@
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+#include <string>
+#include <vector>
+
+/**
+ * Output of the echo and printf builtins
+ * Everything is collected in one buffer, which is reused by the next
+ * builtin, and written with a single write() at the end (or whenever
+ * FORMAT_BUFFER_SIZE bytes have piled up), so the text of a builtin never
+ * interleaves with the output of other processes.
+ */
+class OutputBuffer {
+public:
+    /**
+     * @param fd Where the output goes
+     */
+    explicit OutputBuffer(int fd);
+    ~OutputBuffer();
+
+    void append(const char* data, size_t len);
+    void append(const std::string& text) { append(text.data(), text.size()); }
+    void append(char c) { append(&c, 1); }
+
+    /**
+     * Write out what is buffered
+     *
+     * @return false if a write failed (the error was reported)
+     */
+    bool flush();
+
+private:
+    int fd;
+    bool failed;
+    std::string& buffer;    // Shared by all OutputBuffers, keeps its capacity
+};
+
+// Write the buffer out once it holds this many bytes
+#define FORMAT_BUFFER_SIZE 65536
+
+/**
+ * Kind of a piece of a format string
+ */
+enum FormatPieceType {
+    PIECE_TEXT,         // Literal text, escapes already decoded
+    PIECE_CONVERSION,   // %d, %s, ... with flags, width and precision
+    PIECE_STOP          // \c: no more output at all
+};
+
+/**
+ * One piece of a compiled printf format
+ */
+struct FormatPiece {
+    FormatPieceType type;
+    std::string text;       // PIECE_TEXT: the text, PIECE_CONVERSION: snprintf() spec ("%-8lld")
+    char conversion = 0;    // d, i, o, u, x, X, c, s, b, e, E, f, F, g, G, a, A
+    bool widthArg = false;  // Width given as * (taken from the arguments)
+    bool precisionArg = false;  // Precision given as .*
+};
+
+/**
+ * printf format split into pieces, parsed once and kept for repeated use
+ */
+struct CompiledFormat {
+    std::vector<FormatPiece> pieces;
+    size_t conversions = 0;     // Number of arguments one pass of the format uses
+    std::string error;          // Invalid directive (nothing is printed then)
+};
+
+/**
+ * Compile a printf format, or take it from the cache of recently used ones
+ *
+ * @param format Format string as given to printf
+ * @return Compiled format, valid until the next call
+ */
+const CompiledFormat& compileFormat(const std::string& format);
+
+/**
+ * Print arguments with a compiled format (the printf builtin)
+ * The format is used again while arguments are left, like POSIX printf.
+ *
+ * @param format Result of compileFormat()
+ * @param args Arguments
+ * @param out Output
+ * @return false if an argument was not a valid number (it printed as 0)
+ */
+bool formatArguments(const CompiledFormat& format, const std::vector<std::string>& args, OutputBuffer& out);
+
+/**
+ * Decode backslash escapes (\n, \t, \\, \0NNN, ...) as echo -e and %b do
+ *
+ * @param text Text with escapes
+ * @param out Output
+ * @return false if \c ended the output
+ */
+bool decodeEscapes(const std::string& text, OutputBuffer& out);
+
+#endif // FORMAT_HPP
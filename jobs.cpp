@@ -4,13 +4,15 @@
 #include <signal.h>
 
 // Add a new job to the job table
-void addJob(pid_t pgid, const std::string& command, JobState state, const std::vector<pid_t>& pids) {
+void addJob(pid_t pgid, const std::string& command, JobState state, const std::vector<pid_t>& pids,
+            const std::vector<int>& relayIds) {
     Job job;
     job.jobId = nextJobId++;
     job.pgid = pgid;
     job.command = command;
     job.state = state;
     job.pids = pids;
+    job.relayIds = relayIds;
     job.is_current = true;  // Mark as current (most recent)
     job.notified = false;   // Not yet notified about completion
     
@@ -21,6 +21,7 @@ struct Job
     std::string command;
     JobState state;
     std::vector<pid_t> pids;
+    std::vector<int> relayIds;  // Output relays of the job (see relay.hpp)
     bool is_current;
     bool notified;
 };
@@ -37,8 +38,10 @@ extern int nextJobId;
  * @param command Command string
  * @param state Initial state of the job
  * @param pids Vector of PIDs associated with the job
+ * @param relayIds Output relays the job writes into, if any
  */
-void addJob(pid_t pgid, const std::string& command, JobState state, const std::vector<pid_t>& pids);
+void addJob(pid_t pgid, const std::string& command, JobState state, const std::vector<pid_t>& pids,
+            const std::vector<int>& relayIds = std::vector<int>());
 
 /**
  * Remove a job from the job table
@@ -0,0 +1,710 @@
+#include "lexer.hpp"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEX_HAVE_X86 1
+#endif
+
+// Character classes used by the scalar scanner
+enum {
+    CLASS_WORD = 0,
+    CLASS_SPACE = 1,
+    CLASS_OP = 2,
+    CLASS_SPECIAL = 4
+};
+
+struct ClassTable {
+    unsigned char cls[256];
+    
+    ClassTable() {
+        for (int i = 0; i < 256; i++) cls[i] = CLASS_WORD;
+        const char* spaces = " \t\n\v\f\r";
+        for (const char* p = spaces; *p; p++) cls[(unsigned char)*p] = CLASS_SPACE;
+        const char* ops = "|&;<>";
+        for (const char* p = ops; *p; p++) cls[(unsigned char)*p] = CLASS_OP;
+        const char* specials = "\"'$\\";
+        for (const char* p = specials; *p; p++) cls[(unsigned char)*p] = CLASS_SPECIAL;
+    }
+};
+
+static const ClassTable classTable;
+
+static void scanScalar(const char* data, size_t len, uint64_t* space, uint64_t* op,
+                       uint64_t* special) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = classTable.cls[(unsigned char)data[i]];
+        uint64_t bit = 1ULL << (i & 63);
+        if (c & CLASS_SPACE) space[i >> 6] |= bit;
+        if (c & CLASS_OP) op[i >> 6] |= bit;
+        if (c & CLASS_SPECIAL) special[i >> 6] |= bit;
+    }
+}
+
+#ifdef LEX_HAVE_X86
+// Classify 16 bytes; returns the three masks in the low 16 bits
+static inline void classify16(__m128i v, uint32_t& sp, uint32_t& op, uint32_t& spc) {
+    // \t..\r is the range 9..13: (c - 9) <= 4 unsigned
+    __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    __m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+    __m128i s = _mm_or_si128(inRange, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    
+    __m128i o = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')), _mm_cmpeq_epi8(v, _mm_set1_epi8('&'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>')))));
+    
+    __m128i q = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('$')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+    
+    sp = (uint32_t)_mm_movemask_epi8(s);
+    op = (uint32_t)_mm_movemask_epi8(o);
+    spc = (uint32_t)_mm_movemask_epi8(q);
+}
+
+// 64 bytes per iteration as four 16-byte vectors, scalar tail
+static void scanSSE2(const char* data, size_t len, uint64_t* space, uint64_t* op,
+                     uint64_t* special) {
+    size_t blocks = len / 64;
+    for (size_t b = 0; b < blocks; b++) {
+        uint64_t s = 0, o = 0, q = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + b * 64 + k * 16));
+            uint32_t sp, opm, spc;
+            classify16(v, sp, opm, spc);
+            s |= (uint64_t)sp << (k * 16);
+            o |= (uint64_t)opm << (k * 16);
+            q |= (uint64_t)spc << (k * 16);
+        }
+        space[b] = s;
+        op[b] = o;
+        special[b] = q;
+    }
+    size_t done = blocks * 64;
+    scanScalar(data + done, len - done, space + blocks, op + blocks, special + blocks);
+}
+
+// 64 bytes per iteration as two 32-byte vectors, scalar tail
+__attribute__((target("avx2")))
+static void scanAVX2(const char* data, size_t len, uint64_t* space, uint64_t* op,
+                     uint64_t* special) {
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i four = _mm256_set1_epi8(4);
+    size_t blocks = len / 64;
+    for (size_t b = 0; b < blocks; b++) {
+        uint64_t s = 0, o = 0, q = 0;
+        for (int k = 0; k < 2; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + b * 64 + k * 32));
+            __m256i shifted = _mm256_sub_epi8(v, nine);
+            __m256i inRange = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, four), shifted);
+            __m256i sv = _mm256_or_si256(inRange, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+            __m256i ov = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')))));
+            __m256i qv = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+            s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(sv) << (k * 32);
+            o |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ov) << (k * 32);
+            q |= (uint64_t)(uint32_t)_mm256_movemask_epi8(qv) << (k * 32);
+        }
+        space[b] = s;
+        op[b] = o;
+        special[b] = q;
+    }
+    size_t done = blocks * 64;
+    scanScalar(data + done, len - done, space + blocks, op + blocks, special + blocks);
+}
+#endif
+
+typedef void (*ScanFn)(const char*, size_t, uint64_t*, uint64_t*, uint64_t*);
+
+static LexBackend bestBackend() {
+#ifdef LEX_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return LEX_AVX2;
+    if (__builtin_cpu_supports("sse2")) return LEX_SSE2;
+#endif
+    return LEX_SCALAR;
+}
+
+static ScanFn scanFor(LexBackend backend) {
+#ifdef LEX_HAVE_X86
+    if (backend == LEX_AVX2) return scanAVX2;
+    if (backend == LEX_SSE2) return scanSSE2;
+#endif
+    return scanScalar;
+}
+
+static LexBackend activeBackend = bestBackend();
+static ScanFn activeScan = scanFor(activeBackend);
+
+LexBackend lexSetBackend(LexBackend backend) {
+    LexBackend best = bestBackend();
+    // Backends are ordered by width, anything wider than the CPU supports falls back
+    if (backend == LEX_AUTO || backend > best) {
+        backend = best;
+    }
+    activeBackend = backend;
+    activeScan = scanFor(backend);
+    return backend;
+}
+
+const char* lexBackendName(LexBackend backend) {
+    switch (backend) {
+        case LEX_SCALAR: return "scalar";
+        case LEX_SSE2: return "sse2";
+        case LEX_AVX2: return "avx2";
+        case LEX_AUTO: break;
+    }
+    return lexBackendName(activeBackend);
+}
+
+void lexScan(const char* data, size_t len, LexMasks& masks) {
+    size_t words = len / 64 + 1;
+    masks.space.assign(words, 0);
+    masks.op.assign(words, 0);
+    masks.special.assign(words, 0);
+    activeScan(data, len, masks.space.data(), masks.op.data(), masks.special.data());
+}
+
+// Position of the first set bit of mask at or after pos (len if none)
+static inline size_t nextSet(const std::vector<uint64_t>& mask, size_t pos, size_t len) {
+    size_t w = pos >> 6;
+    uint64_t bits = mask[w] & (~0ULL << (pos & 63));
+    while (true) {
+        if (bits) {
+            size_t found = (w << 6) + __builtin_ctzll(bits);
+            return found < len ? found : len;
+        }
+        if (++w >= mask.size()) return len;
+        bits = mask[w];
+    }
+}
+
+// Position of the first clear bit of mask at or after pos (len if none)
+static inline size_t nextClear(const std::vector<uint64_t>& mask, size_t pos, size_t len) {
+    size_t w = pos >> 6;
+    uint64_t bits = ~mask[w] & (~0ULL << (pos & 63));
+    while (true) {
+        if (bits) {
+            size_t found = (w << 6) + __builtin_ctzll(bits);
+            return found < len ? found : len;
+        }
+        if (++w >= mask.size()) return len;
+        bits = ~mask[w];
+    }
+}
+
+static bool allDigits(const char* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') return false;
+    }
+    return n > 0;
+}
+
+static Token makeToken(size_t offset, size_t length, bool isOperator) {
+    Token t;
+    t.offset = offset;
+    t.length = length;
+    t.isOperator = isOperator;
+    t.quoted = false;
+    t.owned = false;
+    return t;
+}
+
+// Lex the operator starting at pos and return the position after it
+static size_t lexOperator(const char* data, size_t len, size_t pos, std::vector<Token>& tokens) {
+    char c = data[pos];
+    char n = pos + 1 < len ? data[pos + 1] : '\0';
+    Token t = makeToken(pos, 1, true);
+    if (c == '>' && (n == '>' || n == '&')) {           // >> >&
+        t.length = 2;
+    } else if (c == '<' && (n == '&' || n == '>')) {    // <& <>
+        t.length = 2;
+    } else if (c == '&' && n == '>') {                  // &> &>>
+        t.length = (pos + 2 < len && data[pos + 2] == '>') ? 3 : 2;
+    } else if ((c == '&' || c == '|') && n == c) {      // && ||
+        t.length = 2;
+    }
+    
+    // A digit-only word glued to < or > is the fd number of the redirection
+    if ((c == '<' || c == '>') && !tokens.empty()) {
+        const Token& prev = tokens.back();
+        if (!prev.isOperator && !prev.quoted && !prev.owned &&
+            prev.offset + prev.length == pos && allDigits(data + prev.offset, prev.length)) {
+            t.length += prev.length;
+            t.offset = prev.offset;
+            tokens.pop_back();
+        }
+    }
+    tokens.push_back(t);
+    return t.offset + t.length;
+}
+
+// An unquoted word token with exactly this text
+static bool isWord(const char* data, const Token& t, const char* word) {
+    return !t.isOperator && !t.owned && !t.quoted && t.length == strlen(word) &&
+           memcmp(data + t.offset, word, t.length) == 0;
+}
+
+// The next word is the regex after =~ in [[ ]]: | & < > in it are not operators
+static bool atRegexOperand(const char* data, const std::vector<Token>& tokens) {
+    if (tokens.empty() || !isWord(data, tokens.back(), "=~")) return false;
+    for (size_t i = tokens.size() - 1; i-- > 0;) {
+        if (isWord(data, tokens[i], "]]")) return false;
+        if (isWord(data, tokens[i], "[[")) return true;
+    }
+    return false;
+}
+
+// Lines without quotes, backslashes or $: tokens come straight from the masks
+static void lexPlain(const char* data, size_t len, const LexMasks& masks,
+                     const std::vector<uint64_t>& delim, std::vector<Token>& tokens) {
+    size_t pos = nextClear(masks.space, 0, len);
+    while (pos < len) {
+        bool isOp = (masks.op[pos >> 6] >> (pos & 63)) & 1;
+        
+        if (atRegexOperand(data, tokens)) {
+            // [[ $x =~ a|b ]]: the regex runs until whitespace or ;
+            size_t end = pos;
+            while (end < len && !((masks.space[end >> 6] >> (end & 63)) & 1) && data[end] != ';') end++;
+            tokens.push_back(makeToken(pos, end - pos, false));
+            pos = end;
+        } else if (!isOp) {
+            // Word: runs until the next whitespace or operator character
+            size_t end = nextSet(delim, pos, len);
+            tokens.push_back(makeToken(pos, end - pos, false));
+            pos = end;
+        } else {
+            pos = lexOperator(data, len, pos, tokens);
+        }
+        
+        if (pos < len) {
+            pos = nextClear(masks.space, pos, len);
+        }
+    }
+}
+
+// States of the quoting state machine
+enum LexState {
+    ST_SPACE,       // Between tokens
+    ST_WORD,        // Inside an unquoted word
+    ST_WORD_ESC,    // After a backslash in a word
+    ST_SQUOTE,      // Inside '...'
+    ST_DQUOTE,      // Inside "..."
+    ST_DQUOTE_ESC,  // After a backslash inside "..."
+    ST_DOLLAR,      // After an unquoted $ (could start $'...')
+    ST_ANSI,        // Inside $'...'
+    ST_ANSI_ESC,    // After a backslash inside $'...'
+    ST_COMMENT,     // After a # that starts a word, up to the end of the line
+    ST_COUNT
+};
+
+// Character classes of the quoting state machine
+enum LexClass {
+    LC_OTHER,
+    LC_SPACE,
+    LC_NEWLINE,
+    LC_OP,
+    LC_SQUOTE,
+    LC_DQUOTE,
+    LC_BSLASH,
+    LC_DOLLAR,
+    LC_HASH,
+    LC_COUNT
+};
+
+// What to do with the current character
+enum LexAction {
+    ACT_SKIP,       // Whitespace between tokens
+    ACT_KEEP,       // Append the character to the token
+    ACT_DROP,       // Drop the character (backslash, held $)
+    ACT_QUOTE,      // Drop a quote character, the token is quoted
+    ACT_END,        // Whitespace ends the token
+    ACT_OP,         // Operator character ends the token and starts an operator
+    ACT_DQ_ESC,     // Backslash in "..." not followed by $ ` " \ stays literal
+    ACT_DOLLAR,     // Held $ was not $'...': mark a variable or keep it, reprocess in ST_WORD
+    ACT_DQ_DOLLAR,  // $ in "...": mark a variable or keep it
+    ACT_ANSI,       // Decode a $'...' escape sequence
+    ACT_COMMENT     // # at the start of a word: the rest of the line is ignored
+};
+
+struct LexTransition {
+    unsigned char next;
+    unsigned char action;
+};
+
+#define T(state, action) { state, action }
+static const LexTransition lexTable[ST_COUNT][LC_COUNT] = {
+    //            OTHER                    SPACE                    NEWLINE                  OP                       SQUOTE                   DQUOTE                   BSLASH                        DOLLAR                       HASH
+    /* SPACE  */ { T(ST_WORD, ACT_KEEP),    T(ST_SPACE, ACT_SKIP),   T(ST_SPACE, ACT_SKIP),   T(ST_SPACE, ACT_OP),     T(ST_SQUOTE, ACT_QUOTE), T(ST_DQUOTE, ACT_QUOTE), T(ST_WORD_ESC, ACT_DROP),     T(ST_DOLLAR, ACT_DROP), T(ST_COMMENT, ACT_COMMENT) },
+    /* WORD   */ { T(ST_WORD, ACT_KEEP),    T(ST_SPACE, ACT_END),    T(ST_SPACE, ACT_END),    T(ST_SPACE, ACT_OP),     T(ST_SQUOTE, ACT_QUOTE), T(ST_DQUOTE, ACT_QUOTE), T(ST_WORD_ESC, ACT_DROP),     T(ST_DOLLAR, ACT_DROP), T(ST_WORD, ACT_KEEP) },
+    /* WESC   */ { T(ST_WORD, ACT_KEEP),    T(ST_WORD, ACT_KEEP),    T(ST_WORD, ACT_DROP),    T(ST_WORD, ACT_KEEP),    T(ST_WORD, ACT_KEEP),    T(ST_WORD, ACT_KEEP),    T(ST_WORD, ACT_KEEP),         T(ST_WORD, ACT_KEEP), T(ST_WORD, ACT_KEEP) },
+    /* SQUOTE */ { T(ST_SQUOTE, ACT_KEEP),  T(ST_SQUOTE, ACT_KEEP),  T(ST_SQUOTE, ACT_KEEP),  T(ST_SQUOTE, ACT_KEEP),  T(ST_WORD, ACT_QUOTE),   T(ST_SQUOTE, ACT_KEEP),  T(ST_SQUOTE, ACT_KEEP),       T(ST_SQUOTE, ACT_KEEP), T(ST_SQUOTE, ACT_KEEP) },
+    /* DQUOTE */ { T(ST_DQUOTE, ACT_KEEP),  T(ST_DQUOTE, ACT_KEEP),  T(ST_DQUOTE, ACT_KEEP),  T(ST_DQUOTE, ACT_KEEP),  T(ST_DQUOTE, ACT_KEEP),  T(ST_WORD, ACT_QUOTE),   T(ST_DQUOTE_ESC, ACT_DROP),   T(ST_DQUOTE, ACT_DQ_DOLLAR), T(ST_DQUOTE, ACT_KEEP) },
+    /* DQESC  */ { T(ST_DQUOTE, ACT_DQ_ESC), T(ST_DQUOTE, ACT_DQ_ESC), T(ST_DQUOTE, ACT_DROP), T(ST_DQUOTE, ACT_DQ_ESC), T(ST_DQUOTE, ACT_DQ_ESC), T(ST_DQUOTE, ACT_KEEP), T(ST_DQUOTE, ACT_KEEP),     T(ST_DQUOTE, ACT_KEEP), T(ST_DQUOTE, ACT_DQ_ESC) },
+    /* DOLLAR */ { T(ST_WORD, ACT_DOLLAR),  T(ST_WORD, ACT_DOLLAR),  T(ST_WORD, ACT_DOLLAR),  T(ST_WORD, ACT_DOLLAR),  T(ST_ANSI, ACT_QUOTE),   T(ST_WORD, ACT_DOLLAR),  T(ST_WORD, ACT_DOLLAR),       T(ST_WORD, ACT_DOLLAR), T(ST_WORD, ACT_DOLLAR) },
+    /* ANSI   */ { T(ST_ANSI, ACT_KEEP),    T(ST_ANSI, ACT_KEEP),    T(ST_ANSI, ACT_KEEP),    T(ST_ANSI, ACT_KEEP),    T(ST_WORD, ACT_QUOTE),   T(ST_ANSI, ACT_KEEP),    T(ST_ANSI_ESC, ACT_DROP),     T(ST_ANSI, ACT_KEEP), T(ST_ANSI, ACT_KEEP) },
+    /* AESC   */ { T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),    T(ST_ANSI, ACT_ANSI),         T(ST_ANSI, ACT_ANSI), T(ST_ANSI, ACT_ANSI) },
+    /* CMT    */ { T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP), T(ST_COMMENT, ACT_SKIP) },
+};
+#undef T
+
+struct LexClassTable {
+    unsigned char cls[256];
+    
+    LexClassTable() {
+        for (int i = 0; i < 256; i++) cls[i] = LC_OTHER;
+        const char* spaces = " \t\v\f\r";
+        for (const char* p = spaces; *p; p++) cls[(unsigned char)*p] = LC_SPACE;
+        const char* ops = "|&;<>";
+        for (const char* p = ops; *p; p++) cls[(unsigned char)*p] = LC_OP;
+        cls[(unsigned char)'\n'] = LC_NEWLINE;
+        cls[(unsigned char)'\''] = LC_SQUOTE;
+        cls[(unsigned char)'"'] = LC_DQUOTE;
+        cls[(unsigned char)'\\'] = LC_BSLASH;
+        cls[(unsigned char)'$'] = LC_DOLLAR;
+        cls[(unsigned char)'#'] = LC_HASH;
+    }
+};
+
+static const LexClassTable lexClasses;
+
+// Characters that make a $ the start of a variable reference: $NAME, ${NAME}
+static inline bool isVariableStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '{' ||
+           (c >= '0' && c <= '9') || c == '#' ||  // $1, $#: positional parameters
+           c == '?';                                // $?: last exit status
+}
+
+/**
+ * Token under construction: stays a view into the line until a kept
+ * character is not adjacent to the view, then moves to the end of the
+ * unescaped buffer (only one token is built at a time, so it can grow there)
+ */
+struct TokenBuilder {
+    const char* data;
+    std::string* unescaped;
+    Token token;
+    bool active;
+    
+    void start() {
+        if (!active) {
+            token = makeToken(0, 0, false);
+            active = true;
+        }
+    }
+    
+    void own() {
+        size_t ownedStart = unescaped->size();
+        unescaped->append(data + token.offset, token.length);
+        token.offset = ownedStart;
+        token.owned = true;
+    }
+    
+    void keepRange(size_t from, size_t to) {
+        if (!token.owned) {
+            if (token.length == 0) {
+                token.offset = from;
+                token.length = to - from;
+                return;
+            }
+            if (token.offset + token.length == from) {
+                token.length += to - from;
+                return;
+            }
+            own();
+        }
+        unescaped->append(data + from, to - from);
+        token.length += to - from;
+    }
+    
+    void put(char c) {
+        if (!token.owned) {
+            own();
+        }
+        unescaped->push_back(c);
+        token.length++;
+    }
+    
+    void finish(std::vector<Token>& tokens) {
+        if (!active) return;
+        active = false;
+        
+        // An escaped newline between words is a continuation, not an empty word
+        if (token.length == 0 && !token.quoted) return;
+        tokens.push_back(token);
+    }
+};
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decode the $'...' escape whose letter is at pos, return the position after it
+static size_t decodeAnsiEscape(const char* data, size_t len, size_t pos, TokenBuilder& b) {
+    char c = data[pos];
+    switch (c) {
+        case 'a': b.put('\a'); return pos + 1;
+        case 'b': b.put('\b'); return pos + 1;
+        case 'e':
+        case 'E': b.put('\033'); return pos + 1;
+        case 'f': b.put('\f'); return pos + 1;
+        case 'n': b.put('\n'); return pos + 1;
+        case 'r': b.put('\r'); return pos + 1;
+        case 't': b.put('\t'); return pos + 1;
+        case 'v': b.put('\v'); return pos + 1;
+        case '\\':
+        case '\'':
+        case '"':
+        case '?': b.put(c); return pos + 1;
+        case 'x': {
+            // \xHH: one or two hex digits
+            int value = 0;
+            size_t end = pos + 1;
+            while (end < len && end < pos + 3 && hexValue(data[end]) >= 0) {
+                value = value * 16 + hexValue(data[end]);
+                end++;
+            }
+            if (end == pos + 1) {
+                b.put('\\');
+                b.put('x');
+            } else {
+                b.put((char)value);
+            }
+            return end;
+        }
+        default:
+            if (c >= '0' && c <= '7') {
+                // \nnn: one to three octal digits
+                int value = 0;
+                size_t end = pos;
+                while (end < len && end < pos + 3 && data[end] >= '0' && data[end] <= '7') {
+                    value = value * 8 + (data[end] - '0');
+                    end++;
+                }
+                b.put((char)value);
+                return end;
+            }
+            // Unknown escapes keep their backslash
+            b.put('\\');
+            b.put(c);
+            return pos + 1;
+    }
+}
+
+/**
+ * Find the "))" closing the "((" at pos ($(( )) and (( )))
+ * Parentheses inside the expression nest.
+ *
+ * @return Position of the closing "))", len if there is none
+ */
+static size_t arithmeticEnd(const char* data, size_t len, size_t pos) {
+    int depth = 0;
+    for (size_t i = pos + 2; i < len; i++) {
+        if (data[i] == '(') {
+            depth++;
+        } else if (data[i] == ')') {
+            if (depth == 0) return i + 1 < len && data[i + 1] == ')' ? i : len;
+            depth--;
+        }
+    }
+    return len;
+}
+
+// Lines with quoting: one pass through the state machine, no backtracking
+static int lexQuoted(const char* data, size_t len, const std::vector<uint64_t>& stops,
+                     std::vector<Token>& tokens, std::string& unescaped) {
+    TokenBuilder b;
+    b.data = data;
+    b.unescaped = &unescaped;
+    b.active = false;
+    
+    int state = ST_SPACE;
+    size_t pos = 0;
+    while (pos < len) {
+        // Plain runs inside words and single quotes are copied in one step
+        if (state == ST_WORD && lexClasses.cls[(unsigned char)data[pos]] == LC_OTHER) {
+            size_t end = nextSet(stops, pos, len);
+            b.keepRange(pos, end);
+            pos = end;
+            continue;
+        }
+        // (( expression )) as a command: the words "((", the expression and "))",
+        // so < > & | inside it are not operators
+        if (state == ST_SPACE && data[pos] == '(' && pos + 1 < len && data[pos + 1] == '(') {
+            size_t end = arithmeticEnd(data, len, pos);
+            if (end < len) {
+                tokens.push_back(makeToken(pos, 2, false));
+                tokens.push_back(makeToken(pos + 2, end - pos - 2, false));
+                tokens.push_back(makeToken(end, 2, false));
+                pos = end + 2;
+                continue;
+            }
+        }
+        if (state == ST_SQUOTE) {
+            const char* q = (const char*)memchr(data + pos, '\'', len - pos);
+            size_t end = q ? (size_t)(q - data) : len;
+            b.keepRange(pos, end);
+            pos = end;
+            if (pos == len) break;
+        }
+        
+        // The regex after =~ in [[ ]] keeps | & < > as characters: [[ $x =~ ^a(b|c)$ ]]
+        if ((state == ST_SPACE || state == ST_WORD) && lexClasses.cls[(unsigned char)data[pos]] == LC_OP &&
+            data[pos] != ';' && atRegexOperand(data, tokens)) {
+            b.start();
+            b.keepRange(pos, pos + 1);
+            state = ST_WORD;
+            pos++;
+            continue;
+        }
+        
+        const LexTransition& t = lexTable[state][lexClasses.cls[(unsigned char)data[pos]]];
+        state = t.next;
+        switch (t.action) {
+            case ACT_SKIP:
+                break;
+            case ACT_KEEP:
+                b.start();
+                b.keepRange(pos, pos + 1);
+                break;
+            case ACT_DROP:
+                b.start();
+                break;
+            case ACT_QUOTE:
+                b.start();
+                b.token.quoted = true;
+                break;
+            case ACT_END:
+                b.finish(tokens);
+                break;
+            case ACT_OP:
+                b.finish(tokens);
+                pos = lexOperator(data, len, pos, tokens);
+                continue;
+            case ACT_DQ_ESC:
+                b.keepRange(pos - 1, pos + 1);
+                break;
+            case ACT_DOLLAR:
+                // $(( expression )): marked like a variable, kept as it is up to the "))"
+                if (data[pos] == '(' && pos + 1 < len && data[pos + 1] == '(') {
+                    size_t end = arithmeticEnd(data, len, pos);
+                    if (end < len) {
+                        b.put(LEX_VAR_MARK);
+                        b.keepRange(pos, end + 2);
+                        pos = end + 2;
+                        continue;
+                    }
+                }
+                // Reprocess this character as part of a plain word
+                if (isVariableStart(data[pos])) {
+                    b.put(LEX_VAR_MARK);
+                } else {
+                    b.keepRange(pos - 1, pos);
+                }
+                continue;
+            case ACT_DQ_DOLLAR:
+                if (pos + 2 < len && data[pos + 1] == '(' && data[pos + 2] == '(') {
+                    size_t end = arithmeticEnd(data, len, pos + 1);
+                    if (end < len) {
+                        b.put(LEX_VAR_MARK);
+                        b.keepRange(pos + 1, end + 2);
+                        pos = end + 2;
+                        continue;
+                    }
+                }
+                if (pos + 1 < len && isVariableStart(data[pos + 1])) {
+                    b.put(LEX_VAR_MARK);
+                } else {
+                    b.keepRange(pos, pos + 1);
+                }
+                break;
+            case ACT_ANSI:
+                pos = decodeAnsiEscape(data, len, pos, b);
+                continue;
+            case ACT_COMMENT:
+                pos = len;
+                continue;
+        }
+        pos++;
+    }
+    
+    switch (state) {
+        case ST_DOLLAR:
+            b.keepRange(len - 1, len);
+            break;
+        case ST_WORD_ESC:
+        case ST_SQUOTE:
+        case ST_DQUOTE:
+        case ST_DQUOTE_ESC:
+        case ST_ANSI:
+        case ST_ANSI_ESC:
+            b.finish(tokens);
+            return LEX_INCOMPLETE;
+        default:
+            break;
+    }
+    b.finish(tokens);
+    return LEX_COMPLETE;
+}
+
+int lexLine(const char* data, size_t len, std::vector<Token>& tokens, std::string& unescaped) {
+    tokens.clear();
+    unescaped.clear();
+    
+    // Masks are reused between calls, a line only allocates when it is longer than any before it
+    static LexMasks masks;
+    lexScan(data, len, masks);
+    
+    // Word boundaries are whitespace or operator characters
+    static std::vector<uint64_t> delim;
+    delim.resize(masks.space.size());
+    bool hasSpecial = false;
+    for (size_t w = 0; w < delim.size(); w++) {
+        hasSpecial |= masks.special[w] != 0;
+        delim[w] = masks.space[w] | masks.op[w];
+    }
+    
+    // A # is rare enough to be looked for separately: it may start a comment,
+    // and so is "((", which may start an arithmetic command
+    if (!hasSpecial && !memchr(data, '#', len) && !memmem(data, len, "((", 2)) {
+        lexPlain(data, len, masks, delim, tokens);
+        return LEX_COMPLETE;
+    }
+    
+    // Plain runs inside a word end at whitespace, operators or quoting characters
+    for (size_t w = 0; w < delim.size(); w++) {
+        delim[w] |= masks.special[w];
+    }
+    return lexQuoted(data, len, delim, tokens, unescaped);
+}
+
+size_t lexFindLineEnd(const char* data, size_t len, int& state) {
+    for (size_t pos = 0; pos < len; pos++) {
+        int cls = lexClasses.cls[(unsigned char)data[pos]];
+        if (cls == LC_NEWLINE && (state == ST_SPACE || state == ST_WORD || state == ST_DOLLAR ||
+                                  state == ST_COMMENT)) {
+            state = ST_SPACE;
+            return pos;
+        }
+        
+        const LexTransition& t = lexTable[state][cls];
+        if (t.action == ACT_DOLLAR) {
+            // The held $ was literal, this character belongs to a plain word
+            state = lexTable[ST_WORD][cls].next;
+        } else {
+            state = t.next;
+        }
+    }
+    return len;
+}
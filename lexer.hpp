@@ -0,0 +1,132 @@
+#ifndef LEXER_HPP
+#define LEXER_HPP
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Structure representing a single token as a view into the source line
+ * Tokens are zero-copy: they only store where they are in the line.
+ * Only a token whose text differs from the line (quotes removed around
+ * other characters, escapes decoded) is copied, into the unescaped buffer
+ * filled by lexLine().
+ */
+struct Token {
+    size_t offset;      // Start of the token (in the line, or in the unescaped buffer if owned)
+    size_t length;      // Length of the token in bytes
+    bool isOperator;    // true for | & ; && || and redirections (< > >> <> <& >& &> &>>)
+    bool quoted;        // true if any part of the word was quoted or escaped
+    bool owned;         // true if the text is in the unescaped buffer, not in the line
+};
+
+/**
+ * Marks an unquoted or double-quoted $ that starts a variable reference
+ * ($NAME or ${NAME}) or an arithmetic expansion ($((expression)), kept
+ * with its parentheses) in token text. Expansion happens later, when the
+ * command runs; a $ without the mark (quoted, escaped) is literal.
+ */
+#define LEX_VAR_MARK '\x01'
+
+/**
+ * Result of lexing a line
+ */
+enum LexStatus {
+    LEX_COMPLETE,       // All quotes closed
+    LEX_INCOMPLETE      // Open quote or trailing backslash, more input needed
+};
+
+/**
+ * Character class bitmasks for a line, one bit per byte (bit i of word i/64)
+ */
+struct LexMasks {
+    std::vector<uint64_t> space;    // Whitespace: ' ', \t, \n, \v, \f, \r
+    std::vector<uint64_t> op;       // Operator characters: | & ; < >
+    std::vector<uint64_t> special;  // Quoting and expansion characters: quotes, $ and backslash
+};
+
+/**
+ * Scanner implementation used to build the class bitmasks
+ */
+enum LexBackend {
+    LEX_AUTO,       // Best backend supported by this CPU
+    LEX_SCALAR,     // Portable table-driven scan, one byte at a time
+    LEX_SSE2,       // 16 bytes per compare (x86-64 only)
+    LEX_AVX2        // 32 bytes per compare (x86-64 with AVX2 only)
+};
+
+/**
+ * Select the scanner used by lexLine() (LEX_AUTO picks the fastest one)
+ * Unsupported backends fall back to the best supported one
+ * 
+ * @param backend Requested backend
+ * @return Backend actually in use
+ */
+LexBackend lexSetBackend(LexBackend backend);
+
+/**
+ * Get the name of a backend ("scalar", "sse2", "avx2")
+ * 
+ * @param backend Backend to name
+ * @return Backend name
+ */
+const char* lexBackendName(LexBackend backend);
+
+/**
+ * Classify every byte of a line into the whitespace/operator/special masks
+ * 
+ * @param data Line contents
+ * @param len Line length in bytes
+ * @param masks Output masks, resized to cover the whole line
+ */
+void lexScan(const char* data, size_t len, LexMasks& masks);
+
+/**
+ * Split a line into word and operator tokens
+ * Words are separated by whitespace and by operator characters, so
+ * "ls|wc" and "ls | wc" give the same tokens. A run of digits directly
+ * before < or > is part of the operator ("2>", "2>>", "2>&").
+ * 
+ * Lines containing quotes, backslashes or $ go through a table-driven
+ * state machine in a single pass. It supports '...', "...", backslash
+ * escapes, $'...' (ANSI-C escapes) and backslash-newline continuation.
+ * (( expression )) at the start of a word gives the words "((", the
+ * expression as it is and "))".
+ * Variable references are marked with LEX_VAR_MARK, not expanded.
+ * 
+ * @param data Line contents
+ * @param len Line length in bytes
+ * @param tokens Output tokens (cleared first)
+ * @param unescaped Output text of the owned tokens (cleared first)
+ * @return LEX_COMPLETE, or LEX_INCOMPLETE if a quote or escape is left open
+ */
+int lexLine(const char* data, size_t len, std::vector<Token>& tokens, std::string& unescaped);
+
+/**
+ * Find the end of a logical line in streamed input
+ * A logical line ends at a newline that is not quoted and not escaped.
+ * The quoting state is carried in state, so a quote or a backslash-newline
+ * may span several calls. Start with state = 0 and keep passing the same
+ * variable for the following chunks.
+ * 
+ * @param data Next chunk of input
+ * @param len Chunk length in bytes
+ * @param state Quoting state, updated (reset to 0 when a line end is found)
+ * @return Position of the terminating newline, or len if the line continues
+ */
+size_t lexFindLineEnd(const char* data, size_t len, int& state);
+
+/**
+ * Get the text of a token
+ * 
+ * @param line Source line the token was produced from
+ * @param unescaped Unescaped buffer filled by the same lexLine() call
+ * @param token Token to copy
+ * @return Token text
+ */
+inline std::string tokenText(const char* line, const std::string& unescaped, const Token& token) {
+    const char* base = token.owned ? unescaped.data() : line;
+    return std::string(base + token.offset, token.length);
+}
+
+#endif // LEXER_HPP
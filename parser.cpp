@@ -1,70 +1,774 @@
 #include "parser.hpp"
+#include "lexer.hpp"
+#include "symbols.hpp"
+#include "variables.hpp"
+#include <utility>
+#include <algorithm>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+
+ParsedCommand::ParsedCommand(){}
+
+// Group members are copied too: executeList() expands a copy of a function body in place
+ParsedCommand::ParsedCommand(const ParsedCommand& other)
+    : args(other.args), redirections(other.redirections), isBackground(other.isBackground),
+      lineMerge(other.lineMerge), definition(other.definition) {
+    for (const auto& member : other.group) {
+        group.push_back(std::make_shared<ParsedCommand>(*member));
+    }
+}
+
+ParsedCommand& ParsedCommand::operator=(const ParsedCommand& other) {
+    if (this != &other) {
+        ParsedCommand copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+ParsedPipeline::ParsedPipeline(){}
 
 std::vector<std::string> tokenize(const std::string& line) {
     std::vector<std::string> tokens;
-    std::istringstream iss(line);
-    std::string token;
+    static std::vector<Token> views;
+    static std::string unescaped;
     
-    while (iss >> token) {
-        tokens.push_back(token);
+    lexLine(line.data(), line.size(), views, unescaped);
+    tokens.reserve(views.size());
+    for (size_t i = 0; i < views.size(); i++) {
+        tokens.push_back(tokenText(line.data(), unescaped, views[i]));
     }
     
     return tokens;
 }
 
-ParsedPipeline parseCommandLine(const std::vector<std::string>& tokens) {
+static bool allDigits(const std::string& s, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        if (s[i] < '0' || s[i] > '9') return false;
+    }
+    return to > from;
+}
+
+static Redirection makeRedirection(RedirType type, int fd) {
+    Redirection r;
+    r.type = type;
+    r.fd = fd;
+    r.srcFd = -1;
+    r.flags = 0;
+    return r;
+}
+
+bool isRedirectionOperator(const std::string& op) {
+    size_t digits = 0;
+    while (digits < op.size() && op[digits] >= '0' && op[digits] <= '9') digits++;
+    std::string base = op.substr(digits);
+    if (base == "&>" || base == "&>>") {
+        return digits == 0;
+    }
+    return base == "<" || base == ">" || base == ">>" || base == "<>" ||
+           base == "<&" || base == ">&";
+}
+
+/**
+ * Parse a number with an optional unit suffix ("10M", "30s")
+ * 
+ * @param value Text to parse
+ * @param units Suffix letters, in the same order as scales
+ * @param scales Multiplier for each suffix letter
+ * @param result Output: the number times the suffix's multiplier
+ * @return false if value is not a positive number with a known suffix
+ */
+static bool parseScaled(const std::string& value, const char* units,
+                        const unsigned long long* scales, unsigned long long& result) {
+    size_t digits = 0;
+    while (digits < value.size() && value[digits] >= '0' && value[digits] <= '9') digits++;
+    if (digits == 0 || digits > 12 || value.size() > digits + 1) {
+        return false;
+    }
+    
+    unsigned long long scale = 1;
+    if (digits < value.size()) {
+        const char* unit = strchr(units, value[digits]);
+        if (!unit) return false;
+        scale = scales[unit - units];
+    }
+    result = strtoull(value.substr(0, digits).c_str(), nullptr, 10) * scale;
+    return result > 0;
+}
+
+/**
+ * Parse a relay modifier list such as "{gz}", "{ts=mono}" or "{rotate=100M,keep=3}"
+ * 
+ * @param word Word following a redirection operator
+ * @param relay Output: the modifiers
+ * @return false if word is not a valid modifier list (it is then a file name)
+ */
+static bool parseRelaySpec(const std::string& word, RelaySpec& relay) {
+    if (word.size() < 3 || word[0] != '{' || word[word.size() - 1] != '}') {
+        return false;
+    }
+    
+    RelaySpec spec;
+    size_t pos = 1;
+    while (pos < word.size() - 1) {
+        size_t end = word.find(',', pos);
+        if (end == std::string::npos) end = word.size() - 1;
+        std::string item = word.substr(pos, end - pos);
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+        
+        if (key == "gz") {
+            if (value.empty()) {
+                spec.gzipLevel = 6;
+            } else if (value.size() == 1 && value[0] >= '0' && value[0] <= '9') {
+                spec.gzipLevel = value[0] - '0';
+            } else {
+                return false;
+            }
+        } else if (key == "rotate") {
+            static const unsigned long long sizes[] = { 1ULL << 10, 1ULL << 20, 1ULL << 30 };
+            if (!parseScaled(value, "KMG", sizes, spec.rotateSize)) return false;
+        } else if (key == "every") {
+            static const unsigned long long times[] = { 1, 60, 3600, 86400 };
+            unsigned long long seconds;
+            if (!parseScaled(value, "smhd", times, seconds) || seconds > 0xffffffffULL) return false;
+            spec.rotateSeconds = seconds;
+        } else if (key == "ts") {
+            if (value.empty() || value == "wall") {
+                spec.timestamps = TS_WALL;
+            } else if (value == "mono") {
+                spec.timestamps = TS_MONO;
+            } else {
+                return false;
+            }
+        } else if (key == "crc32c" && value.empty()) {
+            spec.checksum = true;
+        } else if (key == "keep") {
+            if (!allDigits(value, 0, value.size()) || value.size() > 4) return false;
+            spec.keep = atoi(value.c_str());
+        } else {
+            return false;
+        }
+        pos = end + 1;
+    }
+    
+    relay = spec;
+    return relay.active();
+}
+
+/**
+ * Append the redirection for operator op and its word to cmd
+ * 
+ * @param op Operator text, with optional fd number ("2>>", "2>&")
+ * @param word Word following the operator (file, fd number or -)
+ * @param relay Modifiers given between operator and file, if any
+ * @param cmd Command to add the redirection to
+ * @return false if the word does not fit the operator
+ */
+static bool parseRedirection(const std::string& op, const std::string& word,
+                             const RelaySpec& relay, ParsedCommand& cmd) {
+    size_t digits = 0;
+    while (digits < op.size() && op[digits] >= '0' && op[digits] <= '9') digits++;
+    std::string base = op.substr(digits);
+    int fd = digits ? atoi(op.substr(0, digits).c_str()) : (base[0] == '<' ? 0 : 1);
+    
+    // N>&M and N<&M: duplicate, N>&-: close, N>&p and N<&p: coprocess, >&file: same as &>file
+    if (base == "<&" || base == ">&") {
+        if (word == "-") {
+            cmd.redirections.push_back(makeRedirection(REDIR_CLOSE, fd));
+            return true;
+        }
+        if (word == "p") {
+            Redirection r = makeRedirection(REDIR_DUP, fd);
+            r.srcFd = base == ">&" ? REDIR_COPROC_WRITE : REDIR_COPROC_READ;
+            cmd.redirections.push_back(r);
+            return true;
+        }
+        if (allDigits(word, 0, word.size())) {
+            Redirection r = makeRedirection(REDIR_DUP, fd);
+            r.srcFd = atoi(word.c_str());
+            cmd.redirections.push_back(r);
+            return true;
+        }
+        if (base == "<&" || digits) {
+            return false;
+        }
+        base = "&>";
+    }
+    
+    if (word.empty()) {
+        return false;
+    }
+    
+    // Modifiers only make sense for a file that is written
+    if (relay.active() && (base == "<" || base == "<>")) {
+        return false;
+    }
+    
+    Redirection r = makeRedirection(REDIR_OPEN, fd);
+    r.relay = relay;
+    r.path = word;
+    if (base == "<") {                  // Redirect for Input
+        r.flags = O_RDONLY;
+    } else if (base == ">" || base == "&>") {   // Redirect Output (truncate)
+        r.flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (base == ">>" || base == "&>>") { // Redirect and Append Output
+        r.flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {                            // <>: Open for reading and writing
+        r.flags = O_RDWR | O_CREAT;
+    }
+    cmd.redirections.push_back(r);
+    
+    // &> and &>> send stderr to the same open file
+    if (base[0] == '&') {
+        Redirection dup = makeRedirection(REDIR_DUP, 2);
+        dup.srcFd = 1;
+        cmd.redirections.push_back(dup);
+    }
+    return true;
+}
+
+/**
+ * Build the command list from a token sequence
+ * Shared by parseCommandLine() and parseLine(), which differ only in how
+ * they tell operators from words
+ * 
+ * @param count Number of tokens
+ * @param text Callable returning the text of token i
+ * @param isOp Callable returning true if token i is an operator
+ */
+template <typename Text, typename IsOp>
+static ParsedList parseTokens(size_t count, Text text, IsOp isOp) {
+    ParsedList list;
     ParsedPipeline result;
     ParsedCommand currentCmd;
+    ParsedCommand group;        // Parallel group being parsed
+    bool inGroup = false;
     
-    for (size_t i = 0; i < tokens.size(); i++) {
-        if (tokens[i] == "&" && i == tokens.size() - 1) { // Background Execution
-            result.isBackground = true;
-            continue;   // Do not add "&"" to args
+    for (size_t i = 0; i < count; i++) {
+        if (!isOp(i)) {
+            const std::string& word = text(i);
+            
+            // { a & b } and {{ a & b }} open a parallel group in place of a command
+            if (!inGroup && (word == "{" || word == "{{") && currentCmd.args.empty() &&
+                currentCmd.redirections.empty() && !currentCmd.isGroup()) {
+                inGroup = true;
+                group = ParsedCommand();
+                group.lineMerge = (word == "{{");
+                continue;
+            }
+            if (inGroup && word == (group.lineMerge ? "}}" : "}")) {
+                if (!currentCmd.args.empty()) {
+                    group.group.push_back(std::make_shared<ParsedCommand>(std::move(currentCmd)));
+                }
+                if (!group.isGroup()) {
+                    list.error = "empty group";
+                    return list;
+                }
+                // Redirections after the closing brace belong to the whole group
+                currentCmd = std::move(group);
+                inGroup = false;
+                continue;
+            }
+            // [[ ... ]]: operators inside are words of the expression (&&, ||, <, >)
+            if (word == "[[" && currentCmd.args.empty() && !currentCmd.isGroup()) {
+                currentCmd.args.push_back(word);
+                size_t j = i + 1;
+                for (; j < count && (isOp(j) || text(j) != "]]"); j++) {
+                    currentCmd.args.push_back(text(j));
+                }
+                if (j == count) {
+                    list.error = "missing ]]";
+                    return list;
+                }
+                currentCmd.args.push_back("]]");
+                i = j;
+                continue;
+            }
+            if (currentCmd.isGroup()) {
+                list.error = "unexpected word after group: " + word;
+                return list;
+            }
+            currentCmd.args.push_back(word);
+            continue;
         }
-        else if (tokens[i] == "|") {
+        
+        const std::string op = text(i);
+        if (inGroup && (op == "&" || op == ";")) {  // Next member of the group
             if (!currentCmd.args.empty()) {
-                result.commands.push_back(currentCmd);
-                result.hasPipes = true;
+                group.group.push_back(std::make_shared<ParsedCommand>(std::move(currentCmd)));
             }
             currentCmd = ParsedCommand();
         }
-        else if (tokens[i] == ">") {	// Redirect Output
-            if (i + 1 < tokens.size()) {
-                currentCmd.outputFile = tokens[++i];
-                currentCmd.appendMode = false;
-            }
+        else if (inGroup && op == "|") {
+            list.error = "pipes are not supported inside a group";
+            return list;
         }
-        else if (tokens[i] == ">>") {	// Redirect and Append Output
-            if (i + 1 < tokens.size()) {
-                currentCmd.outputFile = tokens[++i];
-                currentCmd.appendMode = true;
+        else if (inGroup && (op == "&&" || op == "||")) {
+            list.error = op + " is not supported inside a group";
+            return list;
+        }
+        else if (op == "&&" || op == "||") {    // End of pipeline, the next one runs on its status
+            if (!currentCmd.args.empty() || currentCmd.isGroup()) {
+                result.commands.push_back(std::move(currentCmd));
+            }
+            if (result.commands.empty()) {
+                list.error = "missing command before " + op;
+                return list;
             }
+            list.pipelines.push_back(std::move(result));
+            result = ParsedPipeline();
+            result.runIf = op == "&&" ? RUN_IF_TRUE : RUN_IF_FALSE;
+            currentCmd = ParsedCommand();
         }
-        else if (tokens[i] == "<") {	// Redirect for Input
-            if (i + 1 < tokens.size()) {
-                currentCmd.inputFile = tokens[++i];
+        else if (op == "&" || op == ";") {   // End of pipeline (& runs it in background)
+            if (!currentCmd.args.empty() || currentCmd.isGroup()) {
+                result.commands.push_back(std::move(currentCmd));
+            }
+            if (result.commands.empty() && result.runIf != RUN_ALWAYS) {
+                list.error = "missing command after " + std::string(result.runIf == RUN_IF_TRUE ? "&&" : "||");
+                return list;
+            }
+            if (!result.commands.empty()) {
+                result.isBackground = (op == "&");
+                list.pipelines.push_back(std::move(result));
             }
+            result = ParsedPipeline();
+            currentCmd = ParsedCommand();
         }
-        else if (tokens[i] == "2>") {	// Redirect Error Output
-            if (i + 1 < tokens.size()) {
-                currentCmd.errorFile = tokens[++i];
-                currentCmd.appendErrorMode = false;
+        else if (op == "|") {
+            if (!currentCmd.args.empty() || currentCmd.isGroup()) {
+                result.commands.push_back(std::move(currentCmd));
+                result.hasPipes = true;
             }
+            currentCmd = ParsedCommand();
         }
-        else if (tokens[i] == "2>>") {	// Redirect and Append Error Output
-            if (i + 1 < tokens.size()) {
-                currentCmd.errorFile = tokens[++i];
-                currentCmd.appendErrorMode = true;
+        else if (isRedirectionOperator(op)) {
+            // >{mods} file: the modifier list comes first
+            RelaySpec relay;
+            size_t word = i + 1;
+            if (word + 1 < count && !isOp(word) && !isOp(word + 1) && parseRelaySpec(text(word), relay)) {
+                word++;
+            }
+            // A redirection without a usable word is ignored
+            if (word < count && !isOp(word) && parseRedirection(op, text(word), relay, currentCmd)) {
+                i = word;   // The words after the operator were consumed
             }
         }
         else {
-            currentCmd.args.push_back(tokens[i]);
+            currentCmd.args.push_back(op);
         }
     }
     
-    if (!currentCmd.args.empty()) {
-        result.commands.push_back(currentCmd);
+    if (inGroup) {
+        list.error = std::string("missing ") + (group.lineMerge ? "}}" : "}");
+        return list;
+    }
+    if (!currentCmd.args.empty() || currentCmd.isGroup()) {
+        result.commands.push_back(std::move(currentCmd));
+    }
+    if (result.commands.empty() && result.runIf != RUN_ALWAYS) {
+        list.error = "missing command after " + std::string(result.runIf == RUN_IF_TRUE ? "&&" : "||");
+        return list;
+    }
+    if (!result.commands.empty()) {
+        list.pipelines.push_back(std::move(result));
     }
     
-    return result;
+    return list;
+}
+
+ParsedPipeline parseCommandLine(const std::vector<std::string>& tokens) {
+    // Plain strings carry no quoting, every operator spelling is an operator.
+    // Only a trailing "&" ends the pipeline, ";" is left to the command.
+    size_t count = tokens.size();
+    ParsedList list = parseTokens(count,
+        [&tokens](size_t i) -> const std::string& { return tokens[i]; },
+        [&tokens, count](size_t i) {
+            const std::string& t = tokens[i];
+            return (t == "&" && i == count - 1) || t == "|" || isRedirectionOperator(t);
+        });
+    return list.pipelines.empty() ? ParsedPipeline() : list.pipelines[0];
+}
+
+bool lexTokens(const std::string& text, std::vector<LexedToken>& tokens) {
+    std::vector<Token> views;
+    std::string unescaped;
+    tokens.clear();
+    if (lexLine(text.data(), text.size(), views, unescaped) == LEX_INCOMPLETE) {
+        return false;
+    }
+    tokens.reserve(views.size());
+    for (const auto& view : views) {
+        LexedToken token = { tokenText(text.data(), unescaped, view), view.isOperator };
+        tokens.push_back(token);
+    }
+    return true;
+}
+
+// "name()" as the first word of a function definition
+static bool isFunctionHeader(const LexedToken& token) {
+    const std::string& text = token.text;
+    return !token.isOperator && text.size() > 2 && text.compare(text.size() - 2, 2, "()") == 0 &&
+           isVariableName(text.substr(0, text.size() - 2));
+}
+
+// A command separator after which a function definition may start
+static bool isListSeparator(const LexedToken& token) {
+    return token.isOperator && (token.text == ";" || token.text == "&" || token.text == "&&" || token.text == "||");
+}
+
+/**
+ * Position of the first "name() {" after a separator, outside groups
+ * @return Its index, 0 if there is none
+ */
+static size_t findLaterDefinition(const std::vector<LexedToken>& tokens) {
+    int depth = 0;
+    for (size_t i = 1; i + 1 < tokens.size(); i++) {
+        const LexedToken& token = tokens[i];
+        if (token.isOperator) continue;
+        if (token.text == "{" || token.text == "{{") depth++;
+        if ((token.text == "}" || token.text == "}}") && depth > 0) depth--;
+        if (depth == 0 && isListSeparator(tokens[i - 1]) && isFunctionHeader(token) &&
+            !tokens[i + 1].isOperator && tokens[i + 1].text == "{") {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append the pipelines of more to list, the first one run as runIf says
+ * @return false if more has a syntax error (copied to list)
+ */
+static bool appendList(ParsedList& list, ParsedList& more, ListCondition runIf) {
+    if (!more.error.empty()) {
+        list.error = more.error;
+        return false;
+    }
+    if (!more.pipelines.empty() && more.pipelines[0].runIf == RUN_ALWAYS) {
+        more.pipelines[0].runIf = runIf;
+    }
+    for (auto& next : more.pipelines) {
+        list.pipelines.push_back(std::move(next));
+    }
+    return true;
+}
+
+ParsedList parseLexedTokens(const std::vector<LexedToken>& tokens) {
+    // a; name() { body }: the commands before the definition are a list of their own
+    size_t later = findLaterDefinition(tokens);
+    if (later > 0) {
+        const std::string& op = tokens[later - 1].text;
+        ListCondition runIf = op == "&&" ? RUN_IF_TRUE : op == "||" ? RUN_IF_FALSE : RUN_ALWAYS;
+        // ; and & stay with the commands before them (& puts the last one in the background)
+        size_t headEnd = runIf == RUN_ALWAYS ? later : later - 1;
+        ParsedList list = parseLexedTokens(std::vector<LexedToken>(tokens.begin(), tokens.begin() + headEnd));
+        if (!list.error.empty()) {
+            return list;
+        }
+        if (runIf != RUN_ALWAYS && list.pipelines.empty()) {
+            list.error = "missing command before " + op;
+            return list;
+        }
+        ParsedList more = parseLexedTokens(std::vector<LexedToken>(tokens.begin() + later, tokens.end()));
+        appendList(list, more, runIf);
+        return list;
+    }
+    
+    // name() { body }: the body is parsed now and kept as it is
+    if (!tokens.empty() && isFunctionHeader(tokens[0])) {
+        ParsedList list;
+        // The body ends at the matching }, groups inside it nest
+        size_t last = 2;
+        for (int depth = 1; last < tokens.size(); last++) {
+            const LexedToken& token = tokens[last];
+            if (token.isOperator) continue;
+            if (token.text == "{" || token.text == "{{") depth++;
+            if ((token.text == "}" || token.text == "}}") && --depth == 0) break;
+        }
+        if (tokens.size() < 3 || tokens[1].isOperator || tokens[1].text != "{" || last == tokens.size()) {
+            list.error = "function body must be { ... } on the same line";
+            return list;
+        }
+        
+        // What follows the body: ; && || and more commands
+        size_t rest = last + 1;
+        ListCondition restIf = RUN_ALWAYS;
+        if (rest < tokens.size()) {
+            const LexedToken& next = tokens[rest];
+            if (!next.isOperator || (next.text != ";" && next.text != "&&" && next.text != "||")) {
+                list.error = "unexpected " + next.text + " after function body";
+                return list;
+            }
+            restIf = next.text == "&&" ? RUN_IF_TRUE : next.text == "||" ? RUN_IF_FALSE : RUN_ALWAYS;
+            rest++;
+            if (restIf != RUN_ALWAYS && rest == tokens.size()) {
+                list.error = "missing command after " + next.text;
+                return list;
+            }
+        }
+        
+        std::shared_ptr<FunctionBody> body(new FunctionBody);
+        body->tokens.assign(tokens.begin() + 2, tokens.begin() + last);
+        body->list = parseLexedTokens(body->tokens);
+        if (!body->list.error.empty()) {
+            list.error = body->list.error;
+            return list;
+        }
+        ParsedCommand define;
+        define.args.push_back(tokens[0].text.substr(0, tokens[0].text.size() - 2));
+        define.definition = body;
+        ParsedPipeline pipeline;
+        pipeline.commands.push_back(std::move(define));
+        list.pipelines.push_back(std::move(pipeline));
+        
+        if (rest < tokens.size()) {
+            ParsedList more = parseLexedTokens(std::vector<LexedToken>(tokens.begin() + rest, tokens.end()));
+            appendList(list, more, restIf);
+        }
+        return list;
+    }
+    return parseTokens(tokens.size(),
+        [&tokens](size_t i) -> const std::string& { return tokens[i].text; },
+        [&tokens](size_t i) { return tokens[i].isOperator; });
+}
+
+/**
+ * Append a token, replacing a word in command position by its alias
+ * An alias is not expanded again inside its own value, so "ls='ls -F'"
+ * ends. Words after |, ;, & and an opening group brace are in command
+ * position.
+ */
+static void appendExpanded(const LexedToken& token, std::vector<LexedToken>& out, bool& commandStart,
+                           std::vector<const AliasDef*>& active) {
+    if (!token.isOperator && commandStart) {
+        const AliasDef* alias = lookupAlias(token.text);
+        if (alias && std::find(active.begin(), active.end(), alias) == active.end()) {
+            active.push_back(alias);
+            for (const auto& inner : alias->tokens) {
+                appendExpanded(inner, out, commandStart, active);
+            }
+            active.pop_back();
+            return;
+        }
+    }
+    out.push_back(token);
+    commandStart = token.isOperator ? (token.text == "|" || token.text == ";" || token.text == "&" ||
+                                       token.text == "&&" || token.text == "||")
+                                    : (token.text == "{" || token.text == "{{");
+}
+
+// A word that may be the header of a function definition: first, or after an operator
+static bool mayDefineFunction(const char* data, const std::string& unescaped, const std::vector<Token>& views) {
+    for (size_t i = 0; i < views.size(); i++) {
+        if (views[i].isOperator || (i > 0 && !views[i - 1].isOperator)) continue;
+        if (isFunctionHeader(LexedToken{tokenText(data, unescaped, views[i]), false})) return true;
+    }
+    return false;
+}
+
+// Lex and parse one logical line in place
+static bool parseSpan(const char* data, size_t len, ParsedList& list) {
+    static std::vector<Token> views;
+    static std::string unescaped;
+    if (lexLine(data, len, views, unescaped) == LEX_INCOMPLETE) {
+        return false;
+    }
+    
+    // Aliases and function definitions take the slower path through copies
+    // of the tokens; a line without them is parsed straight from the views
+    if (haveAliases() || mayDefineFunction(data, unescaped, views)) {
+        std::vector<LexedToken> tokens;
+        std::vector<const AliasDef*> active;
+        bool commandStart = true;
+        for (const auto& view : views) {
+            appendExpanded(LexedToken{tokenText(data, unescaped, view), view.isOperator},
+                           tokens, commandStart, active);
+        }
+        list = parseLexedTokens(tokens);
+    } else {
+        list = parseTokens(views.size(),
+            [data](size_t i) { return tokenText(data, unescaped, views[i]); },
+            [](size_t i) { return views[i].isOperator; });
+    }
+    
+    // Do not keep the token storage of a huge line around
+    if (views.capacity() > 65536) {
+        std::vector<Token>().swap(views);
+        std::string().swap(unescaped);
+    }
+    return true;
+}
+
+bool parseLine(const std::string& line, ParsedList& list) {
+    return parseSpan(line.data(), line.size(), list);
+}
+
+IncrementalParser::IncrementalParser() : start(0), scanned(0), scanState(0) {}
+
+void IncrementalParser::feed(const char* data, size_t len) {
+    // Drop the already parsed prefix before the buffer grows
+    if (start == buffer.size()) {
+        buffer.clear();
+        if (buffer.capacity() > 1 << 20) {
+            std::string().swap(buffer);
+        }
+        start = scanned = 0;
+    } else if (start > 0 && start >= buffer.size() / 2) {
+        buffer.erase(0, start);
+        scanned -= start;
+        start = 0;
+    }
+    buffer.append(data, len);
+}
+
+int IncrementalParser::next(ParsedList& list) {
+    while (scanned < buffer.size()) {
+        size_t end = scanned + lexFindLineEnd(buffer.data() + scanned,
+                                              buffer.size() - scanned, scanState);
+        if (end == buffer.size()) {
+            // Line not finished yet, resume the scan here with the next chunk
+            scanned = end;
+            return PARSE_NEED_MORE;
+        }
+        
+        size_t lineStart = start;
+        start = scanned = end + 1;
+        if (!parseSpan(buffer.data() + lineStart, end - lineStart, list)) {
+            return PARSE_ERROR;
+        }
+        if (!list.pipelines.empty() || !list.error.empty()) {
+            return PARSE_LIST;
+        }
+    }
+    return PARSE_NEED_MORE;
+}
+
+int IncrementalParser::finish(ParsedList& list) {
+    if (start == buffer.size()) {
+        return PARSE_NEED_MORE;
+    }
+    
+    // Input ended without a final newline
+    size_t lineStart = start;
+    start = scanned = buffer.size();
+    scanState = 0;
+    if (!parseSpan(buffer.data() + lineStart, buffer.size() - lineStart, list)) {
+        return PARSE_ERROR;
+    }
+    return list.pipelines.empty() && list.error.empty() ? PARSE_NEED_MORE : PARSE_LIST;
+}
+
+bool IncrementalParser::isContinuing() const {
+    return start < buffer.size();
+}
+
+size_t IncrementalParser::unparsed() const {
+    return buffer.size() - start;
+}
+
+void IncrementalParser::dropUnparsed() {
+    buffer.resize(start);
+    scanned = start;
+    scanState = 0;
+}
+
+// Stage names: letters, digits, '_', '-' and '.'
+static bool isDagName(const std::string& name) {
+    if (name.empty()) return false;
+    for (char c : name) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.') return false;
+    }
+    return true;
+}
+
+bool parseDag(const std::string& text, std::vector<DagStage>& stages, std::string& error) {
+    static const unsigned long long sizes[] = {1ULL << 10, 1ULL << 20, 1ULL << 30};
+    std::map<std::string, size_t> byName;
+    std::istringstream input(text);
+    std::string line;
+    
+    stages.clear();
+    for (int number = 1; std::getline(input, line); number++) {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') continue;
+        std::string where = "line " + std::to_string(number) + ": ";
+        
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            error = where + "expected 'name [< input ...]: command'";
+            return false;
+        }
+        
+        // Head: name, then the inputs after '<'
+        DagStage stage;
+        std::istringstream head(line.substr(0, colon));
+        std::string word;
+        head >> stage.name;
+        if (!isDagName(stage.name)) {
+            error = where + "bad stage name '" + stage.name + "'";
+            return false;
+        }
+        if (byName.count(stage.name)) {
+            error = where + "stage '" + stage.name + "' defined twice";
+            return false;
+        }
+        if (head >> word) {
+            if (word != "<") {
+                error = where + "expected '<' before the inputs of '" + stage.name + "'";
+                return false;
+            }
+            while (head >> word) {
+                size_t eq = word.find('=');
+                DagEdge edge;
+                edge.bufferSize = 0;
+                if (eq != std::string::npos &&
+                    !parseScaled(word.substr(eq + 1), "KMG", sizes, edge.bufferSize)) {
+                    error = where + "bad buffer size '" + word.substr(eq + 1) + "'";
+                    return false;
+                }
+                auto it = byName.find(word.substr(0, eq));
+                if (it == byName.end()) {
+                    error = where + "unknown stage '" + word.substr(0, eq) +
+                            "' (inputs must be defined first)";
+                    return false;
+                }
+                edge.from = it->second;
+                stage.inputs.push_back(edge);
+            }
+            if (stage.inputs.empty()) {
+                error = where + "no inputs after '<'";
+                return false;
+            }
+        }
+        
+        // Command: one simple command, with the usual quoting and redirections
+        ParsedList list;
+        if (!parseLine(line.substr(colon + 1), list)) {
+            error = where + "unterminated quote or escape";
+            return false;
+        }
+        if (!list.error.empty()) {
+            error = where + list.error;
+            return false;
+        }
+        if (list.pipelines.size() != 1 || list.pipelines[0].hasPipes || list.pipelines[0].isBackground ||
+            list.pipelines[0].commands[0].isGroup() || list.pipelines[0].commands[0].args.empty()) {
+            error = where + "a stage runs exactly one simple command";
+            return false;
+        }
+        stage.command = list.pipelines[0].commands[0];
+        byName[stage.name] = stages.size();
+        stages.push_back(stage);
+    }
+    
+    if (stages.empty()) {
+        error = "no stages";
+        return false;
+    }
+    return true;
 }
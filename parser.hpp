@@ -2,21 +2,93 @@
 #define PARSER_HPP
 #include <string>
 #include <vector>
+#include <memory>
 #include <sstream>
 
+/**
+ * Kind of a single redirection operation
+ */
+enum RedirType {
+    REDIR_OPEN,     // Open path onto fd (N<, N>, N>>, N<>, &>, &>>)
+    REDIR_DUP,      // Make fd a copy of srcFd (N>&M, N<&M)
+    REDIR_CLOSE     // Close fd (N>&-, N<&-)
+};
+
+/**
+ * Line timestamps added by a relay
+ */
+enum RelayTimestamp {
+    TS_NONE,        // No timestamps
+    TS_WALL,        // Local date and time ({ts}, {ts=wall})
+    TS_MONO         // Seconds since the command started ({ts=mono})
+};
+
+/**
+ * Processing applied by the shell to an output redirection: >{mods} file
+ * The command then writes into a pipe, and a relay thread inside the
+ * shell transforms the stream on its way to the file (see relay.hpp)
+ */
+struct RelaySpec {
+    int gzipLevel = -1;     // zlib level 0-9 ({gz}, {gz=N}), -1: no compression
+    unsigned long long rotateSize = 0;  // Rotate when the file reaches it ({rotate=10M}), 0: never
+    unsigned rotateSeconds = 0;         // Rotate when the file is that old ({every=1h}), 0: never
+    int keep = 5;                       // Rotated files kept ({keep=N}): file.1 ... file.N
+    RelayTimestamp timestamps = TS_NONE;    // Prefix every line with a timestamp
+    bool checksum = false;              // CRC32C of the command's output ({crc32c})
+    
+    bool rotates() const { return rotateSize > 0 || rotateSeconds > 0; }
+    bool active() const { return gzipLevel >= 0 || rotates() || timestamps != TS_NONE || checksum; }
+};
+
+// Source fds of N>&p and N<&p, replaced by the coprocess's pipes when the command runs
+#define REDIR_COPROC_WRITE (-3)     // N>&p: write to the coprocess's input
+#define REDIR_COPROC_READ (-4)      // N<&p: read the coprocess's output
+
+/**
+ * Structure representing one redirection operation
+ * A command's redirections are applied in source order, so
+ * "> file 2>&1" and "2>&1 > file" give different results
+ */
+struct Redirection {
+    RedirType type;     // Kind of operation
+    int fd;             // File descriptor being redirected
+    int srcFd;          // Source fd (REDIR_DUP only)
+    std::string path;   // File to open (REDIR_OPEN only)
+    int flags;          // open() flags (REDIR_OPEN only)
+    RelaySpec relay;    // Shell-side processing of the output (REDIR_OPEN only)
+};
+
+struct FunctionBody;
+
 /**
  * Structure representing a single parsed command with redirections
  */
 struct ParsedCommand {
     std::vector<std::string> args;	// Command and arguments
-    std::string inputFile;			// Input redirection file (<)
-    std::string outputFile;			// Output redirection file (> or >>)
-	std::string errorFile;        	// For stderr redirection (2>)
-    bool appendMode = false;		// true for >>, false for >
-	bool appendErrorMode = false; 	// For stderr append (2>>)
+    std::vector<Redirection> redirections;  // Redirections in source order
     bool isBackground = false;      // true if command is to be run in background (&)
+    // Members of a parallel group ({ a & b }), no args then. Held through
+    // pointers: ParsedCommand is incomplete here; copies copy the members.
+    std::vector<std::shared_ptr<ParsedCommand>> group;
+    bool lineMerge = false;         // {{ a & b }}: the members' output is merged line by line
+    std::shared_ptr<const FunctionBody> definition; // name() { ... }: defines function args[0]
     
     ParsedCommand();
+    ParsedCommand(const ParsedCommand& other);
+    ParsedCommand(ParsedCommand&& other) = default;
+    ParsedCommand& operator=(const ParsedCommand& other);
+    ParsedCommand& operator=(ParsedCommand&& other) = default;
+    
+    bool isGroup() const { return !group.empty(); }
+};
+
+/**
+ * When a pipeline of a list runs, depending on the status of the one before
+ */
+enum ListCondition {
+    RUN_ALWAYS,     // First pipeline, or after ; or &
+    RUN_IF_TRUE,    // After &&: only if the previous status was 0
+    RUN_IF_FALSE    // After ||: only if the previous status was not 0
 };
 
 /**
@@ -26,12 +98,126 @@ struct ParsedPipeline {
     std::vector<ParsedCommand> commands;// All commands in the pipeline
     bool hasPipes = false;				// true if pipeline contains pipes
     bool isBackground = false;          // true if pipeline is to be run in background (&)
+    ListCondition runIf = RUN_ALWAYS;   // Set by a preceding && or ||
     
     ParsedPipeline();
 };
 
+/**
+ * Structure representing a command list: pipelines separated by ;, &, && or ||
+ */
+struct ParsedList {
+    std::vector<ParsedPipeline> pipelines;  // Pipelines in execution order
+    std::string error;                      // Syntax error: nothing is run when set
+};
+
+/**
+ * Token as produced by the lexer, kept for later parsing (alias values,
+ * function bodies) so that it is not lexed again
+ */
+struct LexedToken {
+    std::string text;       // Unquoted text, variable references marked with LEX_VAR_MARK
+    bool isOperator;        // Unquoted |, &, ;, &&, ||, or a redirection operator
+};
+
+/**
+ * Body of a function: parsed once when it is defined, run on every call
+ */
+struct FunctionBody {
+    std::vector<LexedToken> tokens;     // Between the braces, for rc snapshots
+    ParsedList list;                    // Parsed tokens
+};
+
+/**
+ * Input of a pipeline graph stage: the stage it reads from
+ */
+struct DagEdge {
+    size_t from;                    // Index of the producing stage
+    unsigned long long bufferSize;  // Capacity of the pipe (input=64K), 0: system default
+};
+
+/**
+ * One stage of a pipeline graph (dag builtin)
+ */
+struct DagStage {
+    std::string name;               // Name the consumers refer to
+    ParsedCommand command;          // Simple command run by the stage
+    std::vector<DagEdge> inputs;    // Producers, merged line by line if more than one
+};
+
+/**
+ * Result of asking the incremental parser for the next command list
+ */
+enum ParseStatus {
+    PARSE_NEED_MORE,    // No complete command list buffered
+    PARSE_LIST,         // A command list was produced
+    PARSE_ERROR         // Unterminated quote or escape at end of input
+};
+
+/**
+ * Incremental parser for streamed input
+ * Input is fed in chunks of any size, and a command list is produced as
+ * soon as the newline ending it arrives. Quotes and backslash-newline
+ * continuations may span any number of chunks. Only the unparsed tail of
+ * the input is kept and tokens are views into it, so a huge line is held
+ * about once in memory.
+ */
+class IncrementalParser {
+public:
+    IncrementalParser();
+    
+    /**
+     * Append a chunk of input
+     * 
+     * @param data Chunk contents
+     * @param len Chunk length in bytes
+     */
+    void feed(const char* data, size_t len);
+    
+    /**
+     * Parse the next complete command list, if any
+     * 
+     * @param list Output command list
+     * @return PARSE_LIST, PARSE_NEED_MORE or PARSE_ERROR
+     */
+    int next(ParsedList& list);
+    
+    /**
+     * Parse whatever is left at end of input (a last line without newline)
+     * 
+     * @param list Output command list
+     * @return PARSE_LIST, PARSE_NEED_MORE (nothing left) or PARSE_ERROR
+     */
+    int finish(ParsedList& list);
+    
+    /**
+     * Check if a logical line has been started but not finished
+     * Used to show a continuation prompt
+     * 
+     * @return true if unparsed input is buffered
+     */
+    bool isContinuing() const;
+    
+    /**
+     * Number of bytes fed after the last parsed line
+     */
+    size_t unparsed() const;
+    
+    /**
+     * Forget the bytes after the last parsed line, they are read again
+     */
+    void dropUnparsed();
+    
+private:
+    std::string buffer;     // Unparsed input
+    size_t start;           // Start of the current logical line in buffer
+    size_t scanned;         // How far the line end search got
+    int scanState;          // Quoting state of the line end search
+};
+
 /**
  * Parse command line into tokens
+ * Splits on whitespace and around operators (|, &, ;, and redirections)
  * 
  * @param line Input command line string
  * @return Vector of tokens
@@ -46,4 +232,57 @@ std::vector<std::string> tokenize(const std::string& line);
  */
 ParsedPipeline parseCommandLine(const std::vector<std::string>& tokens);
 
+/**
+ * Check if a token is a redirection operator
+ * 
+ * @param op Token text, e.g. "<", "2>>", "2>&", "&>"
+ * @return true if op redirects a file descriptor
+ */
+bool isRedirectionOperator(const std::string& op);
+
+/**
+ * Tokenize and parse a command line in one step
+ * Unlike tokenize() + parseCommandLine(), quoted operators ("|", '>')
+ * stay plain arguments, and ; or & separate pipelines. Aliases are
+ * expanded in command position, and "name() { ... }" on one line is a
+ * function definition.
+ * 
+ * @param line Input command line string
+ * @param list Output command list
+ * @return false if the line ends inside a quote or after a backslash
+ */
+bool parseLine(const std::string& line, ParsedList& list);
+
+/**
+ * Lex text into tokens without parsing it (alias values)
+ * 
+ * @param text Text in shell syntax
+ * @param tokens Output tokens
+ * @return false if the text ends inside a quote or after a backslash
+ */
+bool lexTokens(const std::string& text, std::vector<LexedToken>& tokens);
+
+/**
+ * Parse tokens from lexTokens() into a command list
+ * Aliases are not expanded: alias values and function bodies had that
+ * done when they were parsed.
+ * 
+ * @param tokens Tokens in source order
+ * @return Command list (error set on a syntax error)
+ */
+ParsedList parseLexedTokens(const std::vector<LexedToken>& tokens);
+
+/**
+ * Parse a pipeline graph description (dag builtin)
+ * Every line is "name [< input[=size] ...]: command", blank lines and
+ * lines starting with # are skipped. An input must be defined on an
+ * earlier line, so the graph cannot have a cycle. A stage without inputs
+ * reads the shell's stdin, a stage nobody reads writes to its stdout.
+ * @param text Contents of the description file
+ * @param stages Output: stages in definition order
+ * @param error Output: "line N: ..." message when parsing fails
+ * @return false if the description is invalid
+ */
+bool parseDag(const std::string& text, std::vector<DagStage>& stages, std::string& error);
+
 #endif // PARSER_HPP
\ No newline at end of file
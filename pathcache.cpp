@@ -0,0 +1,359 @@
+#include "pathcache.hpp"
+#include <map>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// How long a failed lookup is remembered
+#define PATH_MISS_TTL_MS 2000
+
+// PathDir::fd of a directory that was not opened yet
+#define PATH_DIR_UNOPENED -2
+
+// Lowest fd of a cached directory, above the ones redirections commonly name
+#define PATH_DIR_FD_MIN 10
+
+// Number of names from which locateCommands() uses the directory listings
+#define PATH_BATCH_MIN 16
+
+// PATH the cached directories belong to
+static std::string cachedPath;
+static bool cacheValid = false;
+static std::vector<PathDir> cachedDirs;
+
+// Names recently not found in PATH, with the time of the lookup
+static std::map<std::string, long long> missCache;
+
+/**
+ * Names in one PATH directory, for suggestions
+ */
+struct DirIndex {
+    struct timespec mtime;          // Directory mtime when the names were read
+    std::vector<std::string> names; // Sorted
+};
+static std::vector<DirIndex> dirIndex;  // Parallel to cachedDirs
+
+/**
+ * Result of reading a command's #! line, valid while the file is unchanged
+ */
+struct ScriptCheck {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool selfScript;        // The interpreter is this shell
+};
+static std::map<std::string, ScriptCheck> scriptChecks;
+
+static long long monotonicMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Open a PATH directory on first use (a short script rarely needs them all),
+// at fd 10 or above like bash's own fds, where "cmd 1>&5" does not reach it
+static int openPathDir(PathDir& dir) {
+    if (dir.fd == PATH_DIR_UNOPENED) {
+        dir.fd = open(dir.path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dir.fd >= 0 && dir.fd < PATH_DIR_FD_MIN) {
+            int high = fcntl(dir.fd, F_DUPFD_CLOEXEC, PATH_DIR_FD_MIN);
+            if (high >= 0) {
+                close(dir.fd);
+                dir.fd = high;
+            }
+        }
+    }
+    return dir.fd;
+}
+
+const std::vector<PathDir>& pathDirs() {
+    const char* pathEnv = getenv("PATH");
+    std::string path = pathEnv ? pathEnv : "";
+    if (cacheValid && path == cachedPath) {
+        return cachedDirs;
+    }
+    
+    for (const auto& dir : cachedDirs) {
+        if (dir.fd >= 0) close(dir.fd);
+    }
+    cachedDirs.clear();
+    size_t start = 0;
+    while (start <= path.size() && !path.empty()) {
+        size_t end = path.find(':', start);
+        if (end == std::string::npos) end = path.size();
+        if (end > start) {
+            PathDir dir;
+            dir.path = path.substr(start, end - start);
+            dir.fd = PATH_DIR_UNOPENED;
+            cachedDirs.push_back(dir);
+        }
+        start = end + 1;
+    }
+    cachedPath = path;
+    cacheValid = true;
+    missCache.clear();
+    dirIndex.clear();
+    return cachedDirs;
+}
+
+// Check whether path is the running shell's own executable
+static bool isThisShell(const std::string& path) {
+    static struct stat self;
+    static int known = -1;
+    if (known < 0) {
+        known = stat("/proc/self/exe", &self) == 0;
+    }
+    struct stat st;
+    return known && stat(path.c_str(), &st) == 0 && st.st_dev == self.st_dev && st.st_ino == self.st_ino;
+}
+
+/**
+ * Check whether a command is a script for this shell: "#!/path/tinyshell"
+ * or "#!/usr/bin/env tinyshell". The #! line is read once per file version.
+ */
+static bool runsThisShell(int dirFd, const std::string& name, const std::string& path) {
+    struct stat st;
+    if (fstatat(dirFd, name.c_str(), &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    auto cached = scriptChecks.find(path);
+    if (cached != scriptChecks.end() && cached->second.dev == st.st_dev && cached->second.ino == st.st_ino &&
+        cached->second.mtime.tv_sec == st.st_mtim.tv_sec && cached->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return cached->second.selfScript;
+    }
+    
+    char head[256];
+    ssize_t len = -1;
+    int fd = openat(dirFd, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        len = read(fd, head, sizeof(head) - 1);
+        close(fd);
+    }
+    bool self = false;
+    if (len > 2 && head[0] == '#' && head[1] == '!') {
+        head[len] = '\0';
+        std::string line(head + 2, strcspn(head + 2, "\n"));
+        size_t start = line.find_first_not_of(" \t");
+        size_t end = line.find_first_of(" \t", start);
+        std::string interpreter = start == std::string::npos ? "" : line.substr(start, end - start);
+        size_t argStart = end == std::string::npos ? end : line.find_first_not_of(" \t", end);
+        std::string arg = argStart == std::string::npos ? "" :
+                          line.substr(argStart, line.find_first_of(" \t", argStart) - argStart);
+        
+        self = !interpreter.empty() && isThisShell(interpreter);
+        CommandLocation viaEnv;
+        if (!self && !arg.empty() && interpreter.size() >= 4 &&
+            interpreter.compare(interpreter.size() - 4, 4, "/env") == 0 && locateCommand(arg, viaEnv)) {
+            self = isThisShell(viaEnv.path);
+        }
+    }
+    
+    ScriptCheck check;
+    check.dev = st.st_dev;
+    check.ino = st.st_ino;
+    check.mtime = st.st_mtim;
+    check.selfScript = self;
+    scriptChecks[path] = check;
+    return self;
+}
+
+bool locateCommand(const std::string& command, CommandLocation& location) {
+    location = CommandLocation();
+    if (command.empty()) {
+        return false;
+    }
+    if (command.find('/') != std::string::npos) {
+        if (access(command.c_str(), X_OK) != 0) {
+            return false;
+        }
+        location.path = command;
+        location.name = command;
+        location.selfScript = runsThisShell(AT_FDCWD, command, command);
+        return true;
+    }
+    
+    pathDirs();
+    long long now = monotonicMs();
+    auto miss = missCache.find(command);
+    if (miss != missCache.end()) {
+        if (now - miss->second < PATH_MISS_TTL_MS) return false;
+        missCache.erase(miss);
+    }
+    
+    for (auto& dir : cachedDirs) {
+        if (openPathDir(dir) < 0 || faccessat(dir.fd, command.c_str(), X_OK, 0) != 0) continue;
+        location.path = dir.path + "/" + command;
+        location.dirFd = dir.fd;
+        location.name = command;
+        location.selfScript = runsThisShell(dir.fd, command, location.path);
+        return true;
+    }
+    missCache[command] = now;
+    return false;
+}
+
+// Read the names of a directory's files (and links, which may point to one)
+static void readDirNames(int dirFd, std::vector<std::string>& names) {
+    names.clear();
+    int fd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+        if (entry->d_type == DT_REG || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+}
+
+// Bring the name index up to date, re-reading only the directories whose mtime changed
+static void refreshDirIndex() {
+    std::vector<PathDir>& dirs = cachedDirs;
+    pathDirs();
+    dirIndex.resize(dirs.size());
+    for (size_t d = 0; d < dirs.size(); d++) {
+        struct stat st;
+        if (openPathDir(dirs[d]) < 0 || fstat(dirs[d].fd, &st) < 0) {
+            dirIndex[d].names.clear();
+            continue;
+        }
+        if (!dirIndex[d].names.empty() && dirIndex[d].mtime.tv_sec == st.st_mtim.tv_sec &&
+            dirIndex[d].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            continue;
+        }
+        readDirNames(dirs[d].fd, dirIndex[d].names);
+        dirIndex[d].mtime = st.st_mtim;
+    }
+}
+
+/**
+ * Edit distance (insert, delete, replace, swap of neighbours) of a and b,
+ * or limit + 1 as soon as it is certain to exceed limit
+ */
+static size_t editDistance(const std::string& a, const std::string& b, size_t limit) {
+    size_t n = a.size(), m = b.size();
+    if ((n > m ? n - m : m - n) > limit) return limit + 1;
+    
+    std::vector<size_t> before(m + 1), prev(m + 1), cur(m + 1);
+    for (size_t j = 0; j <= m; j++) prev[j] = j;
+    for (size_t i = 1; i <= n; i++) {
+        cur[0] = i;
+        size_t rowMin = cur[0];
+        for (size_t j = 1; j <= m; j++) {
+            size_t cost = a[i - 1] == b[j - 1] ? 0 : 1;
+            cur[j] = std::min(std::min(prev[j] + 1, cur[j - 1] + 1), prev[j - 1] + cost);
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+                cur[j] = std::min(cur[j], before[j - 2] + 1);
+            }
+            rowMin = std::min(rowMin, cur[j]);
+        }
+        if (rowMin > limit) return limit + 1;
+        before.swap(prev);
+        prev.swap(cur);
+    }
+    return prev[m];
+}
+
+std::vector<std::string> suggestCommands(const std::string& command, size_t max) {
+    std::vector<std::string> result;
+    if (command.empty() || command.find('/') != std::string::npos) {
+        return result;
+    }
+    
+    refreshDirIndex();
+    
+    // One typo per three characters, at least one
+    size_t limit = std::max<size_t>(1, command.size() / 3);
+    std::vector<std::pair<size_t, std::string>> found;
+    for (const auto& index : dirIndex) {
+        for (const auto& name : index.names) {
+            size_t distance = editDistance(command, name, limit);
+            if (distance <= limit) found.push_back(std::make_pair(distance, name));
+        }
+    }
+    std::sort(found.begin(), found.end());
+    for (const auto& match : found) {
+        if (result.size() == max) break;
+        if (std::find(result.begin(), result.end(), match.second) == result.end()) {
+            result.push_back(match.second);
+        }
+    }
+    return result;
+}
+
+void locateCommands(const std::vector<std::string>& commands, std::vector<CommandLocation>& locations,
+                    std::vector<bool>& found) {
+    locations.assign(commands.size(), CommandLocation());
+    found.assign(commands.size(), false);
+    
+    // A few names: one faccessat() per directory each is cheaper than the index
+    if (commands.size() < PATH_BATCH_MIN) {
+        for (size_t i = 0; i < commands.size(); i++) {
+            found[i] = locateCommand(commands[i], locations[i]);
+        }
+        return;
+    }
+    
+    // Many names: the sorted directory listings answer all of them, and
+    // only the hits are checked for the execute permission
+    refreshDirIndex();
+    long long now = monotonicMs();
+    for (size_t i = 0; i < commands.size(); i++) {
+        const std::string& command = commands[i];
+        if (command.empty() || command.find('/') != std::string::npos) {
+            found[i] = locateCommand(command, locations[i]);
+            continue;
+        }
+        for (size_t d = 0; d < cachedDirs.size() && !found[i]; d++) {
+            const std::vector<std::string>& names = dirIndex[d].names;
+            if (!std::binary_search(names.begin(), names.end(), command) ||
+                faccessat(cachedDirs[d].fd, command.c_str(), X_OK, 0) != 0) {
+                continue;
+            }
+            CommandLocation& location = locations[i];
+            location.path = cachedDirs[d].path + "/" + command;
+            location.dirFd = cachedDirs[d].fd;
+            location.name = command;
+            location.selfScript = runsThisShell(cachedDirs[d].fd, command, location.path);
+            found[i] = true;
+        }
+        if (!found[i]) missCache[command] = now;
+    }
+}
+
+void execLocated(const CommandLocation& location, char** argv, char** envp) {
+    if (location.dirFd >= 0) {
+#ifdef SYS_execveat
+        syscall(SYS_execveat, location.dirFd, location.name.c_str(), argv, envp, 0);
+#else
+        errno = ENOSYS;
+#endif
+        if (errno == ENOSYS) {
+            int fd = openat(location.dirFd, location.name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                fexecve(fd, argv, envp);
+                close(fd);
+            }
+        }
+    }
+    execve(location.path.c_str(), argv, envp);
+}
+
+bool isPathDirFd(int fd) {
+    for (const auto& dir : cachedDirs) {
+        if (dir.fd == fd) return true;
+    }
+    return false;
+}
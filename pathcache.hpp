@@ -0,0 +1,96 @@
+#ifndef PATHCACHE_HPP
+#define PATHCACHE_HPP
+#include <string>
+#include <vector>
+
+/**
+ * Directory of PATH, held open by the shell
+ */
+struct PathDir {
+    std::string path;   // Directory as written in PATH
+    int fd;             // O_PATH fd of the directory, -1 if it could not be opened,
+                        // -2 until a lookup first reaches it
+};
+
+/**
+ * Where a command was found
+ */
+struct CommandLocation {
+    std::string path;   // Full path, e.g. "/usr/bin/ls"
+    int dirFd = -1;     // O_PATH fd of its PATH directory, -1 for a name with a '/'
+    std::string name;   // Name relative to dirFd
+    bool selfScript = false;    // A script whose #! line names this shell
+};
+
+/**
+ * Get the directories of PATH
+ * Each directory is opened once with O_PATH, when a lookup first reaches
+ * it, and kept open until PATH changes, so a lookup walks one path
+ * component instead of the whole directory path, and a directory swapped
+ * behind a symlink is not seen half-way through a lookup.
+ * 
+ * @return Directories in PATH order
+ */
+const std::vector<PathDir>& pathDirs();
+
+/**
+ * Find an executable in PATH (or check a name that contains a '/')
+ * A name that was not found is remembered for a short time, so repeated
+ * typos and missing tools do not scan PATH again. Scripts for this shell
+ * are recognized by their #! line (read once per file version).
+ * 
+ * @param command Command name
+ * @param location Output: where it was found
+ * @return false if there is no such executable
+ */
+bool locateCommand(const std::string& command, CommandLocation& location);
+
+/**
+ * Find many executables in one pass over PATH (type, which, command -v)
+ * From a handful of names on, the names are looked up in the sorted
+ * directory listings also used by suggestCommands(), instead of one
+ * faccessat() per name and directory; only a hit is checked with
+ * faccessat().
+ * 
+ * @param commands Command names
+ * @param locations Output: where each one was found
+ * @param found Output: whether each one was found
+ */
+void locateCommands(const std::vector<std::string>& commands, std::vector<CommandLocation>& locations,
+                    std::vector<bool>& found);
+
+/**
+ * Suggest commands for a name that was not found
+ * The names in the PATH directories are indexed on first use and read
+ * again only for a directory whose mtime changed; matches are the names
+ * with the smallest edit distance (at most one typo per three characters).
+ * 
+ * @param command Name that was not found
+ * @param max Largest number of suggestions
+ * @return Suggestions, closest first
+ */
+std::vector<std::string> suggestCommands(const std::string& command, size_t max);
+
+/**
+ * Replace the process by a located command (child after fork)
+ * Runs execveat() relative to the cached directory fd, falls back to
+ * fexecve() where execveat() is not available, and to execve() of the
+ * full path when the fd route fails (scripts run through an interpreter
+ * cannot be passed a close-on-exec fd).
+ * 
+ * @param location Result of locateCommand()
+ * @param argv Argument vector
+ * @param envp Environment
+ * @return Only on failure, with errno set
+ */
+void execLocated(const CommandLocation& location, char** argv, char** envp);
+
+/**
+ * Check whether an fd is one of the cached PATH directories
+ * 
+ * @param fd File descriptor
+ * @return true if pathDirs() holds fd
+ */
+bool isPathDirFd(int fd);
+
+#endif // PATHCACHE_HPP
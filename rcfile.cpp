@@ -0,0 +1,392 @@
+#include "rcfile.hpp"
+#include "tinyshell.hpp"
+#include "parser.hpp"
+#include "variables.hpp"
+#include "symbols.hpp"
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern char** environ;
+
+// First bytes of a snapshot
+static const char rcSnapshotMagic[8] = { 'T', 'S', 'H', 'R', 'C', 'S', 'N', 'P' };
+
+/**
+ * Start of a snapshot: identifies the rc it was made from
+ * The records follow, each one a type byte and two length-prefixed
+ * strings (uint32 length, bytes). Aliases and functions keep their
+ * tokens (a flag byte, then the text as a length-prefixed string), so
+ * applying them needs no lexing.
+ */
+struct RcSnapshotHeader {
+    char magic[8];
+    uint32_t version;       // RC_SNAPSHOT_VERSION
+    uint32_t records;       // Number of records after the header
+    uint64_t dev;           // stat() of the rc
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+};
+
+enum RcRecordType {
+    RC_INPUT = 1,       // Environment variable read by the rc, with its value then
+    RC_INPUT_UNSET,     // Environment variable read by the rc, unset then
+    RC_VARIABLE,        // Shell variable
+    RC_EXPORT,          // Environment variable set by the rc
+    RC_OPTION,          // Shell option ("on" or "off")
+    RC_ALIAS,           // Alias: its text as a length-prefixed string, then its tokens
+    RC_FUNCTION         // Function: the tokens of its body
+};
+
+/**
+ * State the rc produced, in the order it is written to the snapshot
+ */
+struct RcRecord {
+    uint8_t type;
+    std::string name;
+    std::string value;
+};
+
+static std::string rcPath() {
+    const char* home = getenv("HOME");
+    return home && *home ? std::string(home) + "/.tinyshellrc" : std::string();
+}
+
+static std::string snapshotDir() {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache) return std::string(cache) + "/tinyshell";
+    const char* home = getenv("HOME");
+    return home && *home ? std::string(home) + "/.cache/tinyshell" : std::string();
+}
+
+static bool sameFile(const RcSnapshotHeader& header, const struct stat& rc) {
+    return header.version == RC_SNAPSHOT_VERSION && header.dev == (uint64_t)rc.st_dev &&
+           header.ino == (uint64_t)rc.st_ino && header.size == (uint64_t)rc.st_size &&
+           header.mtimeSec == (int64_t)rc.st_mtim.tv_sec && header.mtimeNsec == (int64_t)rc.st_mtim.tv_nsec;
+}
+
+// Read one length-prefixed string of a record, false if it runs past the end
+static bool readField(const char*& pos, const char* end, const char*& data, uint32_t& len) {
+    if ((size_t)(end - pos) < sizeof(len)) return false;
+    memcpy(&len, pos, sizeof(len));
+    pos += sizeof(len);
+    if ((size_t)(end - pos) < len) return false;
+    data = pos;
+    pos += len;
+    return true;
+}
+
+static void appendField(std::string& data, const std::string& field) {
+    uint32_t len = field.size();
+    data.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    data += field;
+}
+
+static std::string encodeTokens(const std::vector<LexedToken>& tokens) {
+    std::string data;
+    for (const auto& token : tokens) {
+        data += (char)token.isOperator;
+        appendField(data, token.text);
+    }
+    return data;
+}
+
+static bool decodeTokens(const char* pos, const char* end, std::vector<LexedToken>& tokens) {
+    tokens.clear();
+    while (pos < end) {
+        LexedToken token;
+        token.isOperator = *pos++ != 0;
+        const char* text;
+        uint32_t len;
+        if (!readField(pos, end, text, len)) return false;
+        token.text.assign(text, len);
+        tokens.push_back(token);
+    }
+    return true;
+}
+
+/**
+ * Check an alias or function record and build what it defines
+ *
+ * @return false if the record is damaged
+ */
+static bool decodeDefinition(uint8_t type, const char* value, uint32_t valueLen, AliasDef& alias,
+                             std::shared_ptr<FunctionBody>& body) {
+    const char* pos = value;
+    const char* end = value + valueLen;
+    if (type == RC_ALIAS) {
+        const char* text;
+        uint32_t textLen;
+        if (!readField(pos, end, text, textLen)) return false;
+        alias.text.assign(text, textLen);
+        return decodeTokens(pos, end, alias.tokens);
+    }
+    body.reset(new FunctionBody);
+    if (!decodeTokens(pos, end, body->tokens)) return false;
+    body->list = parseLexedTokens(body->tokens);
+    return body->list.error.empty();
+}
+
+/**
+ * Apply a snapshot made from the rc described by st
+ * The records are checked completely (bounds, inputs) before anything
+ * is applied, so a stale or damaged snapshot changes nothing.
+ *
+ * @return false if there is no usable snapshot
+ */
+static bool applySnapshot(const std::string& path, const struct stat& rc) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RcSnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char* base = static_cast<const char*>(map);
+    const char* end = base + size;
+    RcSnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    bool valid = memcmp(header.magic, rcSnapshotMagic, sizeof(rcSnapshotMagic)) == 0 && sameFile(header, rc);
+
+    // Pass 1: structure and inputs, pass 2: apply
+    for (int pass = 0; pass < 2 && valid; pass++) {
+        const char* pos = base + sizeof(header);
+        for (uint32_t i = 0; i < header.records && valid; i++) {
+            const char* name;
+            const char* value;
+            uint32_t nameLen, valueLen;
+            uint8_t type = pos < end ? (uint8_t)*pos++ : 0;
+            if (!readField(pos, end, name, nameLen) || !readField(pos, end, value, valueLen)) {
+                valid = false;
+                break;
+            }
+            std::string key(name, nameLen);
+            AliasDef alias;
+            std::shared_ptr<FunctionBody> body;
+            if ((type == RC_ALIAS || type == RC_FUNCTION) &&
+                !decodeDefinition(type, value, valueLen, alias, body)) {
+                valid = false;
+                break;
+            }
+            if (pass == 0) {
+                const char* now = getenv(key.c_str());
+                if (type == RC_INPUT) {
+                    valid = now && strlen(now) == valueLen && memcmp(now, value, valueLen) == 0;
+                } else if (type == RC_INPUT_UNSET) {
+                    valid = now == nullptr;
+                } else {
+                    valid = type >= RC_VARIABLE && type <= RC_FUNCTION;
+                }
+                continue;
+            }
+            std::string text(value, valueLen);
+            if (type == RC_VARIABLE) {
+                setVariable(key, text);
+            } else if (type == RC_EXPORT) {
+                exportVariable(key, text);
+            } else if (type == RC_OPTION) {
+                setShellOption(key, text == "on");
+            } else if (type == RC_ALIAS) {
+                defineAlias(key, alias);
+            } else if (type == RC_FUNCTION) {
+                defineFunction(key, body);
+            }
+        }
+    }
+    munmap(map, size);
+    return valid;
+}
+
+// Write the snapshot next to where it is used and move it into place
+static void writeSnapshot(const std::string& dir, const struct stat& rc, const std::vector<RcRecord>& records) {
+    size_t slash = 0;
+    while ((slash = dir.find('/', slash + 1)) != std::string::npos) {
+        mkdir(dir.substr(0, slash).c_str(), 0700);
+    }
+    mkdir(dir.c_str(), 0700);
+
+    RcSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, rcSnapshotMagic, sizeof(rcSnapshotMagic));
+    header.version = RC_SNAPSHOT_VERSION;
+    header.records = records.size();
+    header.dev = rc.st_dev;
+    header.ino = rc.st_ino;
+    header.size = rc.st_size;
+    header.mtimeSec = rc.st_mtim.tv_sec;
+    header.mtimeNsec = rc.st_mtim.tv_nsec;
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto& record : records) {
+        data += (char)record.type;
+        appendField(data, record.name);
+        appendField(data, record.value);
+    }
+
+    std::string path = dir + "/rc.snapshot";
+    std::string temp = path + "." + std::to_string(getpid());
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+    if (done != data.size() || rename(temp.c_str(), path.c_str()) < 0) {
+        unlink(temp.c_str());
+    }
+}
+
+/**
+ * Check whether a command only sets state a snapshot can hold
+ *
+ * @param cmd Command as parsed (not yet expanded)
+ * @param reads Output: variables its words refer to
+ * @param records Output: the options it sets
+ */
+static bool isStateCommand(const ParsedCommand& cmd, std::vector<std::string>& reads,
+                           std::vector<RcRecord>& records) {
+    if (cmd.args.empty() || cmd.isGroup() || !cmd.redirections.empty()) return false;
+    if (cmd.definition) return true;    // The body is not run, its variables are not read
+    for (const auto& arg : cmd.args) {
+        referencedVariables(arg, reads);
+    }
+    const std::string& name = cmd.args[0];
+    if (name == "set") {
+        // Only set -o/+o with a literal name
+        if (cmd.args.size() != 3 || (cmd.args[1] != "-o" && cmd.args[1] != "+o") ||
+            needsExpansion(cmd.args[2])) {
+            return false;
+        }
+        RcRecord record = { RC_OPTION, cmd.args[2], cmd.args[1] == "-o" ? "on" : "off" };
+        records.push_back(record);
+        return true;
+    }
+    if (name == "export" || name == "unalias") return cmd.args.size() > 1;  // Without arguments it prints
+    if (name == "alias") {
+        // Only definitions: alias name prints
+        for (size_t i = 1; i < cmd.args.size(); i++) {
+            if (cmd.args[i].find('=') == std::string::npos) return false;
+        }
+        return cmd.args.size() > 1;
+    }
+    for (const auto& arg : cmd.args) {
+        if (needsExpansion(arg.substr(0, arg.find('='))) || !isAssignment(arg)) return false;
+    }
+    return true;
+}
+
+/**
+ * Run the rc and write a snapshot of its result if it only set state
+ */
+static void runRcFile(const std::string& path, const struct stat& rc, const std::string& dir) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::string text;
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        text.append(chunk, n);
+    }
+    close(fd);
+
+    std::map<std::string, std::string> before;
+    for (char** env = environ; *env; env++) {
+        const char* eq = strchr(*env, '=');
+        if (eq) before[std::string(*env, eq - *env)] = eq + 1;
+    }
+
+    // Line by line like a script, so an alias is defined before the next line is parsed
+    IncrementalParser parser;
+    ParsedList list;
+    bool cacheable = true;
+    std::vector<std::string> reads;
+    std::vector<RcRecord> options;
+    parser.feed(text.data(), text.size());
+    while (true) {
+        int status = parser.next(list);
+        if (status == PARSE_NEED_MORE) status = parser.finish(list);
+        if (status == PARSE_NEED_MORE) break;
+        if (status == PARSE_ERROR) {
+            std::cerr << COLOR_ERROR << "tinyshell: " << path << ": unexpected end of line (unterminated quote or escape)"
+                      << COLOR_RESET << "\n";
+            cacheable = false;
+            continue;
+        }
+        cacheable = cacheable && list.error.empty();
+        for (const auto& pipeline : list.pipelines) {
+            cacheable = cacheable && !pipeline.hasPipes && !pipeline.isBackground &&
+                        pipeline.runIf == RUN_ALWAYS &&
+                        isStateCommand(pipeline.commands[0], reads, options);
+        }
+        if (!executeList(list)) break;
+    }
+    if (!cacheable) return;
+
+    // Inputs as they were before the rc changed anything
+    std::vector<RcRecord> records;
+    for (const auto& name : reads) {
+        auto value = before.find(name);
+        RcRecord record = { (uint8_t)(value != before.end() ? RC_INPUT : RC_INPUT_UNSET), name,
+                            value != before.end() ? value->second : "" };
+        records.push_back(record);
+    }
+    for (const auto& var : shellVariables) {
+        RcRecord record = { RC_VARIABLE, var.first, var.second };
+        records.push_back(record);
+    }
+    for (char** env = environ; *env; env++) {
+        const char* eq = strchr(*env, '=');
+        if (!eq) continue;
+        std::string name(*env, eq - *env);
+        auto old = before.find(name);
+        if (old == before.end() || old->second != eq + 1) {
+            RcRecord record = { RC_EXPORT, name, eq + 1 };
+            records.push_back(record);
+        }
+    }
+    records.insert(records.end(), options.begin(), options.end());
+    for (const auto& name : definedNames(false)) {
+        const AliasDef* alias = lookupAlias(name);
+        std::string value;
+        appendField(value, alias->text);
+        RcRecord record = { RC_ALIAS, name, value + encodeTokens(alias->tokens) };
+        records.push_back(record);
+    }
+    for (const auto& name : definedNames(true)) {
+        RcRecord record = { RC_FUNCTION, name, encodeTokens(lookupFunction(name)->tokens) };
+        records.push_back(record);
+    }
+    if (!dir.empty()) writeSnapshot(dir, rc, records);
+}
+
+void loadRcFile() {
+    std::string path = rcPath();
+    struct stat rc;
+    if (path.empty() || stat(path.c_str(), &rc) < 0 || !S_ISREG(rc.st_mode)) {
+        return;
+    }
+    std::string dir = snapshotDir();
+    if (!dir.empty() && applySnapshot(dir + "/rc.snapshot", rc)) {
+        return;
+    }
+    runRcFile(path, rc, dir);
+}
@@ -0,0 +1,19 @@
+#ifndef RCFILE_HPP
+#define RCFILE_HPP
+
+// Version of the snapshot format, part of its header
+#define RC_SNAPSHOT_VERSION 3
+
+/**
+ * Load ~/.tinyshellrc (startup, and the forked copy running a script)
+ * An rc that only sets state (NAME=value, export, set -o/+o, alias,
+ * unalias, function definitions) is run once; the resulting variables,
+ * environment, options, aliases and functions are written to a
+ * snapshot ($XDG_CACHE_HOME/tinyshell/rc.snapshot) that later shells map
+ * and apply without parsing the rc. The snapshot is used while the rc's
+ * inode, size and mtime and the environment variables the rc read are
+ * unchanged. An rc that runs commands is run every time.
+ */
+void loadRcFile();
+
+#endif // RCFILE_HPP
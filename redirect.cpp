@@ -0,0 +1,286 @@
+#include "redirect.hpp"
+#include "tinyshell.hpp"
+#include <iostream>
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Lowest fd used for the temporary copy that breaks a dup2 cycle
+#define REDIR_TEMP_MIN 10
+
+/**
+ * Symbolic content of an fd while planning
+ */
+struct FdValue {
+    enum Kind { ORIGINAL, FILE, CLOSED } kind;
+    int index;  // Original fd number (ORIGINAL) or file index (FILE)
+    
+    bool operator==(const FdValue& other) const {
+        return kind == other.kind && index == other.index;
+    }
+};
+
+static RedirStep makeStep(RedirStepType type, int fd, int srcFd) {
+    RedirStep step;
+    step.type = type;
+    step.fd = fd;
+    step.srcFd = srcFd;
+    step.flags = 0;
+    return step;
+}
+
+RedirPlan planRedirections(const std::vector<Redirection>& redirections,
+                           const std::vector<int>* preopened) {
+    RedirPlan plan;
+    
+    // Apply the redirections symbolically, in order
+    std::map<int, FdValue> state;
+    std::vector<const Redirection*> files;
+    std::vector<int> fileFds;   // Preopened fd of every file, or -1
+    for (size_t i = 0; i < redirections.size(); i++) {
+        const Redirection& r = redirections[i];
+        FdValue value;
+        if (r.type == REDIR_OPEN) {
+            value.kind = FdValue::FILE;
+            value.index = (int)files.size();
+            files.push_back(&r);
+            fileFds.push_back(preopened ? (*preopened)[i] : -1);
+        } else if (r.type == REDIR_DUP) {
+            auto it = state.find(r.srcFd);
+            if (it != state.end()) {
+                value = it->second;
+            } else {
+                value.kind = FdValue::ORIGINAL;
+                value.index = r.srcFd;
+            }
+            if (value.kind == FdValue::CLOSED && plan.badFd < 0) {
+                plan.badFd = r.srcFd;
+            }
+        } else {
+            value.kind = FdValue::CLOSED;
+            value.index = -1;
+        }
+        state[r.fd] = value;
+    }
+    
+    // Phase 1: fd-to-fd copies, as a parallel move (sources are read before being overwritten)
+    std::vector<std::pair<int, int> > moves;    // (target, source)
+    std::vector<std::vector<int> > fileTargets(files.size());
+    std::vector<int> closes;
+    for (const auto& entry : state) {
+        const FdValue& v = entry.second;
+        if (v.kind == FdValue::ORIGINAL && v.index != entry.first) {
+            moves.push_back(std::make_pair(entry.first, v.index));
+        } else if (v.kind == FdValue::FILE) {
+            fileTargets[v.index].push_back(entry.first);
+        } else if (v.kind == FdValue::CLOSED) {
+            closes.push_back(entry.first);
+        }
+    }
+    
+    bool tempInUse = false;
+    while (!moves.empty()) {
+        bool progress = false;
+        for (size_t i = 0; i < moves.size(); i++) {
+            bool targetStillRead = false;
+            for (size_t j = 0; j < moves.size(); j++) {
+                if (j != i && moves[j].second == moves[i].first) {
+                    targetStillRead = true;
+                    break;
+                }
+            }
+            if (!targetStillRead) {
+                plan.steps.push_back(makeStep(STEP_DUP2, moves[i].first, moves[i].second));
+                moves.erase(moves.begin() + i);
+                progress = true;
+                break;
+            }
+        }
+        if (progress) continue;
+        
+        // Only cycles are left: save one target, then the cycle is a chain
+        if (tempInUse) {
+            plan.steps.push_back(makeStep(STEP_CLOSE_TEMP, -1, -1));
+        }
+        int saved = moves[0].first;
+        plan.steps.push_back(makeStep(STEP_SAVE, -1, saved));
+        for (auto& m : moves) {
+            if (m.second == saved) m.second = REDIR_TEMP_FD;
+        }
+        tempInUse = true;
+        plan.needsFork = true;
+    }
+    if (tempInUse) {
+        plan.steps.push_back(makeStep(STEP_CLOSE_TEMP, -1, -1));
+    }
+    
+    // Phase 2: every file is opened once, in source order, onto its first target.
+    // A file that is only opened for its side effects borrows an fd that ends
+    // up closed anyway (posix_spawn can only open onto a fixed fd).
+    for (size_t f = 0; f < files.size(); f++) {
+        // Already open in the shell: one dup2, or nothing if it was overwritten
+        if (fileFds[f] >= 0) {
+            if (!fileTargets[f].empty()) {
+                plan.steps.push_back(makeStep(STEP_DUP2, fileTargets[f][0], fileFds[f]));
+            }
+            continue;
+        }
+        
+        RedirStep step = makeStep(STEP_OPEN, -1, -1);
+        step.path = files[f]->path;
+        step.flags = files[f]->flags;
+        if (!fileTargets[f].empty()) {
+            step.fd = fileTargets[f][0];
+            plan.steps.push_back(step);
+        } else if (!closes.empty()) {
+            step.fd = closes[0];
+            plan.steps.push_back(step);
+            plan.steps.push_back(makeStep(STEP_CLOSE, closes[0], -1));
+        } else {
+            plan.steps.push_back(step);
+            plan.needsFork = true;
+        }
+    }
+    
+    // Phase 3: the other fds pointing at the same file are copies of the first
+    for (size_t f = 0; f < files.size(); f++) {
+        for (size_t t = 1; t < fileTargets[f].size(); t++) {
+            plan.steps.push_back(makeStep(STEP_DUP2, fileTargets[f][t], fileTargets[f][0]));
+        }
+    }
+    
+    // Phase 4: closes
+    for (int fd : closes) {
+        plan.steps.push_back(makeStep(STEP_CLOSE, fd, -1));
+    }
+    
+    return plan;
+}
+
+bool preflightRedirections(const std::vector<Redirection>& redirections, std::vector<int>& preopened) {
+    // Keep the shell's copies clear of every fd the plan will write
+    int minFd = REDIR_TEMP_MIN;
+    for (const auto& r : redirections) {
+        if (r.fd >= minFd) minFd = r.fd + 1;
+        if (r.srcFd >= minFd) minFd = r.srcFd + 1;
+    }
+    
+    preopened.assign(redirections.size(), -1);
+    for (size_t i = 0; i < redirections.size(); i++) {
+        const Redirection& r = redirections[i];
+        if (r.type != REDIR_OPEN) continue;
+        
+        int fd = open(r.path.c_str(), r.flags | O_CLOEXEC, REDIR_CREATE_MODE);
+        if (fd >= 0 && fd < minFd) {
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, minFd);
+            close(fd);
+            fd = high;
+        }
+        if (fd < 0) {
+            std::cerr << COLOR_ERROR << "tinyshell: " << r.path << ": " << strerror(errno)
+                      << COLOR_RESET << "\n";
+            closePreopened(preopened);
+            return false;
+        }
+        preopened[i] = fd;
+    }
+    return true;
+}
+
+void closePreopened(std::vector<int>& preopened) {
+    for (int fd : preopened) {
+        if (fd >= 0) close(fd);
+    }
+    preopened.clear();
+}
+
+bool applyRedirPlan(const RedirPlan& plan) {
+    if (plan.badFd >= 0) {
+        std::cerr << COLOR_ERROR << "tinyshell: " << plan.badFd << ": " << strerror(EBADF)
+                  << COLOR_RESET << "\n";
+        return false;
+    }
+    
+    int tempFd = -1;
+    for (const auto& step : plan.steps) {
+        switch (step.type) {
+            case STEP_DUP2: {
+                int src = step.srcFd == REDIR_TEMP_FD ? tempFd : step.srcFd;
+                if (dup2(src, step.fd) < 0) {
+                    std::cerr << COLOR_ERROR << "tinyshell: " << step.srcFd << ": "
+                              << strerror(errno) << COLOR_RESET << "\n";
+                    return false;
+                }
+                break;
+            }
+            case STEP_OPEN: {
+                int fd = open(step.path.c_str(), step.flags, REDIR_CREATE_MODE);
+                if (fd < 0) {
+                    std::cerr << COLOR_ERROR << "tinyshell: " << step.path << ": "
+                              << strerror(errno) << COLOR_RESET << "\n";
+                    return false;
+                }
+                // open() returns the lowest free fd, which may already be the target
+                if (fd != step.fd) {
+                    if (step.fd >= 0 && dup2(fd, step.fd) < 0) {
+                        std::cerr << COLOR_ERROR << "tinyshell: " << step.fd << ": "
+                                  << strerror(errno) << COLOR_RESET << "\n";
+                        close(fd);
+                        return false;
+                    }
+                    close(fd);
+                }
+                break;
+            }
+            case STEP_CLOSE:
+                close(step.fd);
+                break;
+            case STEP_SAVE:
+                tempFd = fcntl(step.srcFd, F_DUPFD_CLOEXEC, REDIR_TEMP_MIN);
+                if (tempFd < 0) {
+                    std::cerr << COLOR_ERROR << "tinyshell: " << step.srcFd << ": "
+                              << strerror(errno) << COLOR_RESET << "\n";
+                    return false;
+                }
+                break;
+            case STEP_CLOSE_TEMP:
+                close(tempFd);
+                tempFd = -1;
+                break;
+        }
+    }
+    return true;
+}
+
+int redirPlanToSpawnActions(const RedirPlan& plan, posix_spawn_file_actions_t* actions) {
+    if (plan.needsFork) {
+        return ENOTSUP;
+    }
+    if (plan.badFd >= 0) {
+        return EBADF;
+    }
+    
+    int err = 0;
+    for (const auto& step : plan.steps) {
+        switch (step.type) {
+            case STEP_DUP2:
+                err = posix_spawn_file_actions_adddup2(actions, step.srcFd, step.fd);
+                break;
+            case STEP_OPEN:
+                err = posix_spawn_file_actions_addopen(actions, step.fd, step.path.c_str(),
+                                                       step.flags, REDIR_CREATE_MODE);
+                break;
+            case STEP_CLOSE:
+                err = posix_spawn_file_actions_addclose(actions, step.fd);
+                break;
+            case STEP_SAVE:
+            case STEP_CLOSE_TEMP:
+                err = ENOTSUP;
+                break;
+        }
+        if (err) return err;
+    }
+    return 0;
+}
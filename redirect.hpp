@@ -0,0 +1,102 @@
+#ifndef REDIRECT_HPP
+#define REDIRECT_HPP
+#include "parser.hpp"
+#include <string>
+#include <vector>
+#include <spawn.h>
+
+/**
+ * Kind of a step in a redirection plan
+ */
+enum RedirStepType {
+    STEP_DUP2,      // dup2(srcFd, fd), srcFd may be REDIR_TEMP_FD
+    STEP_OPEN,      // open(path, flags) onto fd (fd < 0: open and close again)
+    STEP_CLOSE,     // close(fd)
+    STEP_SAVE,      // Copy srcFd to the temporary fd (breaks a dup2 cycle)
+    STEP_CLOSE_TEMP // Close the temporary fd
+};
+
+// Stands for the temporary fd of a STEP_SAVE in later steps
+#define REDIR_TEMP_FD (-2)
+
+// Mode of files created by redirections, masked by the umask as in other shells
+#define REDIR_CREATE_MODE 0666
+
+/**
+ * Structure representing one step of a redirection plan
+ */
+struct RedirStep {
+    RedirStepType type;
+    int fd;             // Target file descriptor
+    int srcFd;          // Source file descriptor (STEP_DUP2, STEP_SAVE)
+    std::string path;   // File to open (STEP_OPEN)
+    int flags;          // open() flags (STEP_OPEN)
+};
+
+/**
+ * Structure representing the fd operations needed to apply a command's
+ * redirections, computed once from the ordered redirection list
+ */
+struct RedirPlan {
+    std::vector<RedirStep> steps;   // Steps in execution order
+    bool needsFork = false;         // true if posix_spawn file actions cannot express it
+    int badFd = -1;                 // fd that was duplicated after being closed, or -1
+};
+
+/**
+ * Compute a minimal dup2/open/close sequence for a list of redirections
+ * 
+ * The redirections are first applied symbolically, in order, to find the
+ * final content of every fd they touch. Only the final state is then
+ * built: an fd that ends up unchanged gets no step, a file is opened once
+ * and duplicated to every fd that ends up pointing at it, and fd-to-fd
+ * copies are ordered so no source is overwritten before it is read. A
+ * cycle (e.g. swapping stdout and stderr) is broken with one temporary fd.
+ * Files that are opened but overwritten later are still opened, for their
+ * side effects (creation, truncation, errors).
+ * 
+ * @param redirections Redirections in source order
+ * @param preopened Optional fds already opened by preflightRedirections()
+ * @return Plan for applyRedirPlan() or redirPlanToSpawnActions()
+ */
+RedirPlan planRedirections(const std::vector<Redirection>& redirections,
+                           const std::vector<int>* preopened = nullptr);
+
+/**
+ * Open the files of a command's redirections in the shell, before forking
+ * A wrong path then fails immediately with a precise message, without a
+ * fork. The fds are opened with O_CLOEXEC above every fd the redirections
+ * mention, so children only keep the copies the plan makes with dup2.
+ * 
+ * @param redirections Redirections in source order
+ * @param preopened Output: fd for every REDIR_OPEN entry, -1 for the others
+ * @return true if every file could be opened (on failure nothing stays open)
+ */
+bool preflightRedirections(const std::vector<Redirection>& redirections, std::vector<int>& preopened);
+
+/**
+ * Close the fds opened by preflightRedirections() (parent, after forking)
+ * 
+ * @param preopened fds to close, cleared afterwards
+ */
+void closePreopened(std::vector<int>& preopened);
+
+/**
+ * Apply a redirection plan to the current process (child after fork)
+ * Prints an error message naming the file or fd on failure
+ * 
+ * @param plan Plan from planRedirections()
+ * @return true on success, false if a step failed
+ */
+bool applyRedirPlan(const RedirPlan& plan);
+
+/**
+ * Translate a redirection plan into posix_spawn file actions
+ * 
+ * @param plan Plan from planRedirections()
+ * @param actions Initialized file actions object to append to
+ * @return 0 on success, or an errno value (ENOTSUP if the plan needs fork)
+ */
+int redirPlanToSpawnActions(const RedirPlan& plan, posix_spawn_file_actions_t* actions);
+
+#endif // REDIRECT_HPP
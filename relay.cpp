@@ -0,0 +1,973 @@
+#include "relay.hpp"
+#include "tinyshell.hpp"
+#include "redirect.hpp"
+#include <iostream>
+#include <memory>
+#include <new>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#include <zlib.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdint>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define RELAY_HAVE_CRC32 1
+#endif
+
+// Bytes read from a command's pipe at once
+#define RELAY_READ_SIZE (256 * 1024)
+// Size of the blocks written to disk by compressing sinks
+#define RELAY_WRITE_SIZE (1024 * 1024)
+// Requested capacity of a relay pipe (the kernel may refuse)
+#define RELAY_PIPE_SIZE (1024 * 1024)
+// Longest partial line a merge holds back
+#define RELAY_LINE_MAX (64 * 1024)
+// Lowest fd used by the shell's copies of relay outputs
+#define RELAY_FD_MIN 10
+
+// Pieces passed to one writev() by the timestamping sink (IOV_MAX is 1024)
+#define RELAY_IOV_BATCH 512
+
+bool RelaySink::writev(const struct iovec* iov, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!write(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len)) return false;
+    }
+    return true;
+}
+
+/**
+ * Collect the position of every newline in data
+ * SSE2 compares 64 bytes per step and turns them into one bit mask.
+ */
+static void findNewlines(const char* data, size_t len, std::vector<size_t>& positions) {
+    positions.clear();
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + k * 16));
+            mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << (k * 16);
+        }
+        while (mask) {
+            positions.push_back(i + __builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (data[i] == '\n') positions.push_back(i);
+    }
+}
+
+/**
+ * CRC32C (Castagnoli) lookup table for CPUs without the crc32 instruction
+ */
+struct Crc32cTable {
+    uint32_t entry[256];
+    
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+            }
+            entry[i] = crc;
+        }
+    }
+};
+
+static uint32_t crc32cScalar(uint32_t crc, const unsigned char* data, size_t len) {
+    // Built on first use, not at startup
+    static const Crc32cTable table;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ table.entry[(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef RELAY_HAVE_CRC32
+// SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; len > 0; data++, len--) {
+        c = _mm_crc32_u8((uint32_t)c, *data);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t, const unsigned char*, size_t);
+
+static Crc32cFn bestCrc32c() {
+#ifdef RELAY_HAVE_CRC32
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) return crc32cHardware;
+#endif
+    return crc32cScalar;
+}
+
+// Chosen on the first checksum, so a shell that never relays skips the CPU probe
+static uint32_t crc32cUpdate(uint32_t crc, const unsigned char* data, size_t len) {
+    static const Crc32cFn best = bestCrc32c();
+    return best(crc, data, len);
+}
+
+/**
+ * Report a relay error (on the relay thread) with a single write
+ */
+static void relayError(const std::string& path, const char* message) {
+    std::string line = std::string(COLOR_ERROR) + "tinyshell: " + path + ": " + message +
+                       COLOR_RESET + "\n";
+    ssize_t ignored = ::write(STDERR_FILENO, line.data(), line.size());
+    (void)ignored;
+}
+
+/**
+ * Last sink of every chain: writes to the open file
+ * A reader that went away (| head) ends the relay without a message.
+ */
+class FileSink : public RelaySink {
+public:
+    FileSink(int fd, const std::string& path) : fd(fd), path(path) {}
+    ~FileSink() { close(fd); }
+
+    bool write(const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EPIPE) relayError(path, strerror(errno));
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool writev(const struct iovec* iov, int count) {
+        std::vector<struct iovec> rest(iov, iov + count);
+        size_t first = 0;
+        while (first < rest.size()) {
+            ssize_t n = ::writev(fd, rest.data() + first, rest.size() - first);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EPIPE) relayError(path, strerror(errno));
+                return false;
+            }
+            // Skip what was written, a piece may be cut in the middle
+            while (first < rest.size() && (size_t)n >= rest[first].iov_len) {
+                n -= rest[first++].iov_len;
+            }
+            if (first < rest.size()) {
+                rest[first].iov_base = static_cast<char*>(rest[first].iov_base) + n;
+                rest[first].iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    bool finish() { return true; }
+
+private:
+    int fd;
+    std::string path;
+};
+
+/**
+ * Gzip compression (zlib deflate with a gzip header)
+ * Output is collected into large blocks before it is passed on.
+ */
+class GzipSink : public RelaySink {
+public:
+    GzipSink(int level, RelaySink* next, const std::string& path)
+        : next(next), path(path), out(RELAY_WRITE_SIZE) {
+        memset(&stream, 0, sizeof(stream));
+        // 15 + 16: largest window, gzip format instead of raw zlib
+        ok = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        resetOutput();
+    }
+    ~GzipSink() {
+        if (ok) deflateEnd(&stream);
+    }
+
+    bool write(const char* data, size_t len) {
+        if (!ok) {
+            relayError(path, "cannot initialize compression");
+            return false;
+        }
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream.avail_in = len;
+        while (stream.avail_in > 0) {
+            if (stream.avail_out == 0 && !flushOutput()) return false;
+            deflate(&stream, Z_NO_FLUSH);
+        }
+        return true;
+    }
+
+    bool finish() {
+        if (!ok) return next->finish();
+        int status;
+        do {
+            if (stream.avail_out == 0 && !flushOutput()) return false;
+            status = deflate(&stream, Z_FINISH);
+        } while (status == Z_OK || status == Z_BUF_ERROR);
+        if (status != Z_STREAM_END) {
+            relayError(path, "compression failed");
+            return false;
+        }
+        return flushOutput() && next->finish();
+    }
+
+private:
+    void resetOutput() {
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+    }
+
+    bool flushOutput() {
+        size_t len = out.size() - stream.avail_out;
+        resetOutput();
+        return len == 0 || next->write(reinterpret_cast<const char*>(out.data()), len);
+    }
+
+    std::unique_ptr<RelaySink> next;
+    std::string path;
+    std::vector<unsigned char> out;
+    z_stream stream;
+    bool ok;
+};
+
+/**
+ * Build the processing sinks of a redirection on top of a file sink
+ */
+static RelaySink* makeRelayChain(const Redirection& r, RelaySink* file) {
+    RelaySink* sink = file;
+    if (r.relay.gzipLevel >= 0) {
+        sink = new GzipSink(r.relay.gzipLevel, sink, r.path);
+    }
+    return sink;
+}
+
+/**
+ * Size- and time-based rotation of the output file
+ * When a threshold is reached, the chain is finished (so a compressed
+ * file is complete), file.1 ... file.N-1 are renamed one number up, the
+ * file becomes file.1 and a new file is opened. This all happens on the
+ * relay thread; the command keeps writing into its pipe meanwhile.
+ * Sizes count the command's output (before compression), and a rotation
+ * waits for the end of the current line unless it grows past twice the
+ * size threshold.
+ */
+class RotateSink : public RelaySink {
+public:
+    RotateSink(const Redirection& r, int fd) : redirection(r), written(0), atLineStart(true) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) written = st.st_size;     // >> continues a file
+        opened = std::chrono::steady_clock::now();
+        chain.reset(makeRelayChain(redirection, new FileSink(fd, r.path)));
+    }
+
+    bool write(const char* data, size_t len) {
+        const RelaySpec& spec = redirection.relay;
+        while (len > 0) {
+            bool rotateNow = due();
+            bool overlong = spec.rotateSize > 0 && written >= 2 * spec.rotateSize;
+            if (rotateNow && (atLineStart || overlong)) {
+                if (!rotate()) return false;
+                rotateNow = false;
+            }
+            
+            size_t n = len;
+            if (rotateNow) {
+                // Finish the current line in the old file
+                const char* newline = static_cast<const char*>(memchr(data, '\n', len));
+                if (newline) n = newline - data + 1;
+            } else if (spec.rotateSize > 0 && spec.rotateSize - written < n) {
+                n = spec.rotateSize - written;     // Stop at the threshold
+            }
+            if (!chain->write(data, n)) return false;
+            written += n;
+            atLineStart = data[n - 1] == '\n';
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool finish() { return chain && chain->finish(); }
+
+private:
+    bool due() const {
+        const RelaySpec& spec = redirection.relay;
+        if (spec.rotateSize > 0 && written >= spec.rotateSize) return true;
+        return spec.rotateSeconds > 0 &&
+               std::chrono::steady_clock::now() - opened >= std::chrono::seconds(spec.rotateSeconds);
+    }
+
+    bool rotate() {
+        bool ok = chain->finish();
+        chain.reset();  // Closes the file
+        
+        const std::string& path = redirection.path;
+        int keep = redirection.relay.keep;
+        if (keep == 0) {
+            unlink(path.c_str());
+        } else {
+            for (int n = keep - 1; n >= 1; n--) {
+                std::string from = path + "." + std::to_string(n);
+                rename(from.c_str(), (path + "." + std::to_string(n + 1)).c_str());
+            }
+            rename(path.c_str(), (path + ".1").c_str());
+        }
+        
+        int fd = open(path.c_str(), (redirection.flags & ~O_APPEND) | O_CREAT | O_TRUNC | O_CLOEXEC, REDIR_CREATE_MODE);
+        if (fd < 0) {
+            relayError(path, strerror(errno));
+            return false;
+        }
+        written = 0;
+        opened = std::chrono::steady_clock::now();
+        chain.reset(makeRelayChain(redirection, new FileSink(fd, path)));
+        return ok;
+    }
+
+    Redirection redirection;
+    std::unique_ptr<RelaySink> chain;
+    unsigned long long written;     // Output bytes in the current file
+    bool atLineStart;               // The last byte written ended a line
+    std::chrono::steady_clock::time_point opened;
+};
+
+/**
+ * Prefix every line with a timestamp
+ * All lines of one read share a timestamp, so it is formatted once per
+ * read. The prefixes and the lines, still in the read buffer, are passed
+ * on as one batch of pieces: a single writev() for up to 256 lines.
+ */
+class TimestampSink : public RelaySink {
+public:
+    TimestampSink(RelayTimestamp kind, RelaySink* next)
+        : kind(kind), next(next), atLineStart(true) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+
+    bool write(const char* data, size_t len) {
+        formatPrefix();
+        findNewlines(data, len, newlines);
+        
+        iov.clear();
+        size_t start = 0;
+        for (size_t k = 0; k <= newlines.size(); k++) {
+            size_t end = k < newlines.size() ? newlines[k] + 1 : len;
+            if (end == start) break;    // Data ended with a newline
+            if (atLineStart) {
+                iov.push_back(iovec{const_cast<char*>(prefix), prefixLen});
+            }
+            iov.push_back(iovec{const_cast<char*>(data + start), end - start});
+            atLineStart = k < newlines.size();
+            start = end;
+            
+            if (iov.size() >= RELAY_IOV_BATCH) {
+                if (!next->writev(iov.data(), iov.size())) return false;
+                iov.clear();
+            }
+        }
+        return iov.empty() || next->writev(iov.data(), iov.size());
+    }
+
+    bool finish() { return next->finish(); }
+
+private:
+    void formatPrefix() {
+        struct timespec now;
+        if (kind == TS_MONO) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long sec = now.tv_sec - started.tv_sec;
+            long nsec = now.tv_nsec - started.tv_nsec;
+            if (nsec < 0) {
+                sec--;
+                nsec += 1000000000L;
+            }
+            prefixLen = snprintf(prefix, sizeof(prefix), "[%8ld.%06ld] ", sec, nsec / 1000);
+        } else {
+            clock_gettime(CLOCK_REALTIME, &now);
+            struct tm local;
+            localtime_r(&now.tv_sec, &local);
+            size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &local);
+            prefixLen = n + snprintf(prefix + n, sizeof(prefix) - n, ".%06ld ", now.tv_nsec / 1000);
+        }
+    }
+
+    RelayTimestamp kind;
+    std::unique_ptr<RelaySink> next;
+    bool atLineStart;                   // The next byte starts a line
+    struct timespec started;            // Origin of TS_MONO
+    char prefix[64];
+    size_t prefixLen;
+    std::vector<size_t> newlines;       // Reused between reads
+    std::vector<struct iovec> iov;
+};
+
+/**
+ * CRC32C of the command's output, computed while it streams through
+ */
+class ChecksumSink : public RelaySink {
+public:
+    explicit ChecksumSink(RelaySink* next) : next(next), crc(~0u) {}
+
+    bool write(const char* data, size_t len) {
+        crc = crc32cUpdate(crc, reinterpret_cast<const unsigned char*>(data), len);
+        return next->write(data, len);
+    }
+
+    bool finish() { return next->finish(); }
+
+    std::string digest() const {
+        char text[32];
+        snprintf(text, sizeof(text), "crc32c %08x", ~crc);
+        return text;
+    }
+
+private:
+    std::unique_ptr<RelaySink> next;
+    uint32_t crc;
+};
+
+/**
+ * One producer of a line-merged group
+ * Only whole lines are passed to the shared output, and every sink runs on
+ * the relay thread, so lines of different producers never interleave. A
+ * partial line waits for its end, or goes out when it grows too long.
+ */
+class LineMergeSink : public RelaySink {
+public:
+    explicit LineMergeSink(const std::shared_ptr<RelaySink>& out) : out(out) {}
+
+    bool write(const char* data, size_t len) {
+        const char* last = static_cast<const char*>(memrchr(data, '\n', len));
+        if (!last) {
+            pending.append(data, len);
+            if (pending.size() < RELAY_LINE_MAX) return true;
+            bool ok = out->write(pending.data(), pending.size());
+            pending.clear();
+            return ok;
+        }
+        
+        size_t lines = last - data + 1;
+        bool ok;
+        if (pending.empty()) {
+            ok = out->write(data, lines);
+        } else {
+            struct iovec iov[2] = {
+                { const_cast<char*>(pending.data()), pending.size() },
+                { const_cast<char*>(data), lines }
+            };
+            ok = out->writev(iov, 2);
+        }
+        pending.assign(data + lines, len - lines);
+        return ok;
+    }
+
+    bool finish() {
+        // A last line without a newline still goes out in one piece
+        bool ok = pending.empty() || out->write(pending.data(), pending.size());
+        pending.clear();
+        return ok;
+    }
+
+private:
+    std::shared_ptr<RelaySink> out;
+    std::string pending;    // Start of a line whose end has not arrived yet
+};
+
+/**
+ * Build the sink chain for a redirection
+ */
+static RelaySink* makeRelaySink(const Redirection& r, int fd) {
+    RelaySink* sink;
+    if (r.relay.rotates()) {
+        sink = new RotateSink(r, fd);
+    } else {
+        sink = makeRelayChain(r, new FileSink(fd, r.path));
+    }
+    if (r.relay.timestamps != TS_NONE) {
+        sink = new TimestampSink(r.relay.timestamps, sink);
+    }
+    // Outermost, so it sums exactly what the command wrote
+    if (r.relay.checksum) {
+        sink = new ChecksumSink(sink);
+    }
+    return sink;
+}
+
+/**
+ * A running relay: one command output pipe and its sink chain
+ */
+struct RelayTask {
+    int id;
+    int inFd;
+    std::unique_ptr<RelaySink> sink;
+};
+
+// State shared between the shell and the relay thread
+static std::mutex relayMutex;
+static std::condition_variable relayFinished;
+static std::vector<RelayTask*> relayPending;   // Started, not yet seen by the thread
+static std::map<int, RelayStats> relayTable;   // Progress and result of every relay
+static int relayNextId = 1;
+static int relayWake[2] = {-1, -1};             // Self-pipe to wake the thread's poll()
+
+/**
+ * Register a relay's statistics (relayMutex held)
+ *
+ * @return Id of the new relay
+ */
+static int registerRelay(const std::string& path, bool checksum) {
+    int id = relayNextId++;
+    RelayStats& stats = relayTable[id];
+    stats.path = path;
+    stats.checksum = checksum;
+    return id;
+}
+
+// Count bytes that went through a relay
+static void countRelayBytes(int id, size_t bytes) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    auto it = relayTable.find(id);
+    if (it != relayTable.end()) it->second.bytes += bytes;
+}
+
+// Mark a relay as finished and wake waitRelays()
+static void finishRelay(int id, const std::string& digest) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    auto it = relayTable.find(id);
+    if (it != relayTable.end()) {
+        it->second.finished = true;
+        it->second.digest = digest;
+    }
+    relayFinished.notify_all();
+}
+
+static void relayThreadMain() {
+    std::vector<std::unique_ptr<RelayTask>> tasks;
+    std::vector<pollfd> fds;
+    std::vector<char> buffer(RELAY_READ_SIZE);
+
+    for (;;) {
+        fds.clear();
+        fds.push_back(pollfd{relayWake[0], POLLIN, 0});
+        for (const auto& task : tasks) {
+            fds.push_back(pollfd{task->inFd, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            continue;   // EINTR
+        }
+
+        // New relays
+        if (fds[0].revents) {
+            char drain[64];
+            ssize_t ignored = read(relayWake[0], drain, sizeof(drain));
+            (void)ignored;
+            std::lock_guard<std::mutex> lock(relayMutex);
+            for (RelayTask* task : relayPending) {
+                tasks.push_back(std::unique_ptr<RelayTask>(task));
+            }
+            relayPending.clear();
+        }
+
+        // Move data; tasks added above have no poll entry yet
+        for (size_t i = fds.size() - 1; i > 0; i--) {
+            if (!fds[i].revents) continue;
+            RelayTask& task = *tasks[i - 1];
+
+            ssize_t n = read(task.inFd, buffer.data(), buffer.size());
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            bool ok = true;
+            bool done = n <= 0 ? (ok = task.sink->finish(), true) : !(ok = task.sink->write(buffer.data(), n));
+            if (n > 0) {
+                countRelayBytes(task.id, n);
+            }
+            if (!done) continue;
+
+            // Closing the pipe makes a writer that is still running get SIGPIPE
+            close(task.inFd);
+            std::string digest = ok ? task.sink->digest() : "failed";
+            int id = task.id;
+            tasks.erase(tasks.begin() + (i - 1));
+            finishRelay(id, digest);
+        }
+    }
+}
+
+/**
+ * Start a detached thread with every signal blocked, so job control
+ * signals keep going to the shell's main thread (and a closed pipe
+ * gives EPIPE instead of SIGPIPE)
+ */
+template <class Fn, class... Args>
+static void startQuietThread(Fn fn, Args... args) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    std::thread(fn, args...).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+/**
+ * Start the relay thread on first use
+ */
+static bool ensureRelayThread() {
+    if (relayWake[0] >= 0) {
+        return true;
+    }
+    if (pipe2(relayWake, O_CLOEXEC) < 0) {
+        return false;
+    }
+    startQuietThread(relayThreadMain);
+    return true;
+}
+
+/**
+ * Queue a relay for the thread (relayMutex held)
+ * 
+ * @return Id of the new relay
+ */
+static int queueRelay(int inFd, RelaySink* sink, const std::string& path, bool checksum) {
+    RelayTask* task = new RelayTask;
+    task->id = registerRelay(path, checksum);
+    task->inFd = inFd;
+    task->sink.reset(sink);
+    relayPending.push_back(task);
+    return task->id;
+}
+
+static void wakeRelayThread() {
+    char wake = 1;
+    ssize_t ignored = write(relayWake[1], &wake, 1);
+    (void)ignored;
+}
+
+bool hasRelays(const std::vector<Redirection>& redirections) {
+    for (const auto& r : redirections) {
+        if (r.type == REDIR_OPEN && r.relay.active()) return true;
+    }
+    return false;
+}
+
+bool startRelays(const std::vector<Redirection>& redirections, std::vector<int>& preopened,
+                 std::vector<int>& relayIds) {
+    if (!ensureRelayThread()) {
+        std::cerr << COLOR_ERROR << "tinyshell: relay: " << strerror(errno) << COLOR_RESET << "\n";
+        return false;
+    }
+
+    // Create every pipe first, so a failure leaves nothing started
+    struct NewRelay {
+        size_t index;   // Redirection index
+        int readFd;     // Read end of the pipe
+        int fileFd;     // File opened by preflightRedirections()
+    };
+    std::vector<NewRelay> relays;
+    for (size_t i = 0; i < redirections.size(); i++) {
+        const Redirection& r = redirections[i];
+        if (r.type != REDIR_OPEN || !r.relay.active()) continue;
+
+        int fds[2];
+        int writeFd = -1;
+        if (pipe2(fds, O_CLOEXEC) == 0) {
+            // The write end replaces the file fd, so it must stay as high as it
+            writeFd = fcntl(fds[1], F_DUPFD_CLOEXEC, preopened[i]);
+            close(fds[1]);
+            if (writeFd < 0) close(fds[0]);
+        }
+        if (writeFd < 0) {
+            std::cerr << COLOR_ERROR << "tinyshell: " << r.path << ": " << strerror(errno)
+                      << COLOR_RESET << "\n";
+            // The write ends in preopened are closed by the caller
+            for (const auto& relay : relays) {
+                close(relay.readFd);
+                close(relay.fileFd);
+            }
+            return false;
+        }
+        fcntl(writeFd, F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+        relays.push_back(NewRelay{i, fds[0], preopened[i]});
+        preopened[i] = writeFd;
+    }
+
+    // Hand the file fds and read ends over to the relay thread
+    std::lock_guard<std::mutex> lock(relayMutex);
+    for (const auto& relay : relays) {
+        const Redirection& r = redirections[relay.index];
+        relayIds.push_back(queueRelay(relay.readFd, makeRelaySink(r, relay.fileFd), r.path, r.relay.checksum));
+    }
+    wakeRelayThread();
+    return true;
+}
+
+bool startLineMerge(int outFd, size_t count, std::vector<int>& writeFds, std::vector<int>& relayIds) {
+    if (!ensureRelayThread()) {
+        std::cerr << COLOR_ERROR << "tinyshell: relay: " << strerror(errno) << COLOR_RESET << "\n";
+        return false;
+    }
+    
+    int out = fcntl(outFd, F_DUPFD_CLOEXEC, RELAY_FD_MIN);
+    std::vector<int> readFds;
+    std::vector<int> newWriteFds;
+    while (out >= 0 && readFds.size() < count) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) break;
+        readFds.push_back(fds[0]);
+        newWriteFds.push_back(fds[1]);
+    }
+    if (out < 0 || readFds.size() < count) {
+        std::cerr << COLOR_ERROR << "tinyshell: pipe failed" << COLOR_RESET << "\n";
+        if (out >= 0) close(out);
+        for (size_t k = 0; k < readFds.size(); k++) {
+            close(readFds[k]);
+            close(newWriteFds[k]);
+        }
+        return false;
+    }
+    
+    // The output fd is closed when the last producer's relay ends
+    std::shared_ptr<RelaySink> merged(new FileSink(out, "merge"));
+    std::lock_guard<std::mutex> lock(relayMutex);
+    for (int fd : readFds) {
+        relayIds.push_back(queueRelay(fd, new LineMergeSink(merged), "merge", false));
+    }
+    writeFds.insert(writeFds.end(), newWriteFds.begin(), newWriteFds.end());
+    wakeRelayThread();
+    return true;
+}
+
+// Write all of data to a pipe; false once its reader is gone
+static bool writeFully(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Read exactly len bytes that are known to be in a pipe
+static bool readFully(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::read(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Fan-out of a pipeline graph, on its own thread
+ * Every round takes what is queued in the input pipe: tee() duplicates it
+ * into each output but the last, and splice() moves it into the last one,
+ * so the data never passes through user space. An output with too little
+ * room gets the part tee() could not place from a buffer of at most one
+ * input pipe's worth, and the next round only starts once every output has
+ * its copy: a slow branch stalls the producer, memory does not grow.
+ */
+static void fanOutMain(int id, int inFd, std::vector<int> outFds) {
+    std::vector<char> buffer;
+    std::vector<size_t> placed(outFds.size());
+    size_t live = outFds.size();
+
+    while (live > 0) {
+        pollfd pfd = {inFd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) continue;
+        int queued = 0;
+        if (ioctl(inFd, FIONREAD, &queued) < 0 || queued <= 0) {
+            if (pfd.revents & (POLLHUP | POLLERR)) break;   // End of file
+            continue;
+        }
+        size_t n = queued;
+
+        // Duplicate into every output but the last open one
+        size_t last = outFds.size();
+        while (outFds[--last] < 0) {}
+        bool complete = true;
+        for (size_t k = 0; k < last; k++) {
+            if (outFds[k] < 0) continue;
+            ssize_t m = tee(inFd, outFds[k], n, 0);
+            placed[k] = m < 0 ? n : m;
+            if (m < 0) {
+                close(outFds[k]);
+                outFds[k] = -1;
+                live--;
+            }
+            complete = complete && placed[k] == n;
+        }
+
+        // Move into the last one, unless someone still needs the data
+        size_t consumed = 0;
+        ssize_t m = complete ? splice(inFd, nullptr, outFds[last], nullptr, n, 0)
+                             : tee(inFd, outFds[last], n, 0);
+        placed[last] = m < 0 ? n : m;
+        if (complete && m > 0) consumed = m;
+        if (m < 0) {
+            close(outFds[last]);
+            outFds[last] = -1;
+            live--;
+        }
+
+        // The rest goes through the buffer: bytes [consumed, n)
+        buffer.resize(n - consumed);
+        if (!readFully(inFd, buffer.data(), buffer.size())) break;
+        for (size_t k = 0; k < outFds.size(); k++) {
+            if (outFds[k] < 0 || placed[k] == n) continue;
+            if (!writeFully(outFds[k], buffer.data() + (placed[k] - consumed), n - placed[k])) {
+                close(outFds[k]);
+                outFds[k] = -1;
+                live--;
+            }
+        }
+        countRelayBytes(id, n);
+    }
+
+    // With every consumer gone, the producer gets SIGPIPE
+    close(inFd);
+    for (int fd : outFds) {
+        if (fd >= 0) close(fd);
+    }
+    finishRelay(id, std::string());
+}
+
+/**
+ * Fan-in of a pipeline graph, on its own thread
+ * Like a line merge on the relay thread, but a slow consumer only stalls
+ * this junction, never the relays of other commands.
+ */
+static void fanInMain(int id, std::vector<int> inFds, int outFd, std::string name) {
+    std::shared_ptr<RelaySink> merged(new FileSink(outFd, name));
+    std::vector<std::unique_ptr<RelaySink>> sinks;
+    for (size_t k = 0; k < inFds.size(); k++) {
+        sinks.push_back(std::unique_ptr<RelaySink>(new LineMergeSink(merged)));
+    }
+    std::vector<char> buffer(RELAY_READ_SIZE);
+    std::vector<pollfd> fds;
+    std::vector<size_t> which;
+    bool ok = true;
+
+    for (;;) {
+        fds.clear();
+        which.clear();
+        for (size_t k = 0; k < inFds.size(); k++) {
+            if (inFds[k] < 0) continue;
+            fds.push_back(pollfd{inFds[k], POLLIN, 0});
+            which.push_back(k);
+        }
+        if (fds.empty() || !ok) break;
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+
+        for (size_t i = 0; i < fds.size() && ok; i++) {
+            if (!fds[i].revents) continue;
+            size_t k = which[i];
+            ssize_t n = read(inFds[k], buffer.data(), buffer.size());
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (n > 0) {
+                ok = sinks[k]->write(buffer.data(), n);
+                countRelayBytes(id, n);
+                continue;
+            }
+            ok = sinks[k]->finish();
+            close(inFds[k]);
+            inFds[k] = -1;
+        }
+    }
+
+    // The consumer is gone: close the other inputs too (SIGPIPE upstream)
+    for (int fd : inFds) {
+        if (fd >= 0) close(fd);
+    }
+    sinks.clear();
+    merged.reset();
+    finishRelay(id, std::string());
+}
+
+int startFanOut(int inFd, const std::vector<int>& outFds, const std::string& name) {
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(relayMutex);
+        id = registerRelay(name, false);
+    }
+    startQuietThread(fanOutMain, id, inFd, outFds);
+    return id;
+}
+
+int startFanIn(const std::vector<int>& inFds, int outFd, const std::string& name) {
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(relayMutex);
+        id = registerRelay(name, false);
+    }
+    startQuietThread(fanInMain, id, inFds, outFd, name);
+    return id;
+}
+
+void waitRelays(const std::vector<int>& relayIds) {
+    std::unique_lock<std::mutex> lock(relayMutex);
+    for (int id : relayIds) {
+        relayFinished.wait(lock, [id] {
+            auto it = relayTable.find(id);
+            return it == relayTable.end() || it->second.finished;
+        });
+    }
+}
+
+bool getRelayStats(int relayId, RelayStats& stats) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    auto it = relayTable.find(relayId);
+    if (it == relayTable.end()) {
+        return false;
+    }
+    stats = it->second;
+    return true;
+}
+
+void forgetRelays(const std::vector<int>& relayIds) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    for (int id : relayIds) {
+        relayTable.erase(id);
+    }
+}
+
+void resetRelaysAfterFork() {
+    // The lock may have been held by a thread that no longer exists
+    new (&relayMutex) std::mutex();
+    new (&relayFinished) std::condition_variable();
+    if (relayWake[0] >= 0) {
+        close(relayWake[0]);
+        close(relayWake[1]);
+        relayWake[0] = relayWake[1] = -1;
+    }
+    relayPending.clear();
+    relayTable.clear();
+}
@@ -0,0 +1,151 @@
+#ifndef RELAY_HPP
+#define RELAY_HPP
+#include "parser.hpp"
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+/**
+ * Stage of a relay: receives the output stream of a command
+ * Sinks are chained (e.g. compression, then the file) and all run on the
+ * shell's relay thread.
+ */
+class RelaySink {
+public:
+    virtual ~RelaySink() {}
+
+    /**
+     * Pass the next bytes of the stream
+     *
+     * @return false if the output failed (the error was reported)
+     */
+    virtual bool write(const char* data, size_t len) = 0;
+
+    /**
+     * Pass several pieces of the stream at once (default: one write() each)
+     *
+     * @return false if the output failed (the error was reported)
+     */
+    virtual bool writev(const struct iovec* iov, int count);
+
+    /**
+     * End of the stream: flush everything that is still buffered
+     *
+     * @return false if the output failed (the error was reported)
+     */
+    virtual bool finish() = 0;
+
+    /**
+     * Result of the stream for the job's statistics (e.g. a checksum)
+     *
+     * @return Text such as "crc32c 1a2b3c4d", empty if there is none
+     */
+    virtual std::string digest() const { return std::string(); }
+};
+
+/**
+ * Progress and result of one relay, as shown by jobs --stats
+ */
+struct RelayStats {
+    std::string path;               // Destination file
+    unsigned long long bytes = 0;   // Bytes received from the command so far
+    bool checksum = false;          // A checksum was requested
+    bool finished = false;          // All data has been written
+    std::string digest;             // Result once finished ("crc32c 1a2b3c4d", "failed")
+};
+
+/**
+ * Check whether any redirection of a command goes through a relay
+ *
+ * @param redirections Redirections in source order
+ * @return true if at least one redirection has an active RelaySpec
+ */
+bool hasRelays(const std::vector<Redirection>& redirections);
+
+/**
+ * Start the relays of a command's redirections (parent, before forking)
+ * For every redirection with an active RelaySpec, the file opened by
+ * preflightRedirections() is handed to the relay thread together with the
+ * read end of a new pipe, and the pipe's write end takes its place in
+ * preopened. The child then writes into the pipe instead of the file.
+ *
+ * @param redirections Redirections in source order
+ * @param preopened fds from preflightRedirections(), updated in place
+ * @param relayIds Output: ids of the started relays, for waitRelays()
+ * @return true on success (on failure nothing was started)
+ */
+bool startRelays(const std::vector<Redirection>& redirections, std::vector<int>& preopened,
+                 std::vector<int>& relayIds);
+
+/**
+ * Start a line merge for a parallel group (parent, before forking)
+ * Every producer gets its own pipe; the relay thread passes on whole
+ * lines only, so the lines of different producers never mix. The output
+ * is closed once every producer's pipe has reached end of file.
+ *
+ * @param outFd Where the merged lines go (the shell keeps its own copy)
+ * @param count Number of producers
+ * @param writeFds Output: write end for each producer (O_CLOEXEC)
+ * @param relayIds Output: ids of the started relays, for waitRelays()
+ * @return true on success (on failure nothing was started)
+ */
+bool startLineMerge(int outFd, size_t count, std::vector<int>& writeFds, std::vector<int>& relayIds);
+
+/**
+ * Start a fan-out of a pipeline graph (parent, before forking)
+ * Everything written into inFd's pipe is copied to every output pipe by
+ * a thread of its own (tee/splice). A full output stalls the copy, and so
+ * the producer; an output whose reader is gone is dropped.
+ *
+ * @param inFd Read end of the producer's pipe (taken over)
+ * @param outFds Write ends of the consumers' pipes (taken over)
+ * @param name Name for jobs --stats
+ * @return Relay id, for waitRelays()
+ */
+int startFanOut(int inFd, const std::vector<int>& outFds, const std::string& name);
+
+/**
+ * Start a fan-in of a pipeline graph (parent, before forking)
+ * Whole lines from every input pipe go to outFd on a thread of its own,
+ * like startLineMerge() but independent of the relay thread.
+ *
+ * @param inFds Read ends of the producers' pipes (taken over)
+ * @param outFd Write end of the consumer's pipe (taken over)
+ * @param name Name for jobs --stats
+ * @return Relay id, for waitRelays()
+ */
+int startFanIn(const std::vector<int>& inFds, int outFd, const std::string& name);
+
+/**
+ * Wait until relays have written all of their data
+ * A relay ends when every writer of its pipe has closed it, so this is
+ * called after the command that writes into it has finished.
+ *
+ * @param relayIds Ids from startRelays()
+ */
+void waitRelays(const std::vector<int>& relayIds);
+
+/**
+ * Get the progress and result of a relay
+ *
+ * @param relayId Id from startRelays()
+ * @param stats Output: copy of the relay's statistics
+ * @return false if the id is unknown (or was forgotten)
+ */
+bool getRelayStats(int relayId, RelayStats& stats);
+
+/**
+ * Drop the statistics of relays once they were reported
+ *
+ * @param relayIds Ids from startRelays()
+ */
+void forgetRelays(const std::vector<int>& relayIds);
+
+/**
+ * Forget the relays in a forked copy of the shell
+ * Threads do not survive fork(): the copy starts its own relay thread on
+ * first use, and the relays of the parent stay with the parent.
+ */
+void resetRelaysAfterFork();
+
+#endif // RELAY_HPP
@@ -0,0 +1,91 @@
+#include "symbols.hpp"
+#include <unordered_map>
+#include <algorithm>
+
+// Name -> symbol, and the tables indexed by symbol
+static std::unordered_map<std::string, Symbol> symbolTable;
+static std::vector<std::string> symbolNames;
+static std::vector<std::unique_ptr<AliasDef>> aliases;
+static std::vector<std::shared_ptr<const FunctionBody>> functions;
+static size_t aliasCount = 0;
+static size_t functionCount = 0;
+
+Symbol internSymbol(const std::string& name) {
+    auto it = symbolTable.find(name);
+    if (it != symbolTable.end()) return it->second;
+    Symbol symbol = symbolNames.size();
+    symbolTable.emplace(name, symbol);
+    symbolNames.push_back(name);
+    aliases.resize(symbolNames.size());
+    functions.resize(symbolNames.size());
+    return symbol;
+}
+
+// Find a name without interning it: a lookup miss must not grow the table
+static bool findSymbol(const std::string& name, Symbol& symbol) {
+    auto it = symbolTable.find(name);
+    if (it == symbolTable.end()) return false;
+    symbol = it->second;
+    return true;
+}
+
+bool defineAlias(const std::string& name, const std::string& text) {
+    AliasDef alias;
+    alias.text = text;
+    if (!lexTokens(text, alias.tokens)) return false;
+    defineAlias(name, alias);
+    return true;
+}
+
+void defineAlias(const std::string& name, const AliasDef& alias) {
+    Symbol symbol = internSymbol(name);
+    if (!aliases[symbol]) aliasCount++;
+    aliases[symbol].reset(new AliasDef(alias));
+}
+
+bool removeAlias(const std::string& name) {
+    Symbol symbol;
+    if (!findSymbol(name, symbol) || !aliases[symbol]) return false;
+    aliases[symbol].reset();
+    aliasCount--;
+    return true;
+}
+
+const AliasDef* lookupAlias(const std::string& name) {
+    Symbol symbol;
+    if (aliasCount == 0 || !findSymbol(name, symbol)) return nullptr;
+    return aliases[symbol].get();
+}
+
+void defineFunction(const std::string& name, const std::shared_ptr<const FunctionBody>& body) {
+    Symbol symbol = internSymbol(name);
+    if (!functions[symbol]) functionCount++;
+    functions[symbol] = body;
+}
+
+std::shared_ptr<const FunctionBody> lookupFunction(const std::string& name) {
+    Symbol symbol;
+    if (functionCount == 0 || !findSymbol(name, symbol)) return nullptr;
+    return functions[symbol];
+}
+
+bool haveAliases() {
+    return aliasCount > 0;
+}
+
+std::vector<std::string> definedNames(bool wantFunctions) {
+    std::vector<std::string> names;
+    for (Symbol symbol = 0; symbol < symbolNames.size(); symbol++) {
+        if (wantFunctions ? (bool)functions[symbol] : (bool)aliases[symbol]) {
+            names.push_back(symbolNames[symbol]);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void clearDefinitions() {
+    for (auto& alias : aliases) alias.reset();
+    for (auto& function : functions) function.reset();
+    aliasCount = functionCount = 0;
+}
@@ -0,0 +1,97 @@
+#ifndef SYMBOLS_HPP
+#define SYMBOLS_HPP
+#include "parser.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Interned name: the same name always gets the same small number
+typedef uint32_t Symbol;
+
+/**
+ * Value of an alias: lexed once when it is defined
+ */
+struct AliasDef {
+    std::string text;                   // Value as given to alias, for listing
+    std::vector<LexedToken> tokens;     // Value as lexed, spliced in place of the name
+};
+
+/**
+ * Intern a name
+ *
+ * @param name Command name
+ * @return Its symbol (a new one if the name was never seen)
+ */
+Symbol internSymbol(const std::string& name);
+
+/**
+ * Define or replace an alias
+ *
+ * @param name Alias name
+ * @param text Value in shell syntax
+ * @return false if the value ends inside a quote or after a backslash
+ */
+bool defineAlias(const std::string& name, const std::string& text);
+
+/**
+ * Define or replace an alias from already lexed tokens (rc snapshots)
+ *
+ * @param name Alias name
+ * @param alias Value and its tokens
+ */
+void defineAlias(const std::string& name, const AliasDef& alias);
+
+/**
+ * Remove an alias
+ *
+ * @param name Alias name
+ * @return false if there was no such alias
+ */
+bool removeAlias(const std::string& name);
+
+/**
+ * Look up an alias (the parser, for every word in command position)
+ *
+ * @param name Word
+ * @return The alias, nullptr if the word is none
+ */
+const AliasDef* lookupAlias(const std::string& name);
+
+/**
+ * Define or replace a function
+ *
+ * @param name Function name
+ * @param body Parsed body
+ */
+void defineFunction(const std::string& name, const std::shared_ptr<const FunctionBody>& body);
+
+/**
+ * Look up a function (before PATH)
+ *
+ * @param name Command name
+ * @return The body, nullptr if there is no such function
+ */
+std::shared_ptr<const FunctionBody> lookupFunction(const std::string& name);
+
+/**
+ * Check whether any alias is defined, so the parser can skip the lookups
+ *
+ * @return true if at least one alias exists
+ */
+bool haveAliases();
+
+/**
+ * Get the names of all aliases or all functions
+ *
+ * @param functions true for functions, false for aliases
+ * @return Names in sorted order
+ */
+std::vector<std::string> definedNames(bool functions);
+
+/**
+ * Remove all aliases and functions (a forked copy that acts as a new shell)
+ */
+void clearDefinitions();
+
+#endif // SYMBOLS_HPP
@@ -23,8 +23,19 @@
 #include "utils.hpp"
 #include "parser.hpp"
 #include "jobs.hpp"
+#include "redirect.hpp"
+#include "relay.hpp"
+#include "variables.hpp"
+#include "pathcache.hpp"
+#include "rcfile.hpp"
+#include "symbols.hpp"
+#include "format.hpp"
+#include "condition.hpp"
+#include "arith.hpp"
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
@@ -33,6 +44,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <cerrno>
+#include <map>
 
 // Global variables for job management
 std::vector<Job> jobTable;
@@ -42,74 +57,112 @@ pid_t shell_pgid;
 int shell_terminal;
 bool shell_is_interactive;
 
-ParsedCommand::ParsedCommand(){}
-ParsedPipeline::ParsedPipeline(){}
+// Shell options (set -o / set +o)
+ShellOptions shellOptions;
+
+// Time the other stages get after a pipeline's last stage exited (set -o teardown)
+#define TEARDOWN_GRACE_MS 50
+#define TEARDOWN_POLL_MS 2
+
+// Deepest nesting of function calls, so a function that calls itself ends
+#define FUNCTION_DEPTH_MAX 100
+
+// Current coprocess (coproc builtin)
+Coprocess coprocess;
+
+// Finished jobs whose relays jobs --stats has not shown yet (oldest dropped first)
+#define FINISHED_JOBS_MAX 32
+static std::vector<Job> finishedJobs;
+
+/**
+ * Entry of the option table used by the set builtin
+ */
+struct ShellOptionEntry {
+    const char* name;
+    bool ShellOptions::* flag;
+};
+
+static const ShellOptionEntry shellOptionTable[] = {
+    { "preflight", &ShellOptions::preflight },
+    { "teardown", &ShellOptions::teardown },
+};
 
 std::string findInPath(const std::string& command) {
-    if (command.find('/') != std::string::npos) {
-        if (access(command.c_str(), X_OK) == 0) {
-            return command;
-        }
-        return "";
+    CommandLocation location;
+    return locateCommand(command, location) ? location.path : std::string();
+}
+
+static void runScriptInChild(const CommandLocation& location, const std::vector<std::string>& args);
+static void runFunctionInChild(const FunctionBody& body, const std::vector<std::string>& args);
+
+// Report a command that is not in PATH, with the closest names there
+static void reportCommandNotFound(const std::string& command) {
+    std::cerr << COLOR_ERROR << "tinyshell: command not found: " << command;
+    std::vector<std::string> matches = suggestCommands(command, 3);
+    for (size_t i = 0; i < matches.size(); i++) {
+        std::cerr << (i == 0 ? " (did you mean " : i + 1 == matches.size() ? " or " : ", ") << matches[i];
     }
-    
-    const char* pathEnv = getenv("PATH");
-    if (!pathEnv) return "";
-    
-    std::string pathStr(pathEnv);
-    std::istringstream pathStream(pathStr);
-    std::string dir;
-    
-    while (std::getline(pathStream, dir, ':')) {
-        if (dir.empty()) continue;
-        
-        std::string fullPath = dir + "/" + command;
-        if (access(fullPath.c_str(), X_OK) == 0) {
-            return fullPath;
-        }
+    std::cerr << (matches.empty() ? "" : "?)") << COLOR_RESET << "\n";
+}
+
+void setupRedirections(const ParsedCommand& cmd, const std::vector<int>* preopened) {
+    if (cmd.redirections.empty()) {
+        return;
     }
     
-    return "";
+    RedirPlan plan = planRedirections(cmd.redirections, preopened);
+    if (!applyRedirPlan(plan)) {
+        exit(1);
+    }
 }
 
-void setupRedirections(const ParsedCommand& cmd) {
-    if (!cmd.inputFile.empty()) {	// If "<"
-        int fd = open(cmd.inputFile.c_str(), O_RDONLY);
-        if (fd < 0) {
-            std::cerr << COLOR_ERROR << "tinyshell: cannot open input file\n" 
-                        << COLOR_RESET;
-            exit(1);
-        }
-        dup2(fd, STDIN_FILENO);	// Redirect stdin
-        close(fd);
+int spawnCommand(const std::string& execPath, char** argv, const ParsedCommand& cmd,
+                 const std::vector<int>* preopened, pid_t& pid) {
+    // A foreground job in an interactive shell needs the terminal handed over in the child
+    if (!cmd.isBackground && shell_is_interactive) {
+        return ENOTSUP;
     }
     
-    // Handle output redirection
-    if (!cmd.outputFile.empty()) {	// If ">" or ">>"
-        // Append or Truncate based on append flag of current command
-        int flags = O_WRONLY | O_CREAT | (cmd.appendMode ? O_APPEND : O_TRUNC);
-        int fd = open(cmd.outputFile.c_str(), flags, 0644);
-        if (fd < 0) {
-            std::cerr << COLOR_ERROR << "tinyshell: cannot open output file\n" 
-                        << COLOR_RESET;
-            exit(1);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (!cmd.redirections.empty()) {
+        RedirPlan plan = planRedirections(cmd.redirections, preopened);
+        int err = redirPlanToSpawnActions(plan, &actions);
+        if (err) {
+            posix_spawn_file_actions_destroy(&actions);
+            // Let the fork path report bad fds with the usual message
+            return err == EBADF ? ENOTSUP : err;
         }
-        dup2(fd, STDOUT_FILENO);	// Redirect stdout
-        close(fd);
     }
     
-    // Handle error redirection
-    if (!cmd.errorFile.empty()) {
-        int flags = O_WRONLY | O_CREAT | (cmd.appendErrorMode ? O_APPEND : O_TRUNC);
-        int fd = open(cmd.errorFile.c_str(), flags, 0644);
-        if (fd < 0) {
-            std::cerr << COLOR_ERROR << "tinyshell: cannot open error file\n" 
-                        << COLOR_RESET;
-            exit(1);
-        }
-        dup2(fd, STDERR_FILENO);	// Redirect stderr
-        close(fd);
-    }
+    // Same setup as the fork path: own process group, default signal handlers
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults, empty;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigemptyset(&empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                    POSIX_SPAWN_SETSIGMASK);
+    
+    int err = posix_spawn(&pid, execPath.c_str(), &actions, &attr, argv, environ);
+    
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+// $? of a process that ended: its exit code, or 128 + the signal that killed it
+static int exitStatus(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
 }
 
 // Signal handler for SIGCHLD - handles child process state changes
@@ -149,6 +202,40 @@ void sigchld_handler(int sig) {
     }
 }
 
+// Close the shell's ends of the coprocess pipes
+static void closeCoprocess() {
+    if (coprocess.writeFd >= 0) close(coprocess.writeFd);
+    if (coprocess.readFd >= 0) close(coprocess.readFd);
+    coprocess = Coprocess();
+}
+
+// Print the checksums of finished relays
+static void printRelayChecksums(const std::vector<int>& relayIds) {
+    for (int id : relayIds) {
+        RelayStats stats;
+        if (!getRelayStats(id, stats) || !stats.checksum) continue;
+        std::cout << COLOR_INFO << "[" << stats.path << ": "
+                  << (stats.finished ? stats.digest : "crc32c pending") << ", "
+                  << stats.bytes << " bytes]" << COLOR_RESET << "\n";
+    }
+}
+
+// Print the checksums of finished relays and drop their statistics
+void reportRelayChecksums(const std::vector<int>& relayIds) {
+    printRelayChecksums(relayIds);
+    forgetRelays(relayIds);
+}
+
+// Keep a finished job's relay statistics for the next jobs --stats
+static void keepFinishedJob(const Job& job) {
+    if (job.relayIds.empty()) return;
+    if (finishedJobs.size() >= FINISHED_JOBS_MAX) {
+        forgetRelays(finishedJobs.front().relayIds);
+        finishedJobs.erase(finishedJobs.begin());
+    }
+    finishedJobs.push_back(job);
+}
+
 // Check and print job status changes (called from main loop)
 void check_job_status_changes() {
     if (!job_status_changed) {
@@ -168,6 +255,11 @@ void check_job_status_changes() {
                 std::cout << " ";
             }
             std::cout << " Done        " << it->command << std::endl;
+            printRelayChecksums(it->relayIds);
+            keepFinishedJob(*it);
+            if (it->pgid == coprocess.pid) {
+                closeCoprocess();
+            }
             it->notified = true;
             it = jobTable.erase(it);
         } else {
@@ -347,53 +439,73 @@ int builtin_bg(const std::vector<std::string>& args) {
     return 0;
 }
 
-// Built-in: jobs command
-int builtin_jobs() {
+// Print the relays of a job for jobs --stats
+static void printJobRelays(const Job& job) {
+    for (int id : job.relayIds) {
+        RelayStats stats;
+        if (!getRelayStats(id, stats)) continue;
+        std::cout << "[" << job.jobId << "]  " << stats.path << ": " << stats.bytes << " bytes";
+        if (stats.finished) {
+            std::cout << ", " << (stats.digest.empty() ? "done" : stats.digest);
+        } else if (stats.checksum) {
+            std::cout << ", crc32c pending";
+        }
+        std::cout << "\n";
+    }
+}
+
+// Built-in: jobs command (--stats adds the output relays of every job)
+int builtin_jobs(const std::vector<std::string>& args) {
     printJobs();
+    if (args.size() < 2 || args[1] != "--stats") {
+        return 0;
+    }
+    
+    // Finished jobs once, with their final digests, then the running ones
+    for (const auto& job : finishedJobs) {
+        printJobRelays(job);
+        forgetRelays(job.relayIds);
+    }
+    finishedJobs.clear();
+    for (const auto& job : jobTable) {
+        if (job.state == DONE) continue;    // Listed once reported as Done
+        printJobRelays(job);
+    }
     return 0;
 }
 
-int executeCommand(const ParsedCommand& cmd) {
-    if (cmd.args.empty()) return 0;
-    
-    // Check for built-in commands
-    if (cmd.args[0] == "jobs") {
-        return builtin_jobs();
-    } else if (cmd.args[0] == "fg") {   
-        return builtin_fg(cmd.args);
-    } else if (cmd.args[0] == "bg") {
-        return builtin_bg(cmd.args);
+// Built-in: coproc command
+int builtin_coproc(const ParsedCommand& cmd) {
+    if (cmd.args.size() < 2) {
+        std::cerr << COLOR_ERROR << "tinyshell: coproc: usage: coproc command [args...]"
+                  << COLOR_RESET << "\n";
+        return 2;
     }
-    
-    std::string execPath = findInPath(cmd.args[0]);
-    if (execPath.empty()) {
-        std::cerr << COLOR_ERROR << "tinyshell: command not found: " 
-                  << cmd.args[0] << COLOR_RESET << "\n";
+    ParsedCommand sub = cmd;
+    sub.args.erase(sub.args.begin());
+    CommandLocation location;
+    if (!locateCommand(sub.args[0], location)) {
+        reportCommandNotFound(sub.args[0]);
         return 127;
     }
     
-    char** argv = vectorToArgv(cmd.args);
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        std::cerr << COLOR_ERROR << "tinyshell: fork failed" 
-                  << COLOR_RESET << "\n";
-        freeArgv(argv, cmd.args.size());
-        return -1;
+    // toCo: shell -> coprocess stdin, fromCo: coprocess stdout -> shell
+    int toCo[2], fromCo[2];
+    if (pipe2(toCo, O_CLOEXEC) < 0) {
+        std::cerr << COLOR_ERROR << "tinyshell: pipe failed" << COLOR_RESET << "\n";
+        return 1;
     }
-    else if (pid == 0) {
-        // Child Process
-        
-        // Put child in its own process group
-        pid_t child_pgid = getpid();
-        setpgid(0, child_pgid);
-        
-        // If foreground, give terminal control to child
-        if (!cmd.isBackground) {
-            tcsetpgrp(shell_terminal, child_pgid);
-        }
-        
-        // Set default signal handlers for child
+    if (pipe2(fromCo, O_CLOEXEC) < 0) {
+        close(toCo[0]);
+        close(toCo[1]);
+        std::cerr << COLOR_ERROR << "tinyshell: pipe failed" << COLOR_RESET << "\n";
+        return 1;
+    }
+    
+    char** argv = vectorToArgv(sub.args);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
         signal(SIGINT, SIG_DFL);
         signal(SIGQUIT, SIG_DFL);
         signal(SIGTSTP, SIG_DFL);
@@ -401,241 +513,1402 @@ int executeCommand(const ParsedCommand& cmd) {
         signal(SIGTTOU, SIG_DFL);
         signal(SIGCHLD, SIG_DFL);
         
-        // Handle redirections
-        setupRedirections(cmd);
-        
-        execve(execPath.c_str(), argv, environ);
-        std::cerr << COLOR_ERROR << "tinyshell: execve failed" 
-                  << COLOR_RESET << "\n";
+        dup2(toCo[0], STDIN_FILENO);
+        dup2(fromCo[1], STDOUT_FILENO);
+        setupRedirections(sub);
+        execLocated(location, argv, environ);
+        std::cerr << COLOR_ERROR << "tinyshell: execve failed" << COLOR_RESET << "\n";
         exit(1);
     }
-    else {
-        // Parent Process
-        
-        // Put child in its own process group
-        setpgid(pid, pid);
-        
-        if (cmd.isBackground) {
-            // Background execution
-            std::vector<pid_t> pids;
-            pids.push_back(pid);
-            
-            // Build full command string with arguments
-            std::string fullCommand;
-            for (size_t i = 0; i < cmd.args.size(); i++) {
-                if (i > 0) fullCommand += " ";
-                fullCommand += cmd.args[i];
-            }
-            
-            addJob(pid, fullCommand, RUNNING, pids);
-            freeArgv(argv, cmd.args.size());
-        } else {
-            // Foreground execution
-            // Give terminal to child
-            tcsetpgrp(shell_terminal, pid);
-            
-            int status;
-            pid_t wait_result;
-            
-            // Wait for child
-            while ((wait_result = waitpid(pid, &status, WUNTRACED)) > 0) {
-                if (WIFEXITED(status)) {
-                    int exitCode = WEXITSTATUS(status);
-                    if (exitCode != 0) {
-                        std::cout << COLOR_INFO << "[Process exited with code: " 
-                                << exitCode << "]" << COLOR_RESET << "\n";
-                    }
-                    break;
-                } else if (WIFSIGNALED(status)) {
-                    int signal = WTERMSIG(status);
-                    std::cout << COLOR_ERROR << "[Process terminated by signal: " 
-                            << signal << "]" << COLOR_RESET << "\n";
-                    break;
-                } else if (WIFSTOPPED(status)) {
-                    // Process was stopped (CTRL+Z)
-                    std::vector<pid_t> pids;
-                    pids.push_back(pid);
-                    
-                    // Build full command string with arguments
-                    std::string fullCommand;
-                    for (size_t i = 0; i < cmd.args.size(); i++) {
-                        if (i > 0) fullCommand += " ";
-                        fullCommand += cmd.args[i];
-                    }
-                    
-                    addJob(pid, fullCommand, STOPPED, pids);
-                    
-                    // Get the job we just added to print status
-                    Job* job = getJobByPgid(pid);
-                    if (job) {
-                        std::cout << "\n[" << job->jobId << "]";
-                        if (job->is_current) {
-                            std::cout << "+";
-                        } else {
-                            std::cout << " ";
-                        }
-                        std::cout << " Stopped         " << job->command << std::endl;
-                    }
-                    break;
-                }
-            }
-            
-            // Restore terminal control to shell
-            tcsetpgrp(shell_terminal, shell_pgid);
-            freeArgv(argv, cmd.args.size());
-        }
+    freeArgv(argv);
+    close(toCo[0]);
+    close(fromCo[1]);
+    if (pid < 0) {
+        close(toCo[1]);
+        close(fromCo[0]);
+        std::cerr << COLOR_ERROR << "tinyshell: fork failed" << COLOR_RESET << "\n";
+        return 1;
     }
+    setpgid(pid, pid);
     
+    // A new coprocess replaces the old one, which then sees end of file
+    closeCoprocess();
+    coprocess.pid = pid;
+    coprocess.writeFd = toCo[1];
+    coprocess.readFd = fromCo[0];
+    
+    std::string fullCommand;
+    for (size_t i = 0; i < cmd.args.size(); i++) {
+        if (i > 0) fullCommand += " ";
+        fullCommand += cmd.args[i];
+    }
+    addJob(pid, fullCommand, RUNNING, std::vector<pid_t>(1, pid));
     return 0;
 }
 
-int executePipeline(const std::vector<ParsedCommand>& pipeline) {
-    int numCmds = pipeline.size();
-    std::vector<std::array<int, 2>> pipefds(numCmds - 1);
-    std::vector<pid_t> pids;
-    bool isBackground = pipeline[0].isBackground;
-    
-    // Create all pipes
-    for (int i = 0; i < numCmds - 1; i++) {
-        if (pipe(pipefds[i].data()) == -1) {
-            std::cerr << COLOR_ERROR << "tinyshell: pipe failed" << COLOR_RESET << "\n";
-            return -1;
+// Read one line from fd, a byte at a time so nothing after it is consumed
+static bool readLineFrom(int fd, bool raw, std::string& line) {
+    line.clear();
+    bool any = false;
+    char c;
+    while (true) {
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return any;
+        any = true;
+        if (c == '\n') return true;
+        if (c == '\\' && !raw) {
+            // Backslash escapes the next character, backslash-newline continues
+            do {
+                n = read(fd, &c, 1);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) return true;
+            if (c == '\n') continue;
+        }
+        line += c;
+    }
+}
+
+// Built-in: read command
+int builtin_read(const ParsedCommand& cmd) {
+    bool raw = false;
+    int fd = STDIN_FILENO;
+    int openedFd = -1;
+    size_t i = 1;
+    for (; i < cmd.args.size() && cmd.args[i].size() > 1 && cmd.args[i][0] == '-'; i++) {
+        if (cmd.args[i] == "-r") {
+            raw = true;
+        } else if (cmd.args[i] == "-p") {
+            fd = coprocess.readFd;
+            if (fd < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: read: no coprocess" << COLOR_RESET << "\n";
+                return 1;
+            }
+        } else if (cmd.args[i] == "-u" && i + 1 < cmd.args.size()) {
+            fd = atoi(cmd.args[++i].c_str());
+        } else {
+            std::cerr << COLOR_ERROR << "tinyshell: read: usage: read [-r] [-p] [-u fd] [name...]"
+                      << COLOR_RESET << "\n";
+            return 2;
         }
     }
     
-    pid_t pgid = 0;
+    // The builtin runs in the shell: only its stdin redirections apply
+    for (const auto& r : cmd.redirections) {
+        if (r.fd != STDIN_FILENO) continue;
+        if (openedFd >= 0) close(openedFd);
+        openedFd = -1;
+        if (r.type == REDIR_DUP) {
+            fd = r.srcFd;
+        } else if (r.type == REDIR_OPEN) {
+            openedFd = fd = open(r.path.c_str(), r.flags | O_CLOEXEC);
+            if (fd < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: " << r.path << ": " << strerror(errno)
+                          << COLOR_RESET << "\n";
+                return 1;
+            }
+        }
+    }
     
-    // Fork and execute each command
-    for (int i = 0; i < numCmds; i++) {
-        pid_t pid = fork();
-        
-        if (pid < 0) {
-            std::cerr << COLOR_ERROR << "tinyshell: fork failed" << COLOR_RESET << "\n";
-            return -1;
+    std::vector<std::string> names(cmd.args.begin() + i, cmd.args.end());
+    if (names.empty()) {
+        names.push_back("REPLY");
+    }
+    for (const auto& name : names) {
+        if (!isVariableName(name)) {
+            std::cerr << COLOR_ERROR << "tinyshell: read: " << name << ": not a valid identifier"
+                      << COLOR_RESET << "\n";
+            if (openedFd >= 0) close(openedFd);
+            return 2;
         }
-        else if (pid == 0) {
-            // Child Process
-            
-            // Set process group
-            if (i == 0) {
-                // First process becomes group leader
-                setpgid(0, 0);
-                if (!isBackground) {
-                    tcsetpgrp(shell_terminal, getpid());
-                }
+    }
+    
+    std::string line;
+    bool got = readLineFrom(fd, raw, line);
+    if (openedFd >= 0) close(openedFd);
+    
+    // Split on whitespace, the last name takes the rest of the line
+    const char* spaces = " \t\n";
+    size_t pos = line.find_first_not_of(spaces);
+    for (size_t n = 0; n < names.size(); n++) {
+        std::string value;
+        if (pos != std::string::npos) {
+            if (n + 1 == names.size()) {
+                size_t end = line.find_last_not_of(spaces);
+                value = line.substr(pos, end + 1 - pos);
+                pos = std::string::npos;
             } else {
-                // Join the group
-                setpgid(0, pgid);
-            }
-            
-            // Set default signal handlers
-            signal(SIGINT, SIG_DFL);
-            signal(SIGQUIT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGTTIN, SIG_DFL);
-            signal(SIGTTOU, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
-            
-            // Setup pipes
-            if (i > 0) {
-                dup2(pipefds[i-1][0], STDIN_FILENO);
-            }
-            
-            if (i < numCmds - 1) {
-                dup2(pipefds[i][1], STDOUT_FILENO);
-            }
-            
-            // Close all pipe fds
-            for (int j = 0; j < numCmds - 1; j++) {
-                close(pipefds[j][0]);
-                close(pipefds[j][1]);
-            }
-            
-            // Handle redirections
-            setupRedirections(pipeline[i]);
-            
-            // Find and execute
-            std::string execPath = findInPath(pipeline[i].args[0]);
-            if (execPath.empty()) {
-                std::cerr << COLOR_ERROR << "tinyshell: command not found: " 
-                          << pipeline[i].args[0] << COLOR_RESET << "\n";
-                exit(127);
+                size_t end = line.find_first_of(spaces, pos);
+                value = line.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+                pos = end == std::string::npos ? end : line.find_first_not_of(spaces, end);
             }
-            
-            char** argv = vectorToArgv(pipeline[i].args);
-            execve(execPath.c_str(), argv, environ);
-            
-            std::cerr << COLOR_ERROR << "tinyshell: execve failed" << COLOR_RESET << "\n";
-            exit(1);
         }
-        else {
-            // Parent process
-            if (i == 0) {
-                pgid = pid;
+        setVariable(names[n], value);
+    }
+    return got ? 0 : 1;
+}
+
+/**
+ * Resolve where a writing builtin (echo, printf) sends its output
+ * It runs in the shell, so its redirections are applied by hand in
+ * source order on a table of fds; files for other fds are only created.
+ *
+ * @param opened Output: fds opened here, for the caller to close
+ * @return fd standing for the command's stdout, -2 if a file could not be opened
+ */
+static int builtinOutput(const ParsedCommand& cmd, std::vector<int>& opened) {
+    std::map<int, int> fds;     // Redirected fd -> fd of the shell that stands for it
+    for (const auto& r : cmd.redirections) {
+        if (r.type == REDIR_OPEN) {
+            int fd = open(r.path.c_str(), r.flags | O_CLOEXEC, REDIR_CREATE_MODE);
+            if (fd < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: " << r.path << ": " << strerror(errno)
+                          << COLOR_RESET << "\n";
+                return -2;
             }
-            setpgid(pid, pgid);
-            pids.push_back(pid);
+            opened.push_back(fd);
+            fds[r.fd] = fd;
+        } else if (r.type == REDIR_DUP) {
+            auto it = fds.find(r.srcFd);
+            fds[r.fd] = it != fds.end() ? it->second : r.srcFd;
+        } else {
+            fds[r.fd] = -1;
         }
     }
-    
-    // Parent: close all pipes
-    for (int i = 0; i < numCmds - 1; i++) {
-        close(pipefds[i][0]);
-        close(pipefds[i][1]);
+    auto it = fds.find(STDOUT_FILENO);
+    return it != fds.end() ? it->second : STDOUT_FILENO;
+}
+
+// Built-in: echo command (echo [-neE] args)
+int builtin_echo(const ParsedCommand& cmd) {
+    bool newline = true;
+    bool escapes = false;
+    size_t i = 1;
+    // Only words made of n, e and E are options, echo -x prints -x
+    for (; i < cmd.args.size(); i++) {
+        const std::string& arg = cmd.args[i];
+        if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != std::string::npos) break;
+        for (size_t j = 1; j < arg.size(); j++) {
+            if (arg[j] == 'n') newline = false;
+            else escapes = arg[j] == 'e';
+        }
     }
     
-    // Build command string for job
-    std::string cmdString;
-    for (size_t i = 0; i < pipeline.size(); i++) {
-        if (i > 0) cmdString += " | ";
-        cmdString += pipeline[i].args[0];
+    std::vector<int> opened;
+    int fd = builtinOutput(cmd, opened);
+    int status = 1;
+    if (fd != -2) {
+        std::cout.flush();
+        OutputBuffer out(fd);
+        bool more = true;
+        for (size_t j = i; j < cmd.args.size() && more; j++) {
+            if (j > i) out.append(' ');
+            if (escapes) more = decodeEscapes(cmd.args[j], out);
+            else out.append(cmd.args[j]);
+        }
+        if (newline && more) out.append('\n');
+        status = out.flush() ? 0 : 1;
     }
-    
+    for (int f : opened) close(f);
+    return status;
+}
+
+// Built-in: printf command (printf format [args])
+int builtin_printf(const ParsedCommand& cmd) {
+    if (cmd.args.size() < 2) {
+        std::cerr << COLOR_ERROR << "tinyshell: printf: usage: printf format [arguments]"
+                  << COLOR_RESET << "\n";
+        return 2;
+    }
+    const CompiledFormat& format = compileFormat(cmd.args[1]);
+    if (!format.error.empty()) {
+        std::cerr << COLOR_ERROR << "tinyshell: printf: " << format.error << COLOR_RESET << "\n";
+        return 1;
+    }
+    
+    std::vector<int> opened;
+    int fd = builtinOutput(cmd, opened);
+    int status = 1;
+    if (fd != -2) {
+        std::cout.flush();
+        OutputBuffer out(fd);
+        std::vector<std::string> args(cmd.args.begin() + 2, cmd.args.end());
+        bool valid = formatArguments(format, args, out);
+        status = out.flush() && valid ? 0 : 1;
+    }
+    for (int f : opened) close(f);
+    return status;
+}
+
+// Built-in: test and [ command ([ needs a closing ])
+int builtin_test(const std::vector<std::string>& args) {
+    std::vector<std::string> words(args.begin() + 1, args.end());
+    if (args[0] == "[") {
+        if (words.empty() || words.back() != "]") {
+            std::cerr << COLOR_ERROR << "tinyshell: [: missing ]" << COLOR_RESET << "\n";
+            return CONDITION_ERROR;
+        }
+        words.pop_back();
+    }
+    return evaluateCondition(words, false, args[0].c_str());
+}
+
+// Built-in: [[ ... ]] (the parser keeps the words up to ]] together)
+int builtin_conditional(const std::vector<std::string>& args) {
+    if (args.back() != "]]") {
+        std::cerr << COLOR_ERROR << "tinyshell: [[: missing ]]" << COLOR_RESET << "\n";
+        return CONDITION_ERROR;
+    }
+    std::vector<std::string> words(args.begin() + 1, args.end() - 1);
+    return evaluateCondition(words, true, "[[");
+}
+
+// Evaluate the expressions of let or (( )), the status follows the last value
+static int evaluateExpressions(const std::vector<std::string>& expressions, const char* name) {
+    long long value = 0;
+    for (const auto& expression : expressions) {
+        std::string error;
+        if (!evaluateArithmetic(expression, value, error)) {
+            std::cerr << COLOR_ERROR << "tinyshell: " << name << ": " << expression << ": " << error
+                      << COLOR_RESET << "\n";
+            return 1;
+        }
+    }
+    return value != 0 ? 0 : 1;
+}
+
+// Built-in: let command (let expression...)
+int builtin_let(const std::vector<std::string>& args) {
+    if (args.size() < 2) {
+        std::cerr << COLOR_ERROR << "tinyshell: let: expression expected" << COLOR_RESET << "\n";
+        return 1;
+    }
+    std::vector<std::string> expressions(args.begin() + 1, args.end());
+    return evaluateExpressions(expressions, "let");
+}
+
+// Built-in: (( expression )) (the lexer gives "((", the expression and "))")
+int builtin_arithmetic(const std::vector<std::string>& args) {
+    if (args.size() != 3 || args[2] != "))") {
+        std::cerr << COLOR_ERROR << "tinyshell: ((: missing ))" << COLOR_RESET << "\n";
+        return 1;
+    }
+    return evaluateExpressions(std::vector<std::string>(1, args[1]), "((");
+}
+
+bool expandCommand(ParsedCommand& cmd) {
+    // A failed $(( )) does not stop the expansion, but the command is not run
+    bool ok = true;
+    for (auto& arg : cmd.args) {
+        if (needsExpansion(arg)) arg = expandWord(arg, ok);
+    }
+    for (auto& r : cmd.redirections) {
+        if (needsExpansion(r.path)) r.path = expandWord(r.path, ok);
+        if (r.type == REDIR_DUP && (r.srcFd == REDIR_COPROC_WRITE || r.srcFd == REDIR_COPROC_READ)) {
+            r.srcFd = r.srcFd == REDIR_COPROC_WRITE ? coprocess.writeFd : coprocess.readFd;
+            if (r.srcFd < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: no coprocess" << COLOR_RESET << "\n";
+                return false;
+            }
+        }
+    }
+    for (auto& member : cmd.group) {
+        if (!expandCommand(*member)) return false;
+    }
+    return ok;
+}
+
+bool setShellOption(const std::string& name, bool on) {
+    for (const auto& entry : shellOptionTable) {
+        if (name == entry.name) {
+            shellOptions.*(entry.flag) = on;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Built-in: set command (only -o/+o options)
+int builtin_set(const std::vector<std::string>& args) {
+    size_t count = sizeof(shellOptionTable) / sizeof(shellOptionTable[0]);
+    
+    // set, set -o, set +o: list the options
+    if (args.size() < 3) {
+        for (size_t i = 0; i < count; i++) {
+            bool on = shellOptions.*(shellOptionTable[i].flag);
+            std::cout << shellOptionTable[i].name << "\t" << (on ? "on" : "off") << "\n";
+        }
+        return 0;
+    }
+    
+    if (args[1] != "-o" && args[1] != "+o") {
+        std::cerr << COLOR_ERROR << "tinyshell: set: usage: set [-o|+o] [option]"
+                  << COLOR_RESET << "\n";
+        return 2;
+    }
+    if (setShellOption(args[2], args[1] == "-o")) {
+        return 0;
+    }
+    std::cerr << COLOR_ERROR << "tinyshell: set: " << args[2] << ": invalid option name"
+              << COLOR_RESET << "\n";
+    return 2;
+}
+
+// Built-in: export command (export NAME[=value]..., no arguments: list the environment)
+int builtin_export(const std::vector<std::string>& args) {
+    if (args.size() == 1) {
+        for (char** env = environ; *env; env++) {
+            std::cout << "export " << *env << "\n";
+        }
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        size_t eq = args[i].find('=');
+        std::string name = args[i].substr(0, eq);
+        if (!isVariableName(name)) {
+            std::cerr << COLOR_ERROR << "tinyshell: export: " << args[i] << ": not a valid identifier"
+                      << COLOR_RESET << "\n";
+            status = 1;
+            continue;
+        }
+        // export NAME keeps the current value
+        exportVariable(name, eq == std::string::npos ? getVariable(name) : args[i].substr(eq + 1));
+    }
+    return status;
+}
+
+// Alias names: anything that cannot be mistaken for a path, a variable or quoting
+static bool isAliasName(const std::string& name) {
+    return !name.empty() && name.find_first_of("/$'\"\\=`") == std::string::npos;
+}
+
+// alias name='value', with quotes that read back as the same value
+static std::string aliasDefinition(const std::string& name, const AliasDef& alias) {
+    std::string quoted;
+    for (char c : alias.text) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    return "alias " + name + "='" + quoted + "'\n";
+}
+
+// Built-in: alias command (alias name=value..., alias [name...] lists)
+int builtin_alias(const std::vector<std::string>& args) {
+    if (args.size() == 1) {
+        for (const auto& name : definedNames(false)) {
+            std::cout << aliasDefinition(name, *lookupAlias(name));
+        }
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        size_t eq = args[i].find('=');
+        std::string name = args[i].substr(0, eq);
+        if (eq == std::string::npos) {
+            const AliasDef* alias = lookupAlias(name);
+            if (alias) {
+                std::cout << aliasDefinition(name, *alias);
+            } else {
+                std::cerr << COLOR_ERROR << "tinyshell: alias: " << name << ": not found" << COLOR_RESET << "\n";
+                status = 1;
+            }
+            continue;
+        }
+        if (!isAliasName(name)) {
+            std::cerr << COLOR_ERROR << "tinyshell: alias: " << name << ": invalid alias name"
+                      << COLOR_RESET << "\n";
+            status = 1;
+        } else if (!defineAlias(name, args[i].substr(eq + 1))) {
+            std::cerr << COLOR_ERROR << "tinyshell: alias: " << name << ": unterminated quote or escape"
+                      << COLOR_RESET << "\n";
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Built-in: unalias command (unalias name..., unalias -a removes all)
+int builtin_unalias(const std::vector<std::string>& args) {
+    if (args.size() == 2 && args[1] == "-a") {
+        for (const auto& name : definedNames(false)) {
+            removeAlias(name);
+        }
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (!removeAlias(args[i])) {
+            std::cerr << COLOR_ERROR << "tinyshell: unalias: " << args[i] << ": not found" << COLOR_RESET << "\n";
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Call a function in the shell itself
+ * The body runs with $1, $2, ... set to the arguments; exit inside it
+ * ends the function.
+ */
+static int callFunction(const FunctionBody& body, const std::vector<std::string>& args) {
+    static int depth = 0;
+    if (depth >= FUNCTION_DEPTH_MAX) {
+        std::cerr << COLOR_ERROR << "tinyshell: " << args[0] << ": maximum function nesting reached"
+                  << COLOR_RESET << "\n";
+        return 1;
+    }
+    std::vector<std::string> saved(args.begin() + 1, args.end());
+    saved.swap(positionalParameters);
+    depth++;
+    ParsedList list = body.list;    // executeList() expands in place
+    executeList(list);
+    depth--;
+    positionalParameters.swap(saved);
+    return lastStatus;
+}
+
+/**
+ * Entry of the builtin table used by executeCommand() and type
+ */
+struct BuiltinEntry {
+    const char* name;
+    int (*run)(const ParsedCommand& cmd);
+    bool plainOnly;     // Only without redirections, else the command from PATH runs
+    bool noRelays;      // Only without relays (the shell would have to run them)
+};
+
+static const BuiltinEntry builtinTable[] = {
+    { "jobs", [](const ParsedCommand& cmd) { return builtin_jobs(cmd.args); }, false, false },
+    { "fg", [](const ParsedCommand& cmd) { return builtin_fg(cmd.args); }, false, false },
+    { "bg", [](const ParsedCommand& cmd) { return builtin_bg(cmd.args); }, false, false },
+    { "set", [](const ParsedCommand& cmd) { return builtin_set(cmd.args); }, false, false },
+    { "export", [](const ParsedCommand& cmd) { return builtin_export(cmd.args); }, false, false },
+    { "alias", [](const ParsedCommand& cmd) { return builtin_alias(cmd.args); }, false, false },
+    { "unalias", [](const ParsedCommand& cmd) { return builtin_unalias(cmd.args); }, false, false },
+    { "coproc", builtin_coproc, false, false },
+    { "read", builtin_read, false, false },
+    { "echo", builtin_echo, false, true },
+    { "printf", builtin_printf, false, true },
+    { "dag", builtin_dag, false, false },
+    { "[[", [](const ParsedCommand& cmd) { return builtin_conditional(cmd.args); }, false, false },
+    { "((", [](const ParsedCommand& cmd) { return builtin_arithmetic(cmd.args); }, false, false },
+    { "let", [](const ParsedCommand& cmd) { return builtin_let(cmd.args); }, false, false },
+    { "type", [](const ParsedCommand& cmd) { return builtin_type(cmd.args); }, false, false },
+    { "which", [](const ParsedCommand& cmd) { return builtin_which(cmd.args); }, false, false },
+    { "command", builtin_command, false, false },
+    // Common in scripts, not worth a process (with redirections the file is still created)
+    { "true", [](const ParsedCommand&) { return 0; }, true, false },
+    { "false", [](const ParsedCommand&) { return 1; }, true, false },
+    { "test", [](const ParsedCommand& cmd) { return builtin_test(cmd.args); }, true, false },
+    { "[", [](const ParsedCommand& cmd) { return builtin_test(cmd.args); }, true, false },
+    // Ends the shell in executeList(), listed for type
+    { "exit", [](const ParsedCommand&) { return 0; }, false, false },
+};
+
+static const BuiltinEntry* findBuiltin(const std::string& name) {
+    for (const auto& entry : builtinTable) {
+        if (name == entry.name) return &entry;
+    }
+    return nullptr;
+}
+
+// Set by command: the next lookup skips functions
+static bool skipFunctions = false;
+
+/**
+ * What a command name resolves to, in the order executeCommand() tries
+ */
+enum ResolvedKind { RESOLVED_NONE, RESOLVED_ALIAS, RESOLVED_FUNCTION, RESOLVED_BUILTIN, RESOLVED_FILE };
+
+/**
+ * Resolve many names in one pass (type, which, command -v/-V)
+ * Aliases, functions and builtins come from their tables; the remaining
+ * names go to locateCommands() together.
+ */
+static void resolveNames(const std::vector<std::string>& names, bool withFunctions,
+                         std::vector<ResolvedKind>& kinds, std::vector<CommandLocation>& locations) {
+    kinds.assign(names.size(), RESOLVED_NONE);
+    locations.assign(names.size(), CommandLocation());
+    std::vector<std::string> lookups;
+    std::vector<size_t> lookupIndex;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (withFunctions && lookupAlias(names[i])) {
+            kinds[i] = RESOLVED_ALIAS;
+        } else if (withFunctions && lookupFunction(names[i])) {
+            kinds[i] = RESOLVED_FUNCTION;
+        } else if (findBuiltin(names[i])) {
+            kinds[i] = RESOLVED_BUILTIN;
+        } else {
+            lookups.push_back(names[i]);
+            lookupIndex.push_back(i);
+        }
+    }
+    std::vector<CommandLocation> found;
+    std::vector<bool> ok;
+    locateCommands(lookups, found, ok);
+    for (size_t j = 0; j < lookups.size(); j++) {
+        if (!ok[j]) continue;
+        kinds[lookupIndex[j]] = RESOLVED_FILE;
+        locations[lookupIndex[j]] = found[j];
+    }
+}
+
+/**
+ * Describe how names resolve, with all output in a single write
+ * Styles: 'V' (type, command -V), 't' (type -t), 'v' (command -v),
+ * 'w' (which)
+ */
+static int describeNames(const std::vector<std::string>& names, char style, const char* builtin,
+                         bool withFunctions) {
+    std::vector<ResolvedKind> kinds;
+    std::vector<CommandLocation> locations;
+    resolveNames(names, withFunctions, kinds, locations);
+    
+    std::string out;
+    int status = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string& name = names[i];
+        switch (kinds[i]) {
+        case RESOLVED_ALIAS:
+            if (style == 'v') out += aliasDefinition(name, *lookupAlias(name));
+            else if (style == 't') out += "alias\n";
+            else if (style == 'w') out += name + ": aliased to " + lookupAlias(name)->text + "\n";
+            else out += name + " is aliased to `" + lookupAlias(name)->text + "'\n";
+            break;
+        case RESOLVED_FUNCTION:
+            if (style == 'v') out += name + "\n";
+            else if (style == 't') out += "function\n";
+            else if (style == 'w') out += name + ": shell function\n";
+            else out += name + " is a function\n";
+            break;
+        case RESOLVED_BUILTIN:
+            if (style == 'v') out += name + "\n";
+            else if (style == 't') out += "builtin\n";
+            else if (style == 'w') out += name + ": shell builtin\n";
+            else out += name + " is a shell builtin\n";
+            break;
+        case RESOLVED_FILE:
+            if (style == 't') out += "file\n";
+            else if (style == 'V') out += name + " is " + locations[i].path + "\n";
+            else out += locations[i].path + "\n";
+            break;
+        case RESOLVED_NONE:
+            // command -v fails silently
+            if (style != 'v' && style != 't') {
+                std::cout << out;
+                out.clear();
+                std::cerr << COLOR_ERROR << "tinyshell: " << builtin << ": " << name << ": not found"
+                          << COLOR_RESET << "\n";
+            }
+            status = 1;
+            break;
+        }
+    }
+    std::cout << out;
+    std::cout.flush();
+    return status;
+}
+
+// Built-in: type command (type [-t] name...)
+int builtin_type(const std::vector<std::string>& args) {
+    bool terse = args.size() > 1 && args[1] == "-t";
+    std::vector<std::string> names(args.begin() + (terse ? 2 : 1), args.end());
+    return describeNames(names, terse ? 't' : 'V', "type", true);
+}
+
+// Built-in: which command (which name...)
+int builtin_which(const std::vector<std::string>& args) {
+    std::vector<std::string> names(args.begin() + 1, args.end());
+    return describeNames(names, 'w', "which", true);
+}
+
+// Built-in: command (command -v/-V name..., command name args: skip functions)
+int builtin_command(const ParsedCommand& cmd) {
+    const std::vector<std::string>& args = cmd.args;
+    if (args.size() > 1 && (args[1] == "-v" || args[1] == "-V")) {
+        std::vector<std::string> names(args.begin() + 2, args.end());
+        return describeNames(names, args[1][1], "command", true);
+    }
+    if (args.size() == 1) return 0;
+    ParsedCommand inner = cmd;
+    inner.args.erase(inner.args.begin());
+    skipFunctions = true;
+    int status = executeCommand(inner);
+    skipFunctions = false;
+    return status;
+}
+
+// NAME=value ...: every word is an assignment
+static bool isAssignmentCommand(const ParsedCommand& cmd) {
+    if (!cmd.redirections.empty() || cmd.isGroup()) return false;
+    for (const auto& arg : cmd.args) {
+        if (!isAssignment(arg)) return false;
+    }
+    return true;
+}
+
+int executeCommand(const ParsedCommand& cmd) {
+    if (cmd.args.empty()) return 0;
+    
+    if (cmd.definition) {
+        defineFunction(cmd.args[0], cmd.definition);
+        return 0;
+    }
+    if (isAssignmentCommand(cmd)) {
+        for (const auto& arg : cmd.args) {
+            size_t eq = arg.find('=');
+            assignVariable(arg.substr(0, eq), arg.substr(eq + 1));
+        }
+        return 0;
+    }
+    
+    // Functions come first (command skips them), then builtins, then PATH
+    std::shared_ptr<const FunctionBody> function;
+    if (!skipFunctions) function = lookupFunction(cmd.args[0]);
+    skipFunctions = false;
+    
+    const BuiltinEntry* builtin = function ? nullptr : findBuiltin(cmd.args[0]);
+    if (builtin && (!builtin->plainOnly || cmd.redirections.empty()) &&
+        (!builtin->noRelays || !hasRelays(cmd.redirections))) {
+        return builtin->run(cmd);
+    }
+    
+    // With redirections or & a function runs in a forked copy
+    if (function && cmd.redirections.empty() && !cmd.isBackground) {
+        return callFunction(*function, cmd.args);
+    }
+    
+    CommandLocation location;
+    if (!function && !locateCommand(cmd.args[0], location)) {
+        reportCommandNotFound(cmd.args[0]);
+        return 127;
+    }
+    
+    // Preflight: open the redirection targets here, a bad path costs no fork.
+    // Relays always need it: the shell writes their files.
+    std::vector<int> preopened;
+    std::vector<int> relayIds;
+    const std::vector<int>* opened = nullptr;
+    if ((shellOptions.preflight || hasRelays(cmd.redirections)) && !cmd.redirections.empty()) {
+        if (!preflightRedirections(cmd.redirections, preopened)) {
+            return 1;
+        }
+        if (!startRelays(cmd.redirections, preopened, relayIds)) {
+            closePreopened(preopened);
+            return 1;
+        }
+        opened = &preopened;
+    }
+    
+    char** argv = vectorToArgv(cmd.args);
+    
+    // Output of earlier builtins goes first, also when stdout is not a terminal
+    std::cout.flush();
+    
+    // Fast path: posix_spawn does not copy the shell's page tables
+    pid_t pid;
+    int result = 0;
+    // A script for this shell or a function runs in a forked copy of it instead
+    int spawnErr = location.selfScript || function ? ENOTSUP : spawnCommand(location.path, argv, cmd, opened, pid);
+    if (spawnErr == ENOTSUP || (spawnErr != 0 && !cmd.redirections.empty())) {
+        // A failed file action does not say which file: redo it in a forked
+        // child, which reports the failing path. A copy of the shell must
+        // not write the output still buffered in the parent again.
+        std::cout.flush();
+        pid = fork();
+    } else if (spawnErr != 0) {
+        std::cerr << COLOR_ERROR << "tinyshell: " << cmd.args[0] << ": "
+                  << strerror(spawnErr) << COLOR_RESET << "\n";
+        closePreopened(preopened);
+        freeArgv(argv);
+        return 1;
+    }
+    
+    if (pid < 0) {
+        std::cerr << COLOR_ERROR << "tinyshell: fork failed" 
+                  << COLOR_RESET << "\n";
+        closePreopened(preopened);
+        freeArgv(argv);
+        return -1;
+    }
+    else if (pid == 0) {
+        // Child Process
+        
+        // Put child in its own process group
+        pid_t child_pgid = getpid();
+        setpgid(0, child_pgid);
+        
+        // If foreground, give terminal control to child
+        if (!cmd.isBackground) {
+            tcsetpgrp(shell_terminal, child_pgid);
+        }
+        
+        // Set default signal handlers for child
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        
+        // Handle redirections
+        setupRedirections(cmd, opened);
+        
+        if (function) {
+            runFunctionInChild(*function, cmd.args);
+        }
+        if (location.selfScript) {
+            runScriptInChild(location, cmd.args);
+        }
+        execLocated(location, argv, environ);
+        std::cerr << COLOR_ERROR << "tinyshell: execve failed" 
+                  << COLOR_RESET << "\n";
+        exit(1);
+    }
+    else {
+        // Parent Process
+        closePreopened(preopened);
+        
+        // Put child in its own process group
+        setpgid(pid, pid);
+        
+        if (cmd.isBackground) {
+            // Background execution
+            std::vector<pid_t> pids;
+            pids.push_back(pid);
+            
+            // Build full command string with arguments
+            std::string fullCommand;
+            for (size_t i = 0; i < cmd.args.size(); i++) {
+                if (i > 0) fullCommand += " ";
+                fullCommand += cmd.args[i];
+            }
+            
+            addJob(pid, fullCommand, RUNNING, pids, relayIds);
+            freeArgv(argv);
+        } else {
+            // Foreground execution
+            // Give terminal to child
+            tcsetpgrp(shell_terminal, pid);
+            
+            int status;
+            pid_t wait_result;
+            bool stopped = false;
+            
+            // Wait for child
+            while ((wait_result = waitpid(pid, &status, WUNTRACED)) > 0) {
+                result = WIFSTOPPED(status) ? 128 + WSTOPSIG(status) : exitStatus(status);
+                // Scripts and -c report through $? only
+                if (WIFEXITED(status)) {
+                    int exitCode = WEXITSTATUS(status);
+                    if (exitCode != 0 && shell_is_interactive) {
+                        std::cerr << COLOR_INFO << "[Process exited with code: " 
+                                << exitCode << "]" << COLOR_RESET << "\n";
+                    }
+                    break;
+                } else if (WIFSIGNALED(status)) {
+                    int signal = WTERMSIG(status);
+                    if (shell_is_interactive) {
+                        std::cerr << COLOR_ERROR << "[Process terminated by signal: " 
+                                << signal << "]" << COLOR_RESET << "\n";
+                    }
+                    break;
+                } else if (WIFSTOPPED(status)) {
+                    // Process was stopped (CTRL+Z)
+                    std::vector<pid_t> pids;
+                    pids.push_back(pid);
+                    
+                    // Build full command string with arguments
+                    std::string fullCommand;
+                    for (size_t i = 0; i < cmd.args.size(); i++) {
+                        if (i > 0) fullCommand += " ";
+                        fullCommand += cmd.args[i];
+                    }
+                    
+                    addJob(pid, fullCommand, STOPPED, pids, relayIds);
+                    
+                    // Get the job we just added to print status
+                    Job* job = getJobByPgid(pid);
+                    if (job) {
+                        std::cout << "\n[" << job->jobId << "]";
+                        if (job->is_current) {
+                            std::cout << "+";
+                        } else {
+                            std::cout << " ";
+                        }
+                        std::cout << " Stopped         " << job->command << std::endl;
+                    }
+                    stopped = true;
+                    break;
+                }
+            }
+            
+            // Restore terminal control to shell
+            tcsetpgrp(shell_terminal, shell_pgid);
+            freeArgv(argv);
+            
+            // The output is complete once the relays have flushed it
+            if (!stopped) {
+                waitRelays(relayIds);
+                reportRelayChecksums(relayIds);
+            }
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * One process of a pipeline: a plain stage or a member of a group stage
+ */
+struct PipelineProcess {
+    int stage;                      // Index of the pipeline stage
+    const ParsedCommand* cmd;       // Command the process runs
+    std::vector<int> preopened;     // Its redirection targets, when preflighted
+    int mergeFd;                    // Write end of its line-merge pipe, or -1
+    CommandLocation location;       // Executable, resolved before anything is forked
+    std::shared_ptr<const FunctionBody> function;   // Function to run instead, if any
+};
+
+// Short description of a pipeline stage for the job table
+static std::string describeStage(const ParsedCommand& cmd) {
+    if (!cmd.isGroup()) {
+        return cmd.args[0];
+    }
+    std::string text = cmd.lineMerge ? "{{ " : "{ ";
+    for (size_t i = 0; i < cmd.group.size(); i++) {
+        if (i > 0) text += " & ";
+        text += cmd.group[i]->args[0];
+    }
+    return text + (cmd.lineMerge ? " }}" : " }");
+}
+
+/**
+ * End the stages still running after a pipeline's last stage exited
+ * (set -o teardown). Each gets the grace period to end by itself, then
+ * the SIGPIPE its next write would have raised, and then SIGTERM.
+ */
+static void teardownPipeline(pid_t pgid) {
+    const int signals[] = { SIGPIPE, SIGTERM };
+    for (int sig : signals) {
+        for (int waited = 0; waited < TEARDOWN_GRACE_MS; ) {
+            int status;
+            pid_t pid = waitpid(-pgid, &status, WNOHANG);
+            if (pid < 0 && errno != EINTR) {
+                return;     // Every stage has ended
+            }
+            if (pid <= 0) {
+                usleep(TEARDOWN_POLL_MS * 1000);
+                waited += TEARDOWN_POLL_MS;
+            }
+        }
+        kill(-pgid, sig);
+    }
+}
+
+/**
+ * Wait for a foreground job; a stopped one goes to the job table
+ * The last lastStagePids entries of pids are the pipeline's last stage,
+ * whose end triggers the teardown of the rest (0: no teardown).
+ *
+ * @return Status of the last process in pids, 128 + the signal if it was stopped
+ */
+static int waitForeground(pid_t pgid, const std::string& cmdString, const std::vector<pid_t>& pids,
+                           const std::vector<int>& relayIds, size_t lastStagePids) {
+    size_t lastStageLeft = lastStagePids;
+    tcsetpgrp(shell_terminal, pgid);
+    
+    int status;
+    pid_t wait_result;
+    bool pipeline_stopped = false;
+    int result = 0;
+    
+    // Wait for all children, group members included
+    for (size_t i = 0; i < pids.size(); i++) {
+        while ((wait_result = waitpid(-pgid, &status, WUNTRACED)) > 0) {
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                if (wait_result == pids.back()) {
+                    result = exitStatus(status);
+                }
+                // The pipeline's result is there, upstream stages may never notice
+                if (shellOptions.teardown && lastStageLeft > 0 &&
+                    std::find(pids.end() - lastStagePids, pids.end(), wait_result) != pids.end() &&
+                    --lastStageLeft == 0) {
+                    teardownPipeline(pgid);
+                }
+                continue;
+            } else if (WIFSTOPPED(status)) {
+                // Pipeline was stopped
+                addJob(pgid, cmdString, STOPPED, pids, relayIds);
+                
+                // Get the job we just added to print status
+                Job* job = getJobByPgid(pgid);
+                if (job) {
+                    std::cout << "\n[" << job->jobId << "]";
+                    if (job->is_current) {
+                        std::cout << "+";
+                    } else {
+                        std::cout << " ";
+                    }
+                    std::cout << " Stopped         " << job->command << std::endl;
+                }
+                pipeline_stopped = true;  // Set flag
+                result = 128 + WSTOPSIG(status);
+                break;
+            }
+        }
+        if (pipeline_stopped) {
+            break;
+        }
+    }
+    
+    // Restore terminal control
+    tcsetpgrp(shell_terminal, shell_pgid);
+    
+    // The output is complete once the relays have flushed it
+    if (!pipeline_stopped) {
+        waitRelays(relayIds);
+        reportRelayChecksums(relayIds);
+    }
+    return result;
+}
+
+int executePipeline(const std::vector<ParsedCommand>& pipeline) {
+    int numCmds = pipeline.size();
+    std::vector<std::array<int, 2>> pipefds(numCmds - 1);
+    std::vector<pid_t> pids;
+    bool isBackground = pipeline[0].isBackground;
+    
+    // Every process to start: one per plain stage, one per group member
+    std::vector<PipelineProcess> procs;
+    auto addProcess = [&procs](int stage, const ParsedCommand& cmd) {
+        PipelineProcess proc;
+        proc.stage = stage;
+        proc.cmd = &cmd;
+        proc.mergeFd = -1;
+        procs.push_back(proc);
+    };
+    for (int i = 0; i < numCmds; i++) {
+        if (!pipeline[i].isGroup()) {
+            addProcess(i, pipeline[i]);
+        }
+        for (const auto& member : pipeline[i].group) {
+            addProcess(i, *member);
+        }
+    }
+    
+    // Resolve every command first: a missing one fails the pipeline before
+    // a pipe is created or a process forked
+    bool found = true;
+    for (auto& proc : procs) {
+        proc.function = lookupFunction(proc.cmd->args[0]);
+        if (!proc.function && !locateCommand(proc.cmd->args[0], proc.location)) {
+            reportCommandNotFound(proc.cmd->args[0]);
+            found = false;
+        }
+    }
+    if (!found) {
+        return 127;
+    }
+    
+    // Preflight: open every redirection target before anything is forked.
+    // Relays always need it, and so do a group's redirections: its members
+    // must share one open file, like the processes of a shell group.
+    std::vector<std::vector<int>> groupPreopened(numCmds);  // Redirections of a whole group
+    std::vector<int> relayIds;
+    bool preflight = shellOptions.preflight;
+    for (int i = 0; i < numCmds; i++) {
+        preflight = preflight || hasRelays(pipeline[i].redirections) ||
+                    (pipeline[i].isGroup() && !pipeline[i].redirections.empty());
+    }
+    for (const auto& proc : procs) {
+        preflight = preflight || hasRelays(proc.cmd->redirections);
+    }
+    
+    auto closeAllPreopened = [&]() {
+        for (auto& fds : groupPreopened) closePreopened(fds);
+        for (auto& proc : procs) closePreopened(proc.preopened);
+    };
+    auto openTargets = [&relayIds](const ParsedCommand& cmd, std::vector<int>& fds) {
+        return preflightRedirections(cmd.redirections, fds) &&
+               startRelays(cmd.redirections, fds, relayIds);
+    };
+    if (preflight) {
+        bool opened = true;
+        for (int i = 0; i < numCmds && opened; i++) {
+            if (pipeline[i].isGroup()) opened = openTargets(pipeline[i], groupPreopened[i]);
+        }
+        for (size_t p = 0; p < procs.size() && opened; p++) {
+            opened = openTargets(*procs[p].cmd, procs[p].preopened);
+        }
+        if (!opened) {
+            // Relays already started end when their write ends are closed
+            closeAllPreopened();
+            return 1;
+        }
+    }
+    
+    // Create all pipes
+    for (int i = 0; i < numCmds - 1; i++) {
+        if (pipe(pipefds[i].data()) == -1) {
+            std::cerr << COLOR_ERROR << "tinyshell: pipe failed" << COLOR_RESET << "\n";
+            for (int j = 0; j < i; j++) {
+                close(pipefds[j][0]);
+                close(pipefds[j][1]);
+            }
+            closeAllPreopened();
+            return 1;
+        }
+    }
+    
+    // What the members of a group apply themselves: in a line-merged group
+    // fd 1 is the merge pipe, and the group's own stdout redirections
+    // decide where the relay sends the merged lines instead
+    std::vector<ParsedCommand> groupRedirs(numCmds);
+    std::vector<std::vector<int>> groupRedirFds(numCmds);
+    std::vector<int> mergeFds;
+    for (int i = 0; i < numCmds; i++) {
+        if (!pipeline[i].isGroup()) continue;
+        const std::vector<Redirection>& redirs = pipeline[i].redirections;
+        if (!pipeline[i].lineMerge) {
+            groupRedirs[i].redirections = redirs;
+            groupRedirFds[i] = groupPreopened[i];
+            continue;
+        }
+        
+        // Follow fd 1 (and the fds it may be copied from) through the shell's fds
+        std::map<int, int> view;
+        view[1] = i < numCmds - 1 ? pipefds[i][1] : STDOUT_FILENO;
+        for (size_t k = 0; k < redirs.size(); k++) {
+            const Redirection& r = redirs[k];
+            int target = r.type == REDIR_OPEN ? groupPreopened[i][k]
+                       : r.type == REDIR_DUP ? (view.count(r.srcFd) ? view[r.srcFd] : r.srcFd)
+                       : -1;
+            view[r.fd] = target;
+            if (r.fd == 1) continue;
+            groupRedirs[i].redirections.push_back(r);
+            groupRedirFds[i].push_back(groupPreopened[i][k]);
+        }
+        
+        std::vector<int> writeFds;
+        if (view[1] < 0 || !startLineMerge(view[1], pipeline[i].group.size(), writeFds, relayIds)) {
+            if (view[1] < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: 1: " << strerror(EBADF) << COLOR_RESET << "\n";
+            }
+            for (int fd : mergeFds) close(fd);
+            for (auto& fds : pipefds) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            closeAllPreopened();
+            return 1;
+        }
+        size_t m = 0;
+        for (auto& proc : procs) {
+            if (proc.stage == i) proc.mergeFd = writeFds[m++];
+        }
+        mergeFds.insert(mergeFds.end(), writeFds.begin(), writeFds.end());
+    }
+    
+    pid_t pgid = 0;
+    std::cout.flush();  // Not written twice by a script run in a copy of the shell
+    
+    // Fork and execute each process
+    for (size_t p = 0; p < procs.size(); p++) {
+        int i = procs[p].stage;
+        const ParsedCommand& cmd = *procs[p].cmd;
+        pid_t pid = fork();
+        
+        if (pid < 0) {
+            // Stages already started see their pipes close and end
+            std::cerr << COLOR_ERROR << "tinyshell: fork failed" << COLOR_RESET << "\n";
+            for (auto& fds : pipefds) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            for (int fd : mergeFds) close(fd);
+            closeAllPreopened();
+            return 1;
+        }
+        else if (pid == 0) {
+            // Child Process
+            
+            // Set process group
+            if (p == 0) {
+                // First process becomes group leader
+                setpgid(0, 0);
+                if (!isBackground) {
+                    tcsetpgrp(shell_terminal, getpid());
+                }
+            } else {
+                // Join the group
+                setpgid(0, pgid);
+            }
+            
+            // Set default signal handlers
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            
+            // Setup pipes
+            if (i > 0) {
+                dup2(pipefds[i-1][0], STDIN_FILENO);
+            }
+            
+            if (i < numCmds - 1) {
+                dup2(pipefds[i][1], STDOUT_FILENO);
+            }
+            if (procs[p].mergeFd >= 0) {
+                dup2(procs[p].mergeFd, STDOUT_FILENO);
+            }
+            
+            // Close all pipe fds
+            for (int j = 0; j < numCmds - 1; j++) {
+                close(pipefds[j][0]);
+                close(pipefds[j][1]);
+            }
+            
+            // Handle redirections: the group's first, then the member's own
+            if (pipeline[i].isGroup()) {
+                setupRedirections(groupRedirs[i], preflight ? &groupRedirFds[i] : nullptr);
+            }
+            setupRedirections(cmd, preflight ? &procs[p].preopened : nullptr);
+            
+            // Execute what the shell resolved
+            if (procs[p].function) {
+                runFunctionInChild(*procs[p].function, cmd.args);
+            }
+            if (procs[p].location.selfScript) {
+                runScriptInChild(procs[p].location, cmd.args);
+            }
+            char** argv = vectorToArgv(cmd.args);
+            execLocated(procs[p].location, argv, environ);
+            
+            std::cerr << COLOR_ERROR << "tinyshell: execve failed" << COLOR_RESET << "\n";
+            exit(1);
+        }
+        else {
+            // Parent process
+            if (p == 0) {
+                pgid = pid;
+            }
+            setpgid(pid, pgid);
+            pids.push_back(pid);
+        }
+    }
+    
+    // Parent: close all pipes
+    for (int i = 0; i < numCmds - 1; i++) {
+        close(pipefds[i][0]);
+        close(pipefds[i][1]);
+    }
+    for (int fd : mergeFds) {
+        close(fd);
+    }
+    closeAllPreopened();
+    
+    // Build command string for job
+    std::string cmdString;
+    for (size_t i = 0; i < pipeline.size(); i++) {
+        if (i > 0) cmdString += " | ";
+        cmdString += describeStage(pipeline[i]);
+    }
+    
     if (isBackground) {
         // Background execution
-        addJob(pgid, cmdString, RUNNING, pids);
-    } else {
-        // Foreground execution
-        tcsetpgrp(shell_terminal, pgid);
-        
-        int status;
-        pid_t wait_result;
-        bool pipeline_stopped = false;
-        
-        // Wait for all children
-        for (int i = 0; i < numCmds; i++) {
-            while ((wait_result = waitpid(-pgid, &status, WUNTRACED)) > 0) {
-                if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    continue;
-                } else if (WIFSTOPPED(status)) {
-                    // Pipeline was stopped
-                    addJob(pgid, cmdString, STOPPED, pids);
-                    
-                    // Get the job we just added to print status
-                    Job* job = getJobByPgid(pgid);
-                    if (job) {
-                        std::cout << "\n[" << job->jobId << "]";
-                        if (job->is_current) {
-                            std::cout << "+";
-                        } else {
-                            std::cout << " ";
-                        }
-                        std::cout << " Stopped         " << job->command << std::endl;
-                    }
-                    pipeline_stopped = true;  // Set flag
-                    break;
+        addJob(pgid, cmdString, RUNNING, pids, relayIds);
+        return 0;
+    }
+    size_t lastStagePids = 0;
+    for (const auto& proc : procs) {
+        if (proc.stage == numCmds - 1) lastStagePids++;
+    }
+    return waitForeground(pgid, cmdString, pids, relayIds, lastStagePids);
+}
+
+// Built-in: dag file - run a pipeline graph as one job
+int builtin_dag(const ParsedCommand& cmd) {
+    if (cmd.args.size() != 2) {
+        std::cerr << COLOR_ERROR << "tinyshell: dag: usage: dag file" << COLOR_RESET << "\n";
+        return 2;
+    }
+    const std::string& path = cmd.args[1];
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << COLOR_ERROR << "tinyshell: dag: " << path << ": " << strerror(errno)
+                  << COLOR_RESET << "\n";
+        return 1;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    std::vector<DagStage> stages;
+    std::string error;
+    if (!parseDag(text.str(), stages, error)) {
+        std::cerr << COLOR_ERROR << "tinyshell: dag: " << path << ": " << error << COLOR_RESET << "\n";
+        return 2;
+    }
+    for (auto& stage : stages) {
+        if (!expandCommand(stage.command)) return 1;
+    }
+    size_t count = stages.size();
+    
+    // Every command must exist before anything is started
+    std::vector<CommandLocation> locations(count);
+    bool found = true;
+    for (size_t s = 0; s < count; s++) {
+        if (!locateCommand(stages[s].command.args[0], locations[s])) {
+            reportCommandNotFound(stages[s].command.args[0]);
+            found = false;
+        }
+    }
+    if (!found) {
+        return 127;
+    }
+    
+    // Redirection targets and relays of the stages, like in a pipeline
+    std::vector<std::vector<int>> preopened(count);
+    std::vector<int> relayIds;
+    bool preflight = shellOptions.preflight;
+    for (const auto& stage : stages) {
+        preflight = preflight || hasRelays(stage.command.redirections);
+    }
+    for (size_t s = 0; s < count && preflight; s++) {
+        const std::vector<Redirection>& redirs = stages[s].command.redirections;
+        if (!preflightRedirections(redirs, preopened[s]) || !startRelays(redirs, preopened[s], relayIds)) {
+            for (auto& fds : preopened) closePreopened(fds);
+            return 1;
+        }
+    }
+    
+    // Every pipe first, so a failure starts nothing: one per edge, sized as
+    // requested, plus one in front of each fan-in and behind each fan-out
+    std::vector<int> created;
+    auto newPipe = [&created](int fds[2]) {
+        if (pipe2(fds, O_CLOEXEC) < 0) return false;
+        created.push_back(fds[0]);
+        created.push_back(fds[1]);
+        return true;
+    };
+    std::vector<std::vector<int>> edgeIn(count);    // Read ends of a stage's input edges
+    std::vector<std::vector<int>> edgeOut(count);   // Write ends of a stage's output edges
+    std::vector<int> stageIn(count, -1);            // The stage's stdin, -1: the shell's
+    std::vector<int> stageOut(count, -1);           // The stage's stdout, -1: the shell's
+    std::vector<int> fanInFd(count, -1);            // Write end of a fan-in's pipe
+    std::vector<int> fanOutFd(count, -1);           // Read end of a fan-out's pipe
+    bool ok = true;
+    for (size_t s = 0; s < count && ok; s++) {
+        for (const auto& edge : stages[s].inputs) {
+            int fds[2];
+            if (!(ok = newPipe(fds))) break;
+            if (edge.bufferSize > 0 &&
+                fcntl(fds[1], F_SETPIPE_SZ, (int)std::min(edge.bufferSize, 1ULL << 30)) < 0) {
+                std::cerr << COLOR_ERROR << "tinyshell: dag: " << stages[edge.from].name << " -> "
+                          << stages[s].name << ": buffer size: " << strerror(errno) << COLOR_RESET << "\n";
+            }
+            edgeIn[s].push_back(fds[0]);
+            edgeOut[edge.from].push_back(fds[1]);
+        }
+    }
+    for (size_t s = 0; s < count && ok; s++) {
+        int fds[2];
+        if (edgeIn[s].size() == 1) {
+            stageIn[s] = edgeIn[s][0];
+        } else if (edgeIn[s].size() > 1 && (ok = newPipe(fds))) {
+            stageIn[s] = fds[0];
+            fanInFd[s] = fds[1];
+        }
+        if (edgeOut[s].size() == 1) {
+            stageOut[s] = edgeOut[s][0];
+        } else if (ok && edgeOut[s].size() > 1 && (ok = newPipe(fds))) {
+            stageOut[s] = fds[1];
+            fanOutFd[s] = fds[0];
+        }
+    }
+    if (!ok) {
+        std::cerr << COLOR_ERROR << "tinyshell: dag: pipe failed: " << strerror(errno) << COLOR_RESET << "\n";
+        for (int fd : created) close(fd);
+        for (auto& fds : preopened) closePreopened(fds);
+        return 1;
+    }
+    
+    // Junctions take over their fds
+    for (size_t s = 0; s < count; s++) {
+        if (fanInFd[s] >= 0) {
+            relayIds.push_back(startFanIn(edgeIn[s], fanInFd[s], "merge " + stages[s].name));
+        }
+        if (fanOutFd[s] >= 0) {
+            relayIds.push_back(startFanOut(fanOutFd[s], edgeOut[s], "tee " + stages[s].name));
+        }
+    }
+    
+    // Fork every stage into one process group
+    bool isBackground = cmd.isBackground;
+    std::cout.flush();
+    std::vector<pid_t> pids;
+    pid_t pgid = 0;
+    for (size_t s = 0; s < count; s++) {
+        const ParsedCommand& stageCmd = stages[s].command;
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << COLOR_ERROR << "tinyshell: fork failed" << COLOR_RESET << "\n";
+            break;
+        }
+        if (pid == 0) {
+            if (s == 0) {
+                setpgid(0, 0);
+                if (!isBackground) {
+                    tcsetpgrp(shell_terminal, getpid());
                 }
+            } else {
+                setpgid(0, pgid);
             }
-            if (pipeline_stopped) {
-                break;
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            
+            // Every other pipe fd is O_CLOEXEC
+            if (stageIn[s] >= 0) dup2(stageIn[s], STDIN_FILENO);
+            if (stageOut[s] >= 0) dup2(stageOut[s], STDOUT_FILENO);
+            setupRedirections(stageCmd, preflight ? &preopened[s] : nullptr);
+            
+            if (locations[s].selfScript) {
+                runScriptInChild(locations[s], stageCmd.args);
             }
+            char** argv = vectorToArgv(stageCmd.args);
+            execLocated(locations[s], argv, environ);
+            std::cerr << COLOR_ERROR << "tinyshell: execve failed" << COLOR_RESET << "\n";
+            exit(1);
         }
-        
-        // Restore terminal control
-        tcsetpgrp(shell_terminal, shell_pgid);
+        if (s == 0) {
+            pgid = pid;
+        }
+        setpgid(pid, pgid);
+        pids.push_back(pid);
     }
     
-    return 0;
+    // The shell keeps no pipe end: end of file reaches every stage
+    for (size_t s = 0; s < count; s++) {
+        if (stageIn[s] >= 0) close(stageIn[s]);
+        if (stageOut[s] >= 0) close(stageOut[s]);
+        closePreopened(preopened[s]);
+    }
+    if (pids.empty()) {
+        return 1;
+    }
+    
+    std::string cmdString = "dag " + path;
+    if (isBackground) {
+        addJob(pgid, cmdString, RUNNING, pids, relayIds);
+        return 0;
+    }
+    return waitForeground(pgid, cmdString, pids, relayIds, 0);
 }
 
 void displayPrompt() {
@@ -648,39 +1921,35 @@ void displayPrompt() {
     std::cout.flush();
 }
 
-int main() {
-    std::string line;
-    
-    // CRITICAL: Initialize shell BEFORE anything else
-    init_shell();
+void displayContinuationPrompt() {
+    std::cout << COLOR_PROMPT << "> " << COLOR_RESET;
+    std::cout.flush();
+}
+
+bool executeList(ParsedList& list) {
+    if (!list.error.empty()) {
+        std::cerr << COLOR_ERROR << "tinyshell: syntax error: " << list.error << COLOR_RESET << "\n";
+        lastStatus = 2;
+        return true;
+    }
     
-    std::cout << "=======================================  _____ _____ _____           _____ _____ _____ _____ \n";
-    std::cout << "  Welcome to TinyShell                  |   __|     |   __|   ___   |  _  |  |  |_   _|  |  |\n";
-    std::cout << "  Type 'exit' or press Ctrl+D to quit   |   __|   --|   __|  |___|  |     |  |  | | | |     |\n";
-    std::cout << "======================================= |_____|_____|_____|         |__|__|_____| |_| |__|__|\n\n";
+    for (auto& pipeline : list.pipelines) {
+        // a && b, a || b: skipped pipelines are not expanded and keep $?
+        if ((pipeline.runIf == RUN_IF_TRUE && lastStatus != 0) ||
+            (pipeline.runIf == RUN_IF_FALSE && lastStatus == 0)) {
+            continue;
+        }
 
-    while (true) {
-        // Check for job status changes before prompt
-        check_job_status_changes();
-        
-        displayPrompt();
-        
-        if (!std::getline(std::cin, line)) {
-            std::cout << "\nExiting TinyShell...\n";
-            break;
+        // Expand right before running, so earlier commands of the list count
+        bool expanded = true;
+        for (auto& cmd : pipeline.commands) {
+            expanded = expanded && expandCommand(cmd);
         }
-        
-        if (line.empty() || line.find_first_not_of(" \t") == std::string::npos) {
+        if (!expanded) {
+            lastStatus = 1;
             continue;
         }
         
-        // Parse command line
-        std::vector<std::string> tokens = tokenize(line);
-        if (tokens.empty()) continue;
-        
-        ParsedPipeline pipeline = parseCommandLine(tokens);
-        if (pipeline.commands.empty()) continue;
-        
         // Propagate background flag to all commands in pipeline
         if (pipeline.isBackground) {
             for (auto& cmd : pipeline.commands) {
@@ -688,21 +1957,259 @@ int main() {
             }
         }
         
-        // Check for exit command
+        // Check for exit command: exit [n], the shell's status is n or that of the last command
         for (const auto& cmd : pipeline.commands) {
             if (!cmd.args.empty() && cmd.args[0] == "exit") {
-                std::cout << "Exiting TinyShell...\n";
-                return 0;
+                if (cmd.args.size() > 1) {
+                    char* end;
+                    long code = strtol(cmd.args[1].c_str(), &end, 10);
+                    if (cmd.args[1].empty() || *end != '\0') {
+                        std::cerr << COLOR_ERROR << "tinyshell: exit: " << cmd.args[1]
+                                  << ": numeric argument required" << COLOR_RESET << "\n";
+                        code = 2;
+                    }
+                    lastStatus = (int)(code & 0xff);
+                }
+                return false;
             }
         }
         
         // Execute
-        if (!pipeline.hasPipes) {
-            executeCommand(pipeline.commands[0]);
+        if (!pipeline.hasPipes && !pipeline.commands[0].isGroup()) {
+            lastStatus = executeCommand(pipeline.commands[0]);
         } else {
-            executePipeline(pipeline.commands);
+            lastStatus = executePipeline(pipeline.commands);
         }
     }
+    return true;
+}
+
+// Read up to the end of one line, a byte at a time so the rest stays in the pipe
+static ssize_t readLineChunk(int fd, char* buf, size_t size) {
+    size_t n = 0;
+    while (n < size) {
+        ssize_t r = read(fd, buf + n, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return n > 0 ? (ssize_t)n : r;
+        if (buf[n++] == '\n') break;
+    }
+    return n;
+}
+
+/**
+ * Read, parse and run commands until end of input or exit
+ * 
+ * @param fd Where the commands come from
+ * @param interactive Show prompts and the exit message
+ * @return Exit status of the shell
+ */
+static int runInput(int fd, bool interactive) {
+    IncrementalParser parser;
+    ParsedList list;
+    static char input[65536];
     
-    return 0;
-}
\ No newline at end of file
+    // Commands read the shell's stdin too (read, cat) and must find the
+    // input after their line: a file is read in chunks, with the offset moved
+    // back to the end of the line while its commands run, a pipe up to the
+    // end of a line only
+    struct stat st;
+    bool shared = fd == STDIN_FILENO && !interactive;
+    bool seekable = shared && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    bool byLine = shared && !seekable;
+    
+    while (true) {
+        // Run every command list that is already complete
+        int status;
+        while ((status = parser.next(list)) != PARSE_NEED_MORE) {
+            if (status == PARSE_ERROR) {
+                std::cerr << COLOR_ERROR << "tinyshell: unexpected end of line (unterminated quote or escape)"
+                          << COLOR_RESET << "\n";
+                continue;
+            }
+            off_t ahead = seekable ? (off_t)parser.unparsed() : 0;
+            off_t resume = ahead > 0 ? lseek(fd, -ahead, SEEK_CUR) : -1;
+            bool more = executeList(list);
+            if (resume >= 0) {
+                // Untouched by the commands: go on with the buffered input
+                if (lseek(fd, 0, SEEK_CUR) == resume) {
+                    lseek(fd, ahead, SEEK_CUR);
+                } else {
+                    parser.dropUnparsed();
+                }
+            }
+            if (!more) {
+                if (interactive) std::cout << "Exiting TinyShell...\n";
+                return lastStatus;
+            }
+        }
+        
+        // Check for job status changes before prompt
+        check_job_status_changes();
+        
+        if (interactive) {
+            if (parser.isContinuing()) {
+                displayContinuationPrompt();
+            } else {
+                displayPrompt();
+            }
+        }
+        
+        // Input is consumed in chunks, lines are cut by the parser
+        ssize_t n = byLine ? readLineChunk(fd, input, sizeof(input)) : read(fd, input, sizeof(input));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            status = parser.finish(list);
+            if (status == PARSE_ERROR) {
+                std::cerr << COLOR_ERROR << "\ntinyshell: unexpected end of file (unterminated quote or escape)"
+                          << COLOR_RESET << "\n";
+            } else if (status == PARSE_LIST && !executeList(list)) {
+                if (interactive) std::cout << "Exiting TinyShell...\n";
+                return lastStatus;
+            }
+            if (interactive) std::cout << "\nExiting TinyShell...\n";
+            break;
+        }
+        parser.feed(input, n);
+    }
+    
+    return lastStatus;
+}
+
+// Run a script file as a non-interactive shell
+static int runScript(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << COLOR_ERROR << "tinyshell: " << path << ": " << strerror(errno) << COLOR_RESET << "\n";
+        return 127;
+    }
+    int status = runInput(fd, false);
+    close(fd);
+    return status;
+}
+
+/**
+ * Close in a forked copy of the shell what execve() would have closed
+ * The cached PATH directories stay open. Without this a stage run in the
+ * copy keeps other stages' pipe ends, relay write ends and the coprocess
+ * pipes open, and their readers see EOF late or never.
+ */
+static void closeOnExecFds() {
+    DIR* fds = opendir("/proc/self/fd");
+    if (!fds) return;
+    std::vector<int> cloexec;
+    while (struct dirent* entry = readdir(fds)) {
+        int fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(fds) && !isPathDirFd(fd) &&
+            (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+            cloexec.push_back(fd);
+        }
+    }
+    closedir(fds);
+    for (int fd : cloexec) close(fd);
+}
+
+/**
+ * Run a script for this shell in a forked child, instead of execve()
+ * The child drops what a new tinyshell would not have (jobs, coprocess,
+ * relays, shell variables and options, close-on-exec fds) and keeps the
+ * caches: PATH directories, lookups and #! checks. $1, $2, ... are the
+ * arguments after the script's name, and the child exits with its status.
+ */
+static void runScriptInChild(const CommandLocation& location, const std::vector<std::string>& args) {
+    jobTable.clear();
+    finishedJobs.clear();
+    nextJobId = 1;
+    job_status_changed = 0;
+    coprocess = Coprocess();
+    shellVariables.clear();
+    positionalParameters.assign(args.begin() + 1, args.end());
+    lastStatus = 0;
+    clearDefinitions();
+    shellOptions = ShellOptions();
+    resetRelaysAfterFork();
+    closeOnExecFds();
+    
+    init_shell();
+    loadRcFile();
+    exit(runScript(location.path));
+}
+
+// Run the commands of tinyshell -c, as a non-interactive shell
+static int runString(const std::string& text) {
+    IncrementalParser parser;
+    ParsedList list;
+    parser.feed(text.data(), text.size());
+    
+    int status;
+    while ((status = parser.next(list)) != PARSE_NEED_MORE) {
+        if (status == PARSE_ERROR) {
+            std::cerr << COLOR_ERROR << "tinyshell: unexpected end of line (unterminated quote or escape)"
+                      << COLOR_RESET << "\n";
+            continue;
+        }
+        if (!executeList(list)) return lastStatus;
+    }
+    status = parser.finish(list);
+    if (status == PARSE_ERROR) {
+        std::cerr << COLOR_ERROR << "tinyshell: unexpected end of string (unterminated quote or escape)"
+                  << COLOR_RESET << "\n";
+        return 2;
+    }
+    if (status == PARSE_LIST) executeList(list);
+    return lastStatus;
+}
+
+/**
+ * Run a function in a forked child (pipeline stage, redirected or in the
+ * background), like a subshell: it keeps variables, aliases and functions,
+ * while the jobs, the coprocess, the terminal and the close-on-exec fds
+ * stay with the parent.
+ */
+static void runFunctionInChild(const FunctionBody& body, const std::vector<std::string>& args) {
+    jobTable.clear();
+    finishedJobs.clear();
+    nextJobId = 1;
+    job_status_changed = 0;
+    coprocess = Coprocess();
+    resetRelaysAfterFork();
+    closeOnExecFds();
+    shell_is_interactive = false;
+    shell_terminal = -1;
+    std::cout.flush();
+    exit(callFunction(body, args));
+}
+
+int main(int argc, char* argv[]) {
+    // CRITICAL: Initialize shell BEFORE anything else
+    init_shell();
+    loadRcFile();
+    
+    // tinyshell -c 'commands': no banner, no prompts
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            std::cerr << COLOR_ERROR << "tinyshell: -c: option requires an argument" << COLOR_RESET << "\n";
+            return 2;
+        }
+        return runString(argv[2]);
+    }
+    
+    // tinyshell script [args]: no banner, no prompts
+    if (argc > 1) {
+        positionalParameters.assign(argv + 2, argv + argc);
+        return runScript(argv[1]);
+    }
+    
+    // Input from a pipe or file is read like a script
+    if (!shell_is_interactive) {
+        return runInput(STDIN_FILENO, false);
+    }
+    
+    std::cout << "=======================================  _____ _____ _____           _____ _____ _____ _____ \n";
+    std::cout << "  Welcome to TinyShell                  |   __|     |   __|   ___   |  _  |  |  |_   _|  |  |\n";
+    std::cout << "  Type 'exit' or press Ctrl+D to quit   |   __|   --|   __|  |___|  |     |  |  | | | |     |\n";
+    std::cout << "======================================= |_____|_____|_____|         |__|__|_____| |_| |__|__|\n\n";
+
+    return runInput(STDIN_FILENO, true);
+}
@@ -21,6 +21,29 @@
 #define COLOR_ERROR "\033[1;31m"
 #define COLOR_INFO "\033[1;36m"
 
+/**
+ * Structure holding the shell options changed with set -o / set +o
+ */
+struct ShellOptions {
+    bool preflight = false;     // Open redirection targets in the shell before forking
+    bool teardown = false;      // End the other stages once a pipeline's last stage exits
+};
+
+// Global shell options
+extern ShellOptions shellOptions;
+
+/**
+ * Structure holding the shell's end of the coprocess pipes (coproc builtin)
+ */
+struct Coprocess {
+    pid_t pid = -1;         // Process of the coprocess, -1 if there is none
+    int writeFd = -1;       // Writes go to the coprocess's stdin (>&p)
+    int readFd = -1;        // Reads come from the coprocess's stdout (<&p, read -p)
+};
+
+// The current coprocess
+extern Coprocess coprocess;
+
 /**
  * Search for executable in PATH environment variable
  * 
@@ -30,11 +53,37 @@
 std::string findInPath(const std::string& command);
 
 /**
- * Setup input/output/error redirections for a command
+ * Setup the redirections of a command (child after fork)
+ * Plans a minimal dup2/open/close sequence and applies it, exits on failure
+ * 
+ * @param cmd Parsed command structure
+ * @param preopened Optional fds opened by preflightRedirections() in the shell
+ */
+void setupRedirections(const ParsedCommand& cmd, const std::vector<int>* preopened = nullptr);
+
+/**
+ * Start a command with posix_spawn instead of fork + execve
+ * Used when no terminal handover is needed in the child and the
+ * redirections can be expressed as posix_spawn file actions
  * 
+ * @param execPath Resolved path of the executable
+ * @param argv Argument vector
  * @param cmd Parsed command structure
+ * @param preopened Optional fds opened by preflightRedirections() in the shell
+ * @param pid Output: PID of the new process
+ * @return 0 on success, ENOTSUP if the fork path must be used, or an errno value
  */
-void setupRedirections(const ParsedCommand& cmd);
+int spawnCommand(const std::string& execPath, char** argv, const ParsedCommand& cmd,
+                 const std::vector<int>* preopened, pid_t& pid);
+
+/**
+ * Prepare a parsed command to run: expand variable references in the
+ * arguments and file names, and replace N>&p / N<&p by the coprocess fds
+ * 
+ * @param cmd Command to update (group members included)
+ * @return false if the command refers to a coprocess that does not exist
+ */
+bool expandCommand(ParsedCommand& cmd);
 
 /**
  * Execute a single command with redirections
@@ -52,11 +101,24 @@ int executeCommand(const ParsedCommand& cmd);
  */
 int executePipeline(const std::vector<ParsedCommand>& pipeline);
 
+/**
+ * Execute every pipeline of a command list in order
+ * 
+ * @param list Parsed command list
+ * @return false if the shell should exit
+ */
+bool executeList(ParsedList& list);
+
 /**
  * Display the shell prompt
  */
 void displayPrompt();
 
+/**
+ * Display the prompt for the rest of an unfinished line (open quote or trailing backslash)
+ */
+void displayContinuationPrompt();
+
 /**
  * Initialize the shell environment
  * Sets up signal handlers and terminal control
@@ -84,6 +146,14 @@ void sigtstp_handler(int sig);
  */
 void sigint_handler(int sig);
 
+/**
+ * Print the checksums of a command's output relays
+ * The relays' statistics are dropped afterwards.
+ * 
+ * @param relayIds Ids from startRelays()
+ */
+void reportRelayChecksums(const std::vector<int>& relayIds);
+
 /**
  * Check and update status changes for all background jobs
  * Notifies user of completed or stopped jobs
@@ -108,9 +178,178 @@ int builtin_bg(const std::vector<std::string>& args);
 
 /**
  * Built-in command: jobs - list all jobs
+ * jobs --stats also lists the output relays of every job with their
+ * progress and checksum; those of a finished job, with the final digest,
+ * once after it was reported as Done
+ * 
+ * @param args Command arguments
+ * @return Exit code
+ */
+int builtin_jobs(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: coproc - start a command as the coprocess
+ * Its stdin and stdout are pipes held by the shell, used with >&p, <&p
+ * and read -p. It runs as a background job.
+ * 
+ * @param cmd Parsed command (args[0] is "coproc")
+ * @return Exit code
+ */
+int builtin_coproc(const ParsedCommand& cmd);
+
+/**
+ * Built-in command: read - read a line into variables
+ * read [-r] [-p] [-u fd] [name...]: the line is split on whitespace, the
+ * last name gets the rest (default name REPLY). Input is fd 0 after the
+ * command's own < or <& redirection, the coprocess with -p or fd with -u.
+ * 
+ * @param cmd Parsed command (args[0] is "read")
+ * @return 0, or 1 at end of file
+ */
+int builtin_read(const ParsedCommand& cmd);
+
+/**
+ * Built-in command: echo - print the arguments separated by spaces
+ * echo [-n] [-e|-E]: -n leaves out the newline, -e decodes backslash
+ * escapes. The whole line goes out with one write().
+ * 
+ * @param cmd Parsed command (args[0] is "echo")
+ * @return 0, or 1 if the output failed
+ */
+int builtin_echo(const ParsedCommand& cmd);
+
+/**
+ * Built-in command: printf - print arguments with a format
+ * The format is compiled once and cached; it is used again while
+ * arguments are left. Output is buffered into a single write().
+ * 
+ * @param cmd Parsed command (args[0] is "printf", args[1] the format)
+ * @return 0, or 1 if an argument was not a number or the output failed
+ */
+int builtin_printf(const ParsedCommand& cmd);
+
+/**
+ * Built-in command: test and [ - evaluate a condition
+ * Files, strings and integers with -a, -o, ! and parentheses; [ needs a
+ * closing ] as its last argument. File tests of one evaluation share
+ * their stat() calls.
+ * 
+ * @param args Command arguments
+ * @return 0 if true, 1 if false, 2 on a bad expression
+ */
+int builtin_test(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: [[ ... ]] - evaluate an extended condition
+ * Like test with &&, ||, < and > inside (the parser keeps them as words),
+ * == and != match glob patterns and =~ an extended regex.
+ * 
+ * @param args Command arguments, from [[ to ]]
+ * @return 0 if true, 1 if false, 2 on a bad expression
+ */
+int builtin_conditional(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: let - evaluate arithmetic expressions (let i=i+1)
+ * 
+ * @param args Command arguments, one expression each
+ * @return 0 if the last value is not 0, else 1 (also on an error)
+ */
+int builtin_let(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: (( expression )) - evaluate an arithmetic expression
+ * The lexer keeps the expression as one word, so < > & | in it are not
+ * operators.
+ * 
+ * @param args "((", the expression and "))"
+ * @return 0 if the value is not 0, else 1 (also on an error)
+ */
+int builtin_arithmetic(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: dag - run a pipeline graph described in a file
+ * Stages are connected by pipes (sizes per edge), a stage read by several
+ * others is copied with tee/splice and one reading several gets their
+ * lines merged. All stages form one job.
+ * 
+ * @param cmd Parsed command (args[0] is "dag", args[1] the file)
+ * @return Exit code
+ */
+int builtin_dag(const ParsedCommand& cmd);
+
+/**
+ * Built-in command: set - change shell options (set -o name / set +o name)
+ * 
+ * @param args Command arguments
+ * @return Exit code
+ */
+int builtin_set(const std::vector<std::string>& args);
+
+/**
+ * Change a shell option by name (set -o/+o, rc snapshots)
+ * 
+ * @param name Option name, e.g. "preflight"
+ * @param on New value
+ * @return false if there is no such option
+ */
+bool setShellOption(const std::string& name, bool on);
+
+/**
+ * Built-in command: export - put variables into the environment of commands
+ * export NAME=value sets and exports, export NAME exports the current
+ * value; without arguments the environment is listed.
+ * 
+ * @param args Command arguments
+ * @return Exit code
+ */
+int builtin_export(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: alias - define or list aliases
+ * alias name=value defines (the value is lexed once, and spliced in
+ * place of the name when a later line is parsed), alias name prints one
+ * and alias alone prints all.
+ * 
+ * @param args Command arguments
+ * @return Exit code
+ */
+int builtin_alias(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: unalias - remove aliases (unalias -a removes all)
+ * 
+ * @param args Command arguments
+ * @return Exit code
+ */
+int builtin_unalias(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: type - tell how names resolve (alias, function,
+ * builtin or file in PATH); type -t prints only the kind
+ * 
+ * @param args Command arguments
+ * @return 0, or 1 if a name was not found
+ */
+int builtin_type(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: which - print the path of commands (aliases,
+ * functions and builtins are reported as such)
+ * 
+ * @param args Command arguments
+ * @return 0, or 1 if a name was not found
+ */
+int builtin_which(const std::vector<std::string>& args);
+
+/**
+ * Built-in command: command - command -v prints what a name runs (path,
+ * name or alias definition), command -V describes it like type, and
+ * command name args runs name without looking at functions
  * 
+ * @param cmd Parsed command (args[0] is "command")
  * @return Exit code
  */
-int builtin_jobs();
+int builtin_command(const ParsedCommand& cmd);
 
 #endif // TINYSHELL_HPP
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 /**
  * Convert vector of strings to C-style argv array
+ * The array points into the strings themselves, so args must outlive it
+ * and must not be modified while it is in use
  * 
  * @param args Vector of argument strings
  * @return Dynamically allocated argv array (must be freed with freeArgv)
@@ -13,8 +15,7 @@ char** vectorToArgv(const std::vector<std::string>& args) {
     char** argv = new char*[args.size() + 1];
     
     for (size_t i = 0; i < args.size(); ++i) {
-        argv[i] = new char[args[i].length() + 1];
-        strcpy(argv[i], args[i].c_str());
+        argv[i] = const_cast<char*>(args[i].c_str());
     }
     
     argv[args.size()] = nullptr;
@@ -25,12 +26,8 @@ char** vectorToArgv(const std::vector<std::string>& args) {
  * Free memory allocated for argv array
  * 
  * @param argv Array to free
- * @param size Number of elements in array
  */
-void freeArgv(char** argv, size_t size) {
-    for (size_t i = 0; i < size; ++i) {
-        delete[] argv[i];
-    }
+void freeArgv(char** argv) {
     delete[] argv;
 }
 
@@ -0,0 +1,165 @@
+#include "variables.hpp"
+#include "lexer.hpp"
+#include "arith.hpp"
+#include "tinyshell.hpp"
+#include <iostream>
+#include <cstdlib>
+
+std::map<std::string, std::string> shellVariables;
+std::vector<std::string> positionalParameters;
+int lastStatus = 0;
+
+static bool isNameChar(char c, bool first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           (!first && c >= '0' && c <= '9');
+}
+
+// $1 ... $9 take one digit, longer numbers need ${10}
+static size_t referenceEnd(const std::string& word, size_t start) {
+    if (start < word.size() && ((word[start] >= '0' && word[start] <= '9') || word[start] == '#' ||
+                                word[start] == '?')) {
+        return start + 1;
+    }
+    size_t end = start;
+    while (end < word.size() && isNameChar(word[end], end == start)) end++;
+    return end;
+}
+
+// $((expression)) after a mark: position of the closing "))" (the lexer saw it)
+static size_t arithmeticEnd(const std::string& word, size_t start) {
+    int depth = 0;
+    for (size_t i = start + 2; i + 1 < word.size(); i++) {
+        if (word[i] == '(') {
+            depth++;
+        } else if (word[i] == ')') {
+            if (depth == 0) return word[i + 1] == ')' ? i : std::string::npos;
+            depth--;
+        }
+    }
+    return std::string::npos;
+}
+
+static bool isArithmetic(const std::string& word, size_t start) {
+    return word.compare(start, 2, "((") == 0;
+}
+
+std::string getVariable(const std::string& name) {
+    if (name == "#") {
+        return std::to_string(positionalParameters.size());
+    }
+    if (name == "?") {
+        return std::to_string(lastStatus);
+    }
+    if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos) {
+        size_t index = strtoul(name.c_str(), nullptr, 10);
+        return index >= 1 && index <= positionalParameters.size() ? positionalParameters[index - 1] : "";
+    }
+    auto it = shellVariables.find(name);
+    if (it != shellVariables.end()) {
+        return it->second;
+    }
+    const char* value = getenv(name.c_str());
+    return value ? value : "";
+}
+
+void setVariable(const std::string& name, const std::string& value) {
+    shellVariables[name] = value;
+}
+
+void assignVariable(const std::string& name, const std::string& value) {
+    if (shellVariables.find(name) == shellVariables.end() && getenv(name.c_str())) {
+        setenv(name.c_str(), value.c_str(), 1);
+    } else {
+        shellVariables[name] = value;
+    }
+}
+
+void exportVariable(const std::string& name, const std::string& value) {
+    shellVariables.erase(name);
+    setenv(name.c_str(), value.c_str(), 1);
+}
+
+bool isVariableName(const std::string& name) {
+    if (name.empty()) return false;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (!isNameChar(name[i], i == 0)) return false;
+    }
+    return true;
+}
+
+bool isAssignment(const std::string& word) {
+    size_t eq = word.find('=');
+    return eq != std::string::npos && isVariableName(word.substr(0, eq));
+}
+
+bool needsExpansion(const std::string& word) {
+    return word.find(LEX_VAR_MARK) != std::string::npos;
+}
+
+std::string expandWord(const std::string& word, bool& ok) {
+    std::string result;
+    size_t pos = 0;
+    while (true) {
+        size_t mark = word.find(LEX_VAR_MARK, pos);
+        result.append(word, pos, mark == std::string::npos ? std::string::npos : mark - pos);
+        if (mark == std::string::npos) break;
+        
+        // ${NAME}: up to the closing brace, $NAME: the longest name
+        size_t start = mark + 1;
+        size_t end = start;
+        if (isArithmetic(word, start) && (end = arithmeticEnd(word, start)) != std::string::npos) {
+            std::string expression = word.substr(start + 2, end - start - 2);
+            std::string error;
+            long long value = 0;
+            if (!evaluateArithmetic(expression, value, error)) {
+                std::cerr << COLOR_ERROR << "tinyshell: " << expression << ": " << error << COLOR_RESET << "\n";
+                ok = false;
+            }
+            result += std::to_string(value);
+            pos = end + 2;
+            continue;
+        }
+        if (start < word.size() && word[start] == '{') {
+            end = word.find('}', start);
+            if (end == std::string::npos) {
+                result.append("${");    // Unterminated, keep the text
+                pos = start + 1;
+                continue;
+            }
+            result += getVariable(word.substr(start + 1, end - start - 1));
+            pos = end + 1;
+            continue;
+        }
+        end = referenceEnd(word, start);
+        result += getVariable(word.substr(start, end - start));
+        pos = end;
+    }
+    return result;
+}
+
+void referencedVariables(const std::string& word, std::vector<std::string>& names) {
+    // Same rules as expandWord()
+    for (size_t mark = word.find(LEX_VAR_MARK); mark != std::string::npos;
+         mark = word.find(LEX_VAR_MARK, mark + 1)) {
+        size_t start = mark + 1;
+        // Every name in an arithmetic expansion may be a variable
+        size_t end = isArithmetic(word, start) ? arithmeticEnd(word, start) : std::string::npos;
+        if (end != std::string::npos) {
+            for (size_t i = start + 2; i < end; i++) {
+                if (!isNameChar(word[i], true) || isNameChar(word[i - 1], false)) continue;
+                size_t nameEnd = i;
+                while (nameEnd < end && isNameChar(word[nameEnd], false)) nameEnd++;
+                names.push_back(word.substr(i, nameEnd - i));
+                i = nameEnd;
+            }
+            mark = end;
+            continue;
+        }
+        if (start < word.size() && word[start] == '{') {
+            size_t end = word.find('}', start);
+            if (end != std::string::npos) names.push_back(word.substr(start + 1, end - start - 1));
+            continue;
+        }
+        names.push_back(word.substr(start, referenceEnd(word, start) - start));
+    }
+}
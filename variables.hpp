@@ -0,0 +1,92 @@
+#ifndef VARIABLES_HPP
+#define VARIABLES_HPP
+#include <string>
+#include <vector>
+#include <map>
+
+// Shell variables (set by builtins such as read), looked up before the environment
+extern std::map<std::string, std::string> shellVariables;
+
+// Arguments of the running function: $1, $2, ... and their number $#
+extern std::vector<std::string> positionalParameters;
+
+// Exit status of the last command list entry: $?
+extern int lastStatus;
+
+/**
+ * Get the value of a variable
+ * 
+ * @param name Variable name
+ * @return Positional parameter for a number or "#", else shell variable,
+ *         else environment variable, else empty string
+ */
+std::string getVariable(const std::string& name);
+
+/**
+ * Set a shell variable (not exported to commands)
+ * 
+ * @param name Variable name
+ * @param value New value
+ */
+void setVariable(const std::string& name, const std::string& value);
+
+/**
+ * Assign a variable (NAME=value): an exported variable stays exported
+ * 
+ * @param name Variable name
+ * @param value New value
+ */
+void assignVariable(const std::string& name, const std::string& value);
+
+/**
+ * Export a variable to the environment of commands (export NAME=value)
+ * 
+ * @param name Variable name
+ * @param value New value
+ */
+void exportVariable(const std::string& name, const std::string& value);
+
+/**
+ * Check whether a string is a valid variable name ([A-Za-z_][A-Za-z0-9_]*)
+ * 
+ * @param name Name to check
+ * @return true if name can be used as a variable name
+ */
+bool isVariableName(const std::string& name);
+
+/**
+ * Check whether a word is an assignment (NAME=value)
+ * 
+ * @param word Token text
+ * @return true if the text before the first '=' is a variable name
+ */
+bool isAssignment(const std::string& word);
+
+/**
+ * Expand the variable references marked by the lexer ($NAME, ${NAME})
+ * and arithmetic expansions ($((expression)))
+ * Words are not split: a reference expands to exactly one value.
+ * 
+ * @param word Token text with LEX_VAR_MARK marks
+ * @param ok Set to false if an arithmetic expansion failed (reported, it gives 0)
+ * @return Text with every reference replaced by its value
+ */
+std::string expandWord(const std::string& word, bool& ok);
+
+/**
+ * Check whether a word contains variable references
+ * 
+ * @param word Token text
+ * @return true if expandWord() would change it
+ */
+bool needsExpansion(const std::string& word);
+
+/**
+ * Collect the names of the variables a word refers to
+ * 
+ * @param word Token text with LEX_VAR_MARK marks
+ * @param names Output: names are appended in order of appearance
+ */
+void referencedVariables(const std::string& word, std::vector<std::string>& names);
+
+#endif // VARIABLES_HPP